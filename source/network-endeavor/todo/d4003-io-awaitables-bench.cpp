@@ -0,0 +1,542 @@
+// IoAwaitable Protocol - Benchmarks
+//
+// Google Benchmark suite for the primitives of the demo in
+// d4003-io-awaitables.cpp, which it includes. The numbers are
+// meant for comparison with the sender measurements in
+// d4123-cost-of-senders.md on the same hardware.
+//
+// Compile with: -std=c++20 -O2 -pthread -lbenchmark
+//
+// In an executable, thread_local access is a fixed offset from
+// the thread pointer. To see it cost what it costs in a shared
+// library, a call to __tls_get_addr, build this file with
+// -fPIC -shared and link an empty program against the result,
+// which then provides main.
+
+// GCC flags the demo's function-local types once the demo is
+// no longer the main file
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wsubobject-linkage"
+#endif
+
+#define CAPY_NO_DEMO_MAIN
+#include "d4003-io-awaitables.cpp"
+
+#include <benchmark/benchmark.h>
+
+namespace capy {
+namespace bench {
+
+// ============================================================
+// Fixtures
+// ============================================================
+
+inline_context inline_ctx;
+inline_executor inline_ex{&inline_ctx};
+
+task<int> answer()
+{
+    co_return 42;
+}
+
+task<int, use_frame_allocator<pool_frame_allocator>> static_answer()
+{
+    co_return 42;
+}
+
+task<int> chain(int depth)
+{
+    if(depth == 0)
+        co_return 1;
+    co_return co_await chain(depth - 1) + 1;
+}
+
+// Sets the cached frame allocator for the life of a benchmark
+struct cached_allocator
+{
+    std::pmr::memory_resource* saved;
+
+    explicit cached_allocator(std::pmr::memory_resource* mr) noexcept
+        : saved(get_cached_frame_allocator())
+    {
+        set_cached_frame_allocator(mr);
+    }
+
+    ~cached_allocator()
+    {
+        set_cached_frame_allocator(saved);
+    }
+};
+
+// Posts the awaiting coroutine to another executor
+struct hop_to
+{
+    executor_ref ex;
+    continuation c;
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h, io_env const*)
+    {
+        c.h = h;
+        ex.post(c);
+        return std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+};
+
+// ============================================================
+// task<int> creation and completion
+// ============================================================
+
+void BM_task_create_complete(benchmark::State& state)
+{
+    cached_allocator cached(&default_frame_pool());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(run_sync(inline_ex, answer()));
+}
+BENCHMARK(BM_task_create_complete);
+
+// ============================================================
+// Nested co_await, depth 1 to 64
+// ============================================================
+
+void BM_nested_await(benchmark::State& state)
+{
+    cached_allocator cached(&default_frame_pool());
+    auto const depth = static_cast<int>(state.range(0));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(run_sync(inline_ex, chain(depth)));
+    state.SetItemsProcessed(state.iterations() * depth);
+}
+BENCHMARK(BM_nested_await)->RangeMultiplier(2)->Range(1, 64);
+
+// ============================================================
+// executor_ref and any_executor against direct calls
+// ============================================================
+
+void BM_dispatch_direct(benchmark::State& state)
+{
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(inline_ex.dispatch(c));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_dispatch_direct);
+
+void BM_dispatch_executor_ref(benchmark::State& state)
+{
+    executor_ref ex(inline_ex);
+    benchmark::DoNotOptimize(ex);
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(ex.dispatch(c));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_dispatch_executor_ref);
+
+void BM_dispatch_known_executor_ref(benchmark::State& state)
+{
+    known_executor_ref<inline_executor> ex{executor_ref(inline_ex)};
+    benchmark::DoNotOptimize(ex);
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(ex.dispatch(c));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_dispatch_known_executor_ref);
+
+void BM_dispatch_any_executor(benchmark::State& state)
+{
+    any_executor ex(inline_ex);
+    benchmark::DoNotOptimize(ex);
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(ex.dispatch(c));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_dispatch_any_executor);
+
+void BM_post_direct(benchmark::State& state)
+{
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        inline_ex.post(c);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_post_direct);
+
+void BM_post_executor_ref(benchmark::State& state)
+{
+    executor_ref ex(inline_ex);
+    benchmark::DoNotOptimize(ex);
+    continuation c{std::noop_coroutine()};
+    for(auto _ : state)
+    {
+        ex.post(c);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_post_executor_ref);
+
+// ============================================================
+// Synchronous completion
+//
+// An awaitable that is always ready, awaited in a loop: the
+// cost of the await itself, with no suspension.
+// ============================================================
+
+struct ready_value
+{
+    int value;
+
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>, io_env const*) const noexcept {}
+    int await_resume() const noexcept { return value; }
+};
+
+task<> await_ready_values(benchmark::State& state)
+{
+    int sum = 0;
+    for(auto _ : state)
+    {
+        sum += co_await ready_value{1};
+        benchmark::DoNotOptimize(sum);
+    }
+}
+
+void BM_sync_await(benchmark::State& state)
+{
+    run_sync(inline_ex, await_ready_values(state));
+}
+BENCHMARK(BM_sync_await);
+
+// ============================================================
+// this_coro::environment
+// ============================================================
+
+task<> query_environment(benchmark::State& state)
+{
+    for(auto _ : state)
+    {
+        auto env = co_await this_coro::environment;
+        benchmark::DoNotOptimize(env);
+    }
+}
+
+void BM_environment_query(benchmark::State& state)
+{
+    run_sync(inline_ex, query_environment(state));
+}
+BENCHMARK(BM_environment_query);
+
+// ============================================================
+// Frame allocation
+//
+// The same task through the default pool set as the cached
+// allocator, through the fallback taken when none is cached,
+// through new/delete set as the cached allocator, through the
+// default pool as a static allocator, with no trailer, and
+// through a frame_arena, where each frame bumps the pointer
+// forward and back.
+// ============================================================
+
+void BM_frame_cached_pool(benchmark::State& state)
+{
+    cached_allocator cached(&default_frame_pool());
+    for(auto _ : state)
+    {
+        auto t = answer();
+        benchmark::DoNotOptimize(t.handle().address());
+    }
+}
+BENCHMARK(BM_frame_cached_pool);
+
+void BM_frame_uncached(benchmark::State& state)
+{
+    cached_allocator cached(nullptr);
+    for(auto _ : state)
+    {
+        auto t = answer();
+        benchmark::DoNotOptimize(t.handle().address());
+    }
+}
+BENCHMARK(BM_frame_uncached);
+
+void BM_frame_new_delete(benchmark::State& state)
+{
+    cached_allocator cached(std::pmr::new_delete_resource());
+    for(auto _ : state)
+    {
+        auto t = answer();
+        benchmark::DoNotOptimize(t.handle().address());
+    }
+}
+BENCHMARK(BM_frame_new_delete);
+
+void BM_frame_static_pool(benchmark::State& state)
+{
+    for(auto _ : state)
+    {
+        auto t = static_answer();
+        benchmark::DoNotOptimize(t.handle().address());
+    }
+}
+BENCHMARK(BM_frame_static_pool);
+
+void BM_frame_arena(benchmark::State& state)
+{
+    frame_arena arena;
+    cached_allocator cached(&arena);
+    for(auto _ : state)
+    {
+        auto t = answer();
+        benchmark::DoNotOptimize(t.handle().address());
+    }
+}
+BENCHMARK(BM_frame_arena);
+
+// ============================================================
+// Awaited children: task against inline_task
+//
+// A parent awaits two children at once, as task from the
+// cached default pool and as inline_task from operator new.
+// The frames counter is what each inline_task iteration asked
+// the allocator for: 3 without coro_await_elidable, 1 - the
+// parent, which run_sync does not await - where Clang elides
+// the children into it.
+// ============================================================
+
+void BM_task_children(benchmark::State& state)
+{
+    cached_allocator cached(&default_frame_pool());
+    for(auto _ : state)
+        benchmark::DoNotOptimize(run_sync(inline_ex, nested()));
+}
+BENCHMARK(BM_task_children);
+
+void BM_inline_task_children(benchmark::State& state)
+{
+    counting_new_allocator::frames = 0;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(run_sync(inline_ex, inline_nested()));
+    state.counters["frames"] = benchmark::Counter(
+        static_cast<double>(counting_new_allocator::frames),
+        benchmark::Counter::kAvgIterations);
+    std::size_t const expected = CAPY_HAS_CORO_AWAIT_ELIDABLE ? 1 : 3;
+    if(counting_new_allocator::frames !=
+        expected * static_cast<std::size_t>(state.iterations()))
+        state.SkipWithError("unexpected frame count");
+}
+BENCHMARK(BM_inline_task_children);
+
+// ============================================================
+// Trace event
+//
+// One async_trace record into the calling thread's ring: what
+// each suspend, resume, creation and completion costs a build
+// with CAPY_TRACE=1.
+// ============================================================
+
+void BM_trace_record(benchmark::State& state)
+{
+    auto& ring = async_trace::local();
+    std::uint64_t id = async_trace::next_id(ring);
+    for(auto _ : state)
+    {
+        async_trace::record(ring, trace_event::suspend, id, "bench");
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_trace_record);
+
+// ============================================================
+// Posting through a strand
+//
+// A one-thread pool, run on the benchmark thread, resumes 1024
+// posted continuations: posted to it one at a time, linked and
+// posted as one batch, and through a strand, which queues them
+// itself and hands them to the pool in batches.
+// ============================================================
+
+template<class Ex>
+void post_and_run(benchmark::State& state, thread_pool& pool, Ex ex)
+{
+    std::vector<continuation> cs(1024, continuation{std::noop_coroutine()});
+    for(auto _ : state)
+    {
+        for(auto& c : cs)
+            ex.post(c);
+        pool.run();
+    }
+    state.SetItemsProcessed(state.iterations() * cs.size());
+}
+
+void BM_post_pool(benchmark::State& state)
+{
+    thread_pool pool(1);
+    post_and_run(state, pool, pool.get_executor());
+}
+BENCHMARK(BM_post_pool);
+
+void BM_post_batch_pool(benchmark::State& state)
+{
+    thread_pool pool(1);
+    auto ex = pool.get_executor();
+    std::vector<continuation> cs(1024, continuation{std::noop_coroutine()});
+    for(auto _ : state)
+    {
+        for(std::size_t i = 0; i + 1 < cs.size(); ++i)
+            cs[i].next = &cs[i + 1];
+        ex.post_batch(&cs[0]);
+        pool.run();
+    }
+    state.SetItemsProcessed(state.iterations() * cs.size());
+}
+BENCHMARK(BM_post_batch_pool);
+
+void BM_post_strand(benchmark::State& state)
+{
+    thread_pool pool(1);
+    strand_state<thread_pool::executor_type> strand(pool.get_executor());
+    post_and_run(state, pool, strand.get_executor());
+}
+BENCHMARK(BM_post_strand);
+
+// ============================================================
+// channel
+//
+// A producer and a consumer on a one-thread pool pass 1024
+// values through a channel of capacity 0, 1 and 64. A hand-off
+// to a waiting peer resumes it by symmetric transfer; with room
+// in the ring, values pass without a suspension.
+// ============================================================
+
+task<> channel_produce(channel<int>& ch, int n)
+{
+    for(int i = 0; i < n; ++i)
+        (void)co_await ch.send(i);
+    ch.close();
+}
+
+task<> channel_consume(channel<int>& ch)
+{
+    for(;;)
+    {
+        auto [ec, v] = co_await ch.receive();
+        if(ec)
+            co_return;
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+void BM_channel(benchmark::State& state)
+{
+    thread_pool pool(1);
+    auto ex = pool.get_executor();
+    auto const capacity = static_cast<std::size_t>(state.range(0));
+    int const n = 1024;
+    for(auto _ : state)
+    {
+        channel<int> ch(capacity);
+        run_async(ex, channel_consume(ch));
+        run_async(ex, channel_produce(ch, n));
+        pool.run();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_channel)->Arg(0)->Arg(1)->Arg(64);
+
+// ============================================================
+// Uncontended async_mutex
+//
+// co_await lock() on a free mutex and unlock(): one compare-
+// exchange each, with no suspension. std::mutex for comparison.
+// ============================================================
+
+task<> lock_unlock(benchmark::State& state, async_mutex& m)
+{
+    for(auto _ : state)
+    {
+        co_await m.lock();
+        m.unlock();
+    }
+}
+
+void BM_async_mutex_uncontended(benchmark::State& state)
+{
+    async_mutex m;
+    run_sync(inline_ex, lock_unlock(state, m));
+}
+BENCHMARK(BM_async_mutex_uncontended);
+
+void BM_std_mutex_uncontended(benchmark::State& state)
+{
+    std::mutex m;
+    for(auto _ : state)
+    {
+        m.lock();
+        m.unlock();
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_std_mutex_uncontended);
+
+// ============================================================
+// Post ping-pong between two threads
+//
+// A coroutine hops between two single-threaded pools; each
+// iteration is one round trip, two cross-thread posts. With
+// argument 0 the pools park at once, so every hop wakes a
+// thread through the futex; with 1 they use the default idle
+// policy. On a single CPU the default leaves only the yields.
+// ============================================================
+
+task<> ping_pong(benchmark::State& state, executor_ref home, executor_ref away)
+{
+    for(auto _ : state)
+    {
+        co_await hop_to{away, {}};
+        co_await hop_to{home, {}};
+    }
+    away.on_work_finished();
+}
+
+void BM_post_ping_pong(benchmark::State& state)
+{
+    auto const policy = state.range(0) ? idle_policy{} : idle_policy{0, 0};
+    thread_pool home(1, policy);
+    thread_pool away(1, policy);
+    auto home_ex = home.get_executor();
+    auto away_ex = away.get_executor();
+
+    // Keeps the away pool running until the coroutine is done
+    away_ex.on_work_started();
+    std::thread other([&] { away.run(); });
+    run_async(home_ex, ping_pong(state, home_ex, away_ex));
+    home.run();
+    other.join();
+
+    auto const s = away.stats();
+    state.counters["parks"] = benchmark::Counter(
+        static_cast<double>(s.parks), benchmark::Counter::kAvgIterations);
+    state.counters["spins"] = benchmark::Counter(
+        static_cast<double>(s.spins), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_post_ping_pong)->Arg(0)->Arg(1)->UseRealTime();
+
+} // namespace bench
+} // namespace capy
+
+BENCHMARK_MAIN();
@@ -0,0 +1,662 @@
+// IoAwaitable Protocol - Macro-benchmark
+//
+// A TCP echo server and a minimal HTTP/1.1 keep-alive server on
+// task<>, io_uring_context and thread_pool from
+// d4003-io-awaitables.cpp, which it includes, driven by a
+// built-in load generator. Every run reports requests per
+// second and the p50, p99 and p99.9 latency from an HDR-style
+// histogram, for 1, 2, 4 ... N server cores: the numbers for
+// capacity planning that the microbenchmarks cannot give.
+//
+// Two server layouts:
+//
+//   sharded  One io_uring loop per core, each pinned and with
+//            its own SO_REUSEPORT listener: sharded_context.
+//   pool     One io_uring loop does all the I/O. Each request
+//            hops to a thread_pool of N threads to be handled
+//            and back to the loop to be written, two
+//            cross-thread posts per request.
+//
+// The generator runs plain threads with blocking sockets under
+// poll(), outside the code under test, each connection with
+// one request in flight. Its threads take the CPUs after the
+// server's when the process has them, and share the server's
+// otherwise, which then shows in the numbers.
+//
+// Asio-callback and stdexec-sender servers are not part of
+// this file: neither library is in this tree. Built elsewhere
+// against the same generator, they print the same lines, to be
+// set beside these for d4123-cost-of-senders and
+// d4125-field-experience.
+//
+// Linux only. Compile with: -std=c++20 -O2 -pthread
+//
+//   --server echo|http|all      default all
+//   --layout sharded|pool|all   default all
+//   --cores N                   default hardware_concurrency
+//   --connections C             default 64
+//   --clients T                 generator threads, default 2
+//   --seconds S                 per run, default 2
+//   --size B                    echo message bytes, default 64
+
+// GCC flags the demo's function-local types once the demo is
+// no longer the main file
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wsubobject-linkage"
+#endif
+
+#define CAPY_NO_DEMO_MAIN
+#include "d4003-io-awaitables.cpp"
+
+#include <bit>
+#include <cinttypes>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+
+#if defined(__linux__)
+
+#include <netinet/tcp.h>
+
+namespace capy {
+namespace macrobench {
+
+using clock = std::chrono::steady_clock;
+
+// ============================================================
+// latency_histogram - HDR-style log-linear histogram
+//
+// Values below 2^sub_bits nanoseconds get a counter each.
+// Above that, every power of two is split into 2^(sub_bits-1)
+// counters of equal width, so a value is known to within 1 part
+// in 128 from a nanosecond to the top of the 64-bit range, in a
+// fixed table. Recording is an index computation and an
+// increment; histograms from several threads merge by adding
+// their counters. A percentile reports the highest value of the
+// counter it falls in, as HdrHistogram does.
+// ============================================================
+
+class latency_histogram
+{
+public:
+    static constexpr unsigned sub_bits = 8;
+    static constexpr std::size_t exact = std::size_t(1) << sub_bits;
+    static constexpr std::size_t half = exact / 2;
+    static constexpr std::size_t size = exact + (64 - sub_bits) * half;
+
+    void record(std::uint64_t ns) noexcept
+    {
+        ++counts_[index(ns)];
+        ++total_;
+        if(ns > max_)
+            max_ = ns;
+    }
+
+    void merge(latency_histogram const& other) noexcept
+    {
+        for(std::size_t i = 0; i < size; ++i)
+            counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    std::uint64_t count() const noexcept { return total_; }
+
+    std::uint64_t max() const noexcept { return max_; }
+
+    // The value at or below which a fraction q of the values lie
+    std::uint64_t percentile(double q) const noexcept
+    {
+        if(total_ == 0)
+            return 0;
+        auto const target = std::max<std::uint64_t>(1,
+            static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(total_))));
+        std::uint64_t seen = 0;
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            seen += counts_[i];
+            if(seen >= target)
+                return std::min(highest(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    std::vector<std::uint64_t> counts_ = std::vector<std::uint64_t>(size);
+    std::uint64_t total_ = 0;
+    std::uint64_t max_ = 0;
+
+    static std::size_t index(std::uint64_t v) noexcept
+    {
+        if(v < exact)
+            return static_cast<std::size_t>(v);
+        // v lies in [2^(sub_bits+g-1), 2^(sub_bits+g)), g >= 1
+        auto const g = static_cast<unsigned>(std::bit_width(v)) - sub_bits;
+        return exact + (g - 1) * half + static_cast<std::size_t>((v >> g) - half);
+    }
+
+    // The highest value counted by counter i
+    static std::uint64_t highest(std::size_t i) noexcept
+    {
+        if(i < exact)
+            return i;
+        auto const g = (i - exact) / half + 1;
+        std::uint64_t const sub = (i - exact) % half + half;
+        return ((sub + 1) << g) - 1;
+    }
+};
+
+// ============================================================
+// Servers
+//
+// A session reads into a buffer in its frame and answers what
+// it read. Echo writes the bytes back. HTTP answers every
+// complete request in the buffer - a header block ending in an
+// empty line, without a body - with one fixed response, so
+// pipelined requests are answered in one write, and keeps the
+// connection until the client closes it. With a pool, a session
+// handles each read on the pool and writes from the loop.
+// ============================================================
+
+enum class protocol
+{
+    echo,
+    http
+};
+
+enum class layout
+{
+    sharded,
+    pool
+};
+
+constexpr std::string_view http_request =
+    "GET / HTTP/1.1\r\nHost: capy\r\n\r\n";
+
+constexpr std::string_view http_response =
+    "HTTP/1.1 200 OK\r\nContent-Length: 13\r\n"
+    "Content-Type: text/plain\r\n\r\nHello, world!";
+
+task<bool> write_all(io_uring_context& ctx, int fd, char const* p, std::size_t n)
+{
+    while(n > 0)
+    {
+        auto [ec, k] = co_await write_some(ctx, fd, const_buffer(p, n));
+        if(ec)
+            co_return false;
+        p += k;
+        n -= k;
+    }
+    co_return true;
+}
+
+// Counts the complete requests at the front of buf and moves
+// what follows them to the front
+std::size_t take_requests(char* buf, std::size_t& used) noexcept
+{
+    std::string_view const s(buf, used);
+    std::size_t n = 0;
+    std::size_t pos = 0;
+    for(;;)
+    {
+        auto const end = s.find("\r\n\r\n", pos);
+        if(end == std::string_view::npos)
+            break;
+        pos = end + 4;
+        ++n;
+    }
+    std::memmove(buf, buf + pos, used - pos);
+    used -= pos;
+    return n;
+}
+
+task<> echo_session(io_uring_context& ctx, int fd, thread_pool* pool)
+{
+    auto loop_ex = ctx.get_executor();
+    char buf[4096];
+    for(;;)
+    {
+        auto [ec, n] = co_await read_some(ctx, fd, {buf, sizeof(buf)});
+        if(ec)
+            break;
+        if(pool)
+        {
+            co_await switch_to{pool->get_executor(), {}};
+            co_await switch_to{loop_ex, {}};
+        }
+        if(!co_await write_all(ctx, fd, buf, n))
+            break;
+    }
+    ::close(fd);
+}
+
+task<> http_session(io_uring_context& ctx, int fd, thread_pool* pool)
+{
+    auto loop_ex = ctx.get_executor();
+    char buf[4096];
+    std::size_t used = 0;
+    std::string out;
+    for(;;)
+    {
+        auto [ec, n] = co_await read_some(ctx, fd, {buf + used, sizeof(buf) - used});
+        if(ec)
+            break;
+        used += n;
+        if(pool)
+            co_await switch_to{pool->get_executor(), {}};
+        std::size_t const requests = take_requests(buf, used);
+        out.clear();
+        for(std::size_t i = 0; i < requests; ++i)
+            out.append(http_response);
+        if(pool)
+            co_await switch_to{loop_ex, {}};
+        // A header block larger than the buffer
+        if(used == sizeof(buf))
+            break;
+        if(requests && !co_await write_all(ctx, fd, out.data(), out.size()))
+            break;
+    }
+    ::close(fd);
+}
+
+// Accepts until stopped, one session per connection on the loop
+task<> serve(io_uring_context& ctx, int lfd, protocol p, thread_pool* pool)
+{
+    {
+        uring_acceptor acceptor(ctx, lfd);
+        for(;;)
+        {
+            auto [ec, fd] = co_await acceptor.next();
+            if(ec)
+                break;
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if(p == protocol::echo)
+                run_async(ctx.get_executor(), echo_session(ctx, fd, pool));
+            else
+                run_async(ctx.get_executor(), http_session(ctx, fd, pool));
+        }
+    }
+    ::close(lfd);
+}
+
+// ============================================================
+// Load generator
+//
+// The connections are dealt out to the generator threads. Each
+// thread sends a request on every connection it holds, then
+// waits in poll() and sends the next request on a connection
+// as soon as the last byte of its response arrives: a closed
+// loop, whose latency is the time from a send to that last
+// byte. Responses in the first tenth of the run warm the pools
+// and caches and are not recorded. A connection that fails or
+// stalls for a second is counted as an error and dropped.
+// ============================================================
+
+struct options
+{
+    std::vector<protocol> protocols{protocol::echo, protocol::http};
+    std::vector<layout> layouts{layout::sharded, layout::pool};
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned connections = 64;
+    unsigned clients = 2;
+    double seconds = 2;
+    std::size_t size = 64;
+};
+
+struct result
+{
+    latency_histogram latency;
+    double seconds = 0;
+    std::uint64_t errors = 0;
+};
+
+// The CPUs this process may run on
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(::sched_getaffinity(0, sizeof(set), &set) == 0)
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    return cpus;
+}
+
+bool send_all(int fd, std::string_view data) noexcept
+{
+    while(!data.empty())
+    {
+        auto const n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if(n <= 0)
+            return false;
+        data.remove_prefix(static_cast<std::size_t>(n));
+    }
+    return true;
+}
+
+struct client_thread
+{
+    sockaddr_in addr;
+    std::string_view request;
+    std::size_t reply;
+    unsigned connections;
+    clock::time_point record_from;
+    clock::time_point end;
+    int cpu = -1;
+    latency_histogram latency;
+    std::uint64_t errors = 0;
+
+    void run()
+    {
+        if(cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            ::sched_setaffinity(0, sizeof(set), &set);
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<clock::time_point> sent(connections);
+        std::vector<std::size_t> got(connections);
+        for(unsigned i = 0; i < connections; ++i)
+        {
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if(::connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) < 0)
+            {
+                ::close(fd);
+                ++errors;
+                continue;
+            }
+            fds.push_back({fd, POLLIN, 0});
+        }
+        for(std::size_t i = 0; i < fds.size(); ++i)
+        {
+            sent[i] = clock::now();
+            if(!send_all(fds[i].fd, request))
+                drop(fds[i]);
+        }
+
+        char buf[65536];
+        std::size_t open = 0;
+        for(auto& p : fds)
+            open += p.fd >= 0;
+        while(open > 0)
+        {
+            if(::poll(fds.data(), fds.size(), 1000) <= 0)
+                break;
+            for(std::size_t i = 0; i < fds.size(); ++i)
+            {
+                auto& p = fds[i];
+                if(p.fd < 0 || !p.revents)
+                    continue;
+                auto const n = ::recv(p.fd, buf, sizeof(buf), 0);
+                if(n <= 0)
+                {
+                    drop(p);
+                    --open;
+                    continue;
+                }
+                got[i] += static_cast<std::size_t>(n);
+                if(got[i] < reply)
+                    continue;
+                got[i] = 0;
+                auto const now = clock::now();
+                if(now >= record_from)
+                    latency.record(static_cast<std::uint64_t>(
+                        std::chrono::nanoseconds(now - sent[i]).count()));
+                if(now >= end)
+                {
+                    ::close(std::exchange(p.fd, -1));
+                    --open;
+                    continue;
+                }
+                sent[i] = now;
+                if(!send_all(p.fd, request))
+                {
+                    drop(p);
+                    --open;
+                }
+            }
+        }
+        for(auto& p : fds)
+        {
+            if(p.fd >= 0)
+            {
+                drop(p);
+            }
+        }
+    }
+
+    void drop(pollfd& p) noexcept
+    {
+        ::close(std::exchange(p.fd, -1));
+        ++errors;
+    }
+};
+
+result generate(sockaddr_in const& addr, protocol p, unsigned server_cores,
+    options const& o)
+{
+    std::string const echo_message(o.size, 'x');
+    std::string_view const request = p == protocol::echo
+        ? std::string_view(echo_message) : http_request;
+    std::size_t const reply = p == protocol::echo
+        ? echo_message.size() : http_response.size();
+
+    auto const cpus = allowed_cpus();
+    auto const start = clock::now();
+    auto const length = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(o.seconds));
+
+    std::vector<client_thread> clients(o.clients);
+    for(unsigned t = 0; t < o.clients; ++t)
+    {
+        auto& c = clients[t];
+        c.addr = addr;
+        c.request = request;
+        c.reply = reply;
+        c.connections = o.connections / o.clients + (t < o.connections % o.clients);
+        c.record_from = start + length / 10;
+        c.end = start + length;
+        if(cpus.size() > server_cores)
+            c.cpu = cpus[server_cores + t % (cpus.size() - server_cores)];
+    }
+    std::vector<std::thread> threads;
+    for(auto& c : clients)
+        threads.emplace_back([&c] { c.run(); });
+    for(auto& t : threads)
+        t.join();
+
+    result r;
+    r.seconds = std::chrono::duration<double>(length - length / 10).count();
+    for(auto& c : clients)
+    {
+        r.latency.merge(c.latency);
+        r.errors += c.errors;
+    }
+    return r;
+}
+
+// ============================================================
+// Runs
+// ============================================================
+
+sockaddr_in loopback() noexcept
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+result run_sharded(protocol p, unsigned cores, options const& o)
+{
+    sharded_context shards(cores);
+    std::stop_source stop;
+    auto addr = loopback();
+    int first = open_reuseport_listener(addr);
+
+    std::latch listening(static_cast<std::ptrdiff_t>(cores));
+    std::thread server([&] {
+        shards.run([&](sharded_context::shard& s) {
+            auto local = addr;
+            int lfd = s.index() == 0 ? first : open_reuseport_listener(local);
+            run_async(s.get_executor(), stop.get_token(),
+                serve(s.context(), lfd, p, nullptr));
+            listening.count_down();
+        });
+    });
+    listening.wait();
+    auto r = generate(addr, p, cores, o);
+    stop.request_stop();
+    shards.stop();
+    server.join();
+    return r;
+}
+
+result run_pool(protocol p, unsigned cores, options const& o)
+{
+    thread_pool pool(cores);
+    auto pool_ex = pool.get_executor();
+    // Keeps the workers up between requests
+    pool_ex.on_work_started();
+    std::thread workers([&] { pool.run(); });
+
+    io_uring_context ctx;
+    std::stop_source stop;
+    auto addr = loopback();
+    int lfd = open_reuseport_listener(addr);
+    run_async(ctx.get_executor(), stop.get_token(), serve(ctx, lfd, p, &pool));
+    std::thread loop([&] { ctx.run(); });
+
+    auto r = generate(addr, p, cores + 1, o);
+    stop.request_stop();
+    loop.join();
+    pool_ex.on_work_finished();
+    workers.join();
+    return r;
+}
+
+void report(protocol p, layout l, unsigned cores, options const& o, result const& r)
+{
+    auto const us = [&](double q) {
+        return static_cast<double>(r.latency.percentile(q)) / 1000.0;
+    };
+    std::printf("%-4s  %-7s  cores %3u  conns %4u  %10.0f req/s"
+        "  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %9.1f us",
+        p == protocol::echo ? "echo" : "http",
+        l == layout::sharded ? "sharded" : "pool",
+        cores, o.connections,
+        static_cast<double>(r.latency.count()) / r.seconds,
+        us(0.50), us(0.99), us(0.999),
+        static_cast<double>(r.latency.max()) / 1000.0);
+    if(r.errors)
+        std::printf("  errors %" PRIu64, r.errors);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+// 1, 2, 4 ... up to n, and n
+std::vector<unsigned> core_counts(unsigned n)
+{
+    std::vector<unsigned> counts;
+    for(unsigned c = 1; c < n; c *= 2)
+        counts.push_back(c);
+    counts.push_back(n);
+    return counts;
+}
+
+bool parse(int argc, char** argv, options& o)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string_view const arg = argv[i];
+        if(i + 1 == argc)
+            return false;
+        std::string_view const value = argv[++i];
+        auto const number = [&] { return std::strtod(argv[i], nullptr); };
+        if(arg == "--server")
+        {
+            if(value == "echo")
+                o.protocols = {protocol::echo};
+            else if(value == "http")
+                o.protocols = {protocol::http};
+            else if(value != "all")
+                return false;
+        }
+        else if(arg == "--layout")
+        {
+            if(value == "sharded")
+                o.layouts = {layout::sharded};
+            else if(value == "pool")
+                o.layouts = {layout::pool};
+            else if(value != "all")
+                return false;
+        }
+        else if(arg == "--cores")
+            o.cores = static_cast<unsigned>(number());
+        else if(arg == "--connections")
+            o.connections = static_cast<unsigned>(number());
+        else if(arg == "--clients")
+            o.clients = static_cast<unsigned>(number());
+        else if(arg == "--seconds")
+            o.seconds = number();
+        else if(arg == "--size")
+            o.size = static_cast<std::size_t>(number());
+        else
+            return false;
+    }
+    return o.cores > 0 && o.connections > 0 && o.clients > 0 &&
+        o.seconds > 0 && o.size > 0;
+}
+
+} // namespace macrobench
+} // namespace capy
+
+int main(int argc, char** argv)
+{
+    using namespace capy::macrobench;
+
+    options o;
+    if(!parse(argc, argv, o))
+    {
+        std::fprintf(stderr, "usage: %s [--server echo|http|all] "
+            "[--layout sharded|pool|all] [--cores N] [--connections C] "
+            "[--clients T] [--seconds S] [--size B]\n", argv[0]);
+        return 2;
+    }
+    o.clients = std::min(o.clients, o.connections);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::printf("%u connections from %u generator threads, %.1f s per run, "
+        "%u CPUs available\n", o.connections, o.clients, o.seconds,
+        static_cast<unsigned>(allowed_cpus().size()));
+    for(auto p : o.protocols)
+    {
+        for(auto l : o.layouts)
+        {
+            for(unsigned cores : core_counts(o.cores))
+            {
+                auto const r = l == layout::sharded
+                    ? run_sharded(p, cores, o) : run_pool(p, cores, o);
+                report(p, l, cores, o, r);
+            }
+        }
+    }
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::fprintf(stderr, "the macro-benchmark needs io_uring, on Linux\n");
+    return 1;
+}
+
+#endif
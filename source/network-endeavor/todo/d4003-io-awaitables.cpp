@@ -4,28 +4,166 @@
 // Copyright (c) 2025 Vinnie Falco (vinnie.falco@gmail.com)
 // Distributed under the Boost Software License, Version 1.0.
 //
-// Compile with: -std=c++20
+// Compile with: -std=c++20 -pthread
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <concepts>
+#include <condition_variable>
 #include <coroutine>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <exception>
+#include <iterator>
+#include <latch>
+#include <memory>
 #include <memory_resource>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <source_location>
+#include <span>
+#include <stdexcept>
 #include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <type_traits>
-#include <typeinfo>
 #include <utility>
+#include <variant>
+#include <vector>
 
 #include <cstdio>
 
+// Exceptions are used unless the compiler has them turned off
+// or CAPY_HAS_EXCEPTIONS is defined to 0. Without them a task
+// keeps no exception storage and errors that would be thrown
+// terminate instead. CAPY_TRY and CAPY_CATCH fold away to plain
+// blocks so the same code serves both builds.
+#if !defined(CAPY_HAS_EXCEPTIONS)
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define CAPY_HAS_EXCEPTIONS 1
+#else
+#define CAPY_HAS_EXCEPTIONS 0
+#endif
+#endif
+
+// With CAPY_TLS_WRITE_ON_CHANGE, the default, a resume writes
+// the thread's cached frame allocator only when it differs from
+// the value already there; define it to 0 to always write.
+#if !defined(CAPY_TLS_WRITE_ON_CHANGE)
+#define CAPY_TLS_WRITE_ON_CHANGE 1
+#endif
+
+// After CAPY_RESUME_BUDGET awaits in a row that complete without
+// suspending, a task posts itself to its executor so the work
+// queued behind it gets a turn; define it to 0 to never force
+// a yield. co_await this_coro::yield yields by hand.
+#if !defined(CAPY_RESUME_BUDGET)
+#define CAPY_RESUME_BUDGET 128
+#endif
+
+// Define CAPY_FRAME_TELEMETRY to 1 to count task frames per
+// coroutine function; see frame_telemetry.
+#if !defined(CAPY_FRAME_TELEMETRY)
+#define CAPY_FRAME_TELEMETRY 0
+#endif
+
+// Define CAPY_TRACE to 1 to record task creation, suspension,
+// resumption and completion; see async_trace.
+#if !defined(CAPY_TRACE)
+#define CAPY_TRACE 0
+#endif
+
+// Define CAPY_ASYNC_STACK to 1 to keep the logical call stack
+// of every task for backtraces; see async_stack.
+#if !defined(CAPY_ASYNC_STACK)
+#define CAPY_ASYNC_STACK 0
+#endif
+
+// Clang 20 and later can keep the frame of a coroutine awaited
+// at once inside the frame of the coroutine awaiting it, when
+// both return a type marked coro_await_elidable; see inline_task.
+#if !defined(CAPY_HAS_CORO_AWAIT_ELIDABLE)
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::coro_await_elidable)
+#define CAPY_HAS_CORO_AWAIT_ELIDABLE 1
+#endif
+#endif
+#endif
+#if !defined(CAPY_HAS_CORO_AWAIT_ELIDABLE)
+#define CAPY_HAS_CORO_AWAIT_ELIDABLE 0
+#endif
+
+#if CAPY_HAS_CORO_AWAIT_ELIDABLE
+#define CAPY_CORO_AWAIT_ELIDABLE [[clang::coro_await_elidable]]
+#else
+#define CAPY_CORO_AWAIT_ELIDABLE
+#endif
+
+#if CAPY_HAS_EXCEPTIONS
+#define CAPY_TRY try
+#define CAPY_CATCH(x) catch(x)
+#define CAPY_RETHROW throw
+#else
+#define CAPY_TRY if(true)
+#define CAPY_CATCH(x) else if(false)
+#define CAPY_RETHROW ((void)0)
+#endif
+
+#if defined(__linux__)
+#define CAPY_REACTOR_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__)
+#define CAPY_REACTOR_KQUEUE
+#endif
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#elif defined(CAPY_REACTOR_KQUEUE)
+#include <sys/event.h>
+#endif
+
 // ============================================================
 
 namespace capy {
 
+namespace detail {
+
+// Throws, or without exceptions reports and terminates
+[[noreturn]] inline void
+throw_system_error(std::error_code ec, char const* what)
+{
+#if CAPY_HAS_EXCEPTIONS
+    throw std::system_error(ec, what);
+#else
+    std::fprintf(stderr, "%s: %s\n", what, ec.message().c_str());
+    std::abort();
+#endif
+}
+
+} // namespace detail
+
 // ============================================================
 // execution_context (minimal for demo)
 //
@@ -37,6 +175,8 @@ namespace capy {
 // stub; see Capy for the complete implementation.
 // ============================================================
 
+class timer_wheel;
+
 class execution_context
 {
 public:
@@ -45,6 +185,11 @@ public:
 
     execution_context(execution_context const&) = delete;
     execution_context& operator=(execution_context const&) = delete;
+
+    // The timer wheel for this context's timers. The event loops
+    // drive their own; any other context shares the wheel of
+    // timer_context's thread. See timer_wheel.
+    virtual timer_wheel* timers() noexcept;
 };
 
 // ============================================================
@@ -78,21 +223,69 @@ concept Executor =
         { ce.post(c) };
     };
 
+// An executor that can also take a null-terminated chain of
+// continuations, linked through next, in one queue operation
+// and one wakeup. Optional: executor_ref and any_executor post
+// a chain to any other executor one continuation at a time.
+template<class E>
+concept BatchExecutor =
+    Executor<E> &&
+    requires(E const& ce, continuation* head) {
+        { ce.post_batch(head) };
+    };
+
+namespace detail {
+
+// Posts a chain one continuation at a time. Each next is read
+// before its continuation is posted, which may run it at once.
+template<class Ex>
+void
+post_each(Ex const& ex, continuation* head)
+{
+    while(head)
+    {
+        auto* next = std::exchange(head->next, nullptr);
+        ex.post(*head);
+        head = next;
+    }
+}
+
+// Counts a chain and finds its last continuation
+inline std::size_t
+chain_length(continuation* head, continuation*& last) noexcept
+{
+    std::size_t n = 1;
+    last = head;
+    while(last->next)
+    {
+        last = last->next;
+        ++n;
+    }
+    return n;
+}
+
+} // namespace detail
+
 // ============================================================
 // executor_ref (type-erased executor wrapper)
 // ============================================================
 
 namespace detail {
 
+// Its address identifies T, with or without RTTI
+template<class T>
+inline constexpr char type_tag = 0;
+
 struct executor_vtable
 {
     execution_context& (*context)(void const*) noexcept;
     void (*on_work_started)(void const*) noexcept;
     void (*on_work_finished)(void const*) noexcept;
     void (*post)(void const*, continuation&);
+    void (*post_batch)(void const*, continuation*);
     std::coroutine_handle<> (*dispatch)(void const*, continuation&);
     bool (*equals)(void const*, void const*) noexcept;
-    void const* (*type_id)() noexcept;
+    void const* type;
 };
 
 template<class Ex>
@@ -109,37 +302,66 @@ inline constexpr executor_vtable vtable_for = {
     [](void const* p, continuation& c) {
         static_cast<Ex const*>(p)->post(c);
     },
+    [](void const* p, continuation* head) {
+        auto const& ex = *static_cast<Ex const*>(p);
+        if constexpr (BatchExecutor<Ex>)
+            ex.post_batch(head);
+        else
+            post_each(ex, head);
+    },
     [](void const* p, continuation& c) -> std::coroutine_handle<> {
         return static_cast<Ex const*>(p)->dispatch(c);
     },
     [](void const* a, void const* b) noexcept -> bool {
         return *static_cast<Ex const*>(a) == *static_cast<Ex const*>(b);
     },
-    []() noexcept -> void const* {
-        return &typeid(Ex);
-    },
+    &type_tag<Ex>,
 };
 
 } // namespace detail
 
+template<class Ex>
+class known_executor_ref;
+
+class any_executor;
+
 class executor_ref
 {
+    friend class any_executor;
+
     void const* ex_ = nullptr;
     detail::executor_vtable const* vt_ = nullptr;
 
+    executor_ref(void const* ex, detail::executor_vtable const* vt) noexcept
+        : ex_(ex)
+        , vt_(vt)
+    {
+    }
+
 public:
     executor_ref() = default;
     executor_ref(executor_ref const&) = default;
     executor_ref& operator=(executor_ref const&) = default;
 
     template<class Ex>
-        requires (!std::same_as<std::decay_t<Ex>, executor_ref>)
+        requires (!std::same_as<std::decay_t<Ex>, executor_ref> &&
+                  !std::same_as<std::decay_t<Ex>, any_executor>)
     executor_ref(Ex const& ex) noexcept
         : ex_(&ex)
         , vt_(&detail::vtable_for<Ex>)
     {
     }
 
+    // Refers to the same executor, not to the wrapper
+    template<class Ex>
+    executor_ref(known_executor_ref<Ex> const& ex) noexcept
+        : executor_ref(ex.ref())
+    {
+    }
+
+    // Refers to the executor stored inside ex
+    executor_ref(any_executor const& ex) noexcept;
+
     explicit operator bool() const noexcept { return ex_ != nullptr; }
 
     execution_context& context() const noexcept { return vt_->context(ex_); }
@@ -147,6 +369,7 @@ public:
     void on_work_finished() const noexcept { vt_->on_work_finished(ex_); }
     std::coroutine_handle<> dispatch(continuation& c) const { return vt_->dispatch(ex_, c); }
     void post(continuation& c) const { vt_->post(ex_, c); }
+    void post_batch(continuation* head) const { vt_->post_batch(ex_, head); }
 
     bool operator==(executor_ref const& other) const noexcept
     {
@@ -162,7 +385,7 @@ public:
     E const* target() const noexcept
     {
         if(!ex_) return nullptr;
-        if(vt_->type_id() == &typeid(E))
+        if(vt_->type == &detail::type_tag<E>)
             return static_cast<E const*>(ex_);
         return nullptr;
     }
@@ -172,20 +395,229 @@ public:
     E* target() noexcept
     {
         if(!ex_) return nullptr;
-        if(vt_->type_id() == &typeid(E))
+        if(vt_->type == &detail::type_tag<E>)
             return const_cast<E*>(
                 static_cast<E const*>(ex_));
         return nullptr;
     }
 };
 
+// ============================================================
+// known_executor_ref - devirtualized executor_ref
+//
+// An executor_ref that expects to refer to an Ex. It checks the
+// type tag once, when constructed, and calls an Ex directly
+// from then on; any other executor goes through the vtable as
+// usual. The test is one well-predicted branch, and the direct
+// calls inline, so code that knows its hot executor type pays
+// nothing for the erasure. It converts back to executor_ref.
+// ============================================================
+
+template<class Ex>
+class known_executor_ref
+{
+    executor_ref ref_;
+    Ex const* ex_ = nullptr;
+
+public:
+    known_executor_ref() = default;
+
+    explicit known_executor_ref(executor_ref ref) noexcept
+        : ref_(ref)
+        , ex_(ref.target<Ex>())
+    {
+    }
+
+    known_executor_ref(Ex const& ex) noexcept
+        : ref_(ex)
+        , ex_(&ex)
+    {
+    }
+
+    executor_ref ref() const noexcept { return ref_; }
+
+    // The executor when it is an Ex, otherwise null
+    Ex const* known() const noexcept { return ex_; }
+
+    explicit operator bool() const noexcept { return static_cast<bool>(ref_); }
+
+    execution_context& context() const noexcept
+    {
+        if(ex_)
+            return ex_->context();
+        return ref_.context();
+    }
+
+    void on_work_started() const noexcept
+    {
+        if(ex_)
+            ex_->on_work_started();
+        else
+            ref_.on_work_started();
+    }
+
+    void on_work_finished() const noexcept
+    {
+        if(ex_)
+            ex_->on_work_finished();
+        else
+            ref_.on_work_finished();
+    }
+
+    std::coroutine_handle<> dispatch(continuation& c) const
+    {
+        if(ex_)
+            return ex_->dispatch(c);
+        return ref_.dispatch(c);
+    }
+
+    void post(continuation& c) const
+    {
+        if(ex_)
+            ex_->post(c);
+        else
+            ref_.post(c);
+    }
+
+    void post_batch(continuation* head) const
+    {
+        if constexpr (BatchExecutor<Ex>)
+        {
+            if(ex_)
+                return ex_->post_batch(head);
+        }
+        ref_.post_batch(head);
+    }
+
+    bool operator==(known_executor_ref const& other) const noexcept
+    {
+        return ref_ == other.ref_;
+    }
+};
+
+// ============================================================
+// any_executor - owning executor with inline storage
+//
+// executor_ref points at the caller's executor object, so a
+// dispatch reads the ref, then the vtable, then the executor,
+// and only then its context; and the ref dangles as soon as
+// the object it names goes away. Nearly every executor is a
+// pointer to its context, so any_executor stores the executor
+// itself, by value, in a buffer of two pointers next to the
+// vtable. The state a dispatch needs then sits inside whatever
+// holds the any_executor - the io_env above all - and copies
+// of it stay valid wherever they travel.
+//
+// Only trivially copyable executors that fit the buffer are
+// accepted, which keeps copies a plain memberwise copy; an
+// executor that does not fit is a compile error, not a heap
+// allocation. Built from an executor_ref it stores the ref
+// and forwards to it, so target() and equality still see the
+// executor behind the ref.
+// ============================================================
+
+class any_executor
+{
+    alignas(void*) unsigned char buf_[2 * sizeof(void*)];
+    detail::executor_vtable const* vt_ = nullptr;
+
+    void const* get() const noexcept { return buf_; }
+
+    bool holds_ref() const noexcept
+    {
+        return vt_ == &detail::vtable_for<executor_ref>;
+    }
+
+public:
+    template<class Ex>
+    static constexpr bool fits =
+        std::is_trivially_copyable_v<Ex> &&
+        sizeof(Ex) <= sizeof(buf_) &&
+        alignof(Ex) <= alignof(void*);
+
+    any_executor() = default;
+    any_executor(any_executor const&) = default;
+    any_executor& operator=(any_executor const&) = default;
+
+    template<class Ex>
+        requires (!std::same_as<std::decay_t<Ex>, any_executor> &&
+                  !std::same_as<std::decay_t<Ex>, executor_ref>) &&
+                 Executor<Ex>
+    any_executor(Ex const& ex) noexcept
+        : vt_(&detail::vtable_for<Ex>)
+    {
+        static_assert(fits<Ex>,
+            "executor must be trivially copyable and "
+            "no larger than two pointers");
+        ::new(static_cast<void*>(buf_)) Ex(ex);
+    }
+
+    any_executor(executor_ref const& ex) noexcept
+        : vt_(&detail::vtable_for<executor_ref>)
+    {
+        ::new(static_cast<void*>(buf_)) executor_ref(ex);
+    }
+
+    template<class Ex>
+    any_executor(known_executor_ref<Ex> const& ex) noexcept
+        : any_executor(ex.ref())
+    {
+    }
+
+    explicit operator bool() const noexcept
+    {
+        if(holds_ref())
+            return static_cast<bool>(
+                *static_cast<executor_ref const*>(get()));
+        return vt_ != nullptr;
+    }
+
+    execution_context& context() const noexcept { return vt_->context(get()); }
+    void on_work_started() const noexcept { vt_->on_work_started(get()); }
+    void on_work_finished() const noexcept { vt_->on_work_finished(get()); }
+    std::coroutine_handle<> dispatch(continuation& c) const { return vt_->dispatch(get(), c); }
+    void post(continuation& c) const { vt_->post(get(), c); }
+    void post_batch(continuation* head) const { vt_->post_batch(get(), head); }
+
+    bool operator==(any_executor const& other) const noexcept
+    {
+        return executor_ref(*this) == executor_ref(other);
+    }
+
+    template<class E>
+    E const* target() const noexcept
+    {
+        return executor_ref(*this).target<E>();
+    }
+
+    template<class E>
+    E* target() noexcept
+    {
+        return executor_ref(*this).target<E>();
+    }
+
+    friend class executor_ref;
+};
+
+inline executor_ref::executor_ref(any_executor const& ex) noexcept
+{
+    if(ex.holds_ref())
+        *this = *static_cast<executor_ref const*>(ex.get());
+    else if(ex.vt_)
+        *this = executor_ref(ex.get(), ex.vt_);
+}
+
+static_assert(Executor<any_executor>);
+static_assert(BatchExecutor<any_executor>);
+static_assert(std::is_trivially_copyable_v<any_executor>);
+
 // ============================================================
 // io_env - execution environment
 // ============================================================
 
 struct io_env
 {
-    executor_ref executor;
+    any_executor executor;
     std::stop_token stop_token;
     std::pmr::memory_resource* frame_allocator = nullptr;
 };
@@ -200,12 +632,17 @@ struct environment_tag {};
 struct executor_tag {};
 struct stop_token_tag {};
 struct frame_allocator_tag {};
+struct yield_tag {};
 
 inline constexpr environment_tag environment{};
 inline constexpr executor_tag executor{};
 inline constexpr stop_token_tag stop_token{};
 inline constexpr frame_allocator_tag frame_allocator{};
 
+// Posts the task to its executor, to resume behind the work
+// already queued there
+inline constexpr yield_tag yield{};
+
 } // namespace this_coro
 
 // ============================================================
@@ -218,6 +655,13 @@ inline std::pmr::memory_resource*& tls_frame_allocator() noexcept
     static thread_local std::pmr::memory_resource* mr = nullptr;
     return mr;
 }
+
+// Set while a task posts itself; see post_self
+inline bool& tls_yielding() noexcept
+{
+    static thread_local bool yielding = false;
+    return yielding;
+}
 } // namespace detail
 
 inline std::pmr::memory_resource*
@@ -232,480 +676,9109 @@ set_cached_frame_allocator(std::pmr::memory_resource* mr) noexcept
     detail::tls_frame_allocator() = mr;
 }
 
+namespace detail {
+
+// Stores mr in the slot, skipping the write when it is already
+// there. A resumed coroutine nearly always finds its own
+// allocator in place, so the line stays clean.
+inline void
+restore_frame_allocator(
+    std::pmr::memory_resource*& slot,
+    std::pmr::memory_resource* mr) noexcept
+{
+#if CAPY_TLS_WRITE_ON_CHANGE
+    if(slot != mr)
+        slot = mr;
+#else
+    slot = mr;
+#endif
+}
+
+inline void
+restore_frame_allocator(std::pmr::memory_resource* mr) noexcept
+{
+    restore_frame_allocator(tls_frame_allocator(), mr);
+}
+
+} // namespace detail
+
 // ============================================================
 // safe_resume — save/restore TLS frame allocator around resume
+//
+// The slot's address is taken once: this is an ordinary
+// function, so it cannot change threads across the resume, and
+// in a shared library that is one __tls_get_addr, not two.
 // ============================================================
 
 inline void
 safe_resume(std::coroutine_handle<> h) noexcept
 {
-    auto* saved = get_cached_frame_allocator();
+    auto& slot = detail::tls_frame_allocator();
+    auto* saved = slot;
     h.resume();
-    set_cached_frame_allocator(saved);
+    detail::restore_frame_allocator(slot, saved);
 }
 
 // ============================================================
-// IoAwaitable concept
+// recycling_frame_pool - size-class frame recycling resource
+//
+// Coroutine frames come in a small number of fixed sizes, one
+// per coroutine function, and are freed in roughly the order
+// they were allocated. The pool keeps a thread-local free list
+// per 64-byte size class, so the steady state allocates and
+// frees without locks or calls to the upstream resource.
+//
+// A thread whose cache grows past cache_limit spills half of a
+// class to the pool's return queue, a lock-free stack of chains;
+// a thread whose cache is empty takes the whole queue in one
+// exchange. This moves blocks from the thread that frees them
+// back to the thread that allocates them.
+//
+// A thread keeps caches for up to cache_slots pools at once,
+// claimed by the first pools it allocates from; a further pool
+// goes straight to its return queue on that thread.
+//
+// Blocks are only returned upstream when the pool is destroyed.
+// A pool must outlive every thread that allocates from it.
 // ============================================================
 
-template<typename A>
-concept IoAwaitable =
-    requires(
-        A a,
-        std::coroutine_handle<> h,
-        io_env const* env)
-    {
-        a.await_suspend(h, env);
-    };
+class recycling_frame_pool final : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t class_count = 32;
+    static constexpr std::size_t max_block_size = granularity * class_count;
+    static constexpr std::size_t cache_limit = 64;
+    static constexpr std::size_t cache_slots = 4;
 
-// ============================================================
-// IoRunnable concept
-// ============================================================
+    explicit recycling_frame_pool(
+        std::pmr::memory_resource* upstream =
+            std::pmr::new_delete_resource()) noexcept
+        : upstream_(upstream)
+    {
+    }
 
-template<typename T>
-concept IoRunnable =
-    IoAwaitable<T> &&
-    requires { typename T::promise_type; } &&
-    requires(T& t, T const& ct,
-             typename T::promise_type const& cp,
-             typename T::promise_type& p)
+    ~recycling_frame_pool()
     {
-        { ct.handle() } noexcept
-            -> std::same_as<std::coroutine_handle<typename T::promise_type>>;
-        { cp.exception() } noexcept -> std::same_as<std::exception_ptr>;
-        { t.release() } noexcept;
-        { p.set_continuation(std::coroutine_handle<>{}) } noexcept;
-        { p.set_environment(static_cast<io_env const*>(nullptr)) } noexcept;
-    } &&
-    (std::is_void_v<decltype(std::declval<T&>().await_resume())> ||
-     requires(typename T::promise_type& p) {
-         p.result();
-     });
+        auto* c = local();
+        for(std::size_t i = 0; i < cache_slots; ++i)
+            if(c[i].owner == this)
+                flush(c[i]);
+        for(std::size_t i = 0; i < class_count; ++i)
+            release_chain(i, returned_[i].exchange(nullptr));
+    }
 
-// ============================================================
-// io_awaitable_promise_base CRTP mixin
-// ============================================================
+    recycling_frame_pool(recycling_frame_pool const&) = delete;
+    recycling_frame_pool& operator=(recycling_frame_pool const&) = delete;
 
-template<typename Derived>
-class io_awaitable_promise_base
-{
-    io_env const* env_ = nullptr;
-    mutable std::coroutine_handle<> cont_{std::noop_coroutine()};
+    std::pmr::memory_resource* upstream() const noexcept { return upstream_; }
 
-public:
-    static void*
-    operator new(std::size_t size)
+private:
+    struct block
     {
-        auto* mr = get_cached_frame_allocator();
-        if(!mr)
-            mr = std::pmr::new_delete_resource();
+        block* next;
+    };
 
-        auto total = size + sizeof(std::pmr::memory_resource*);
-        void* raw = mr->allocate(total, alignof(std::max_align_t));
-        std::memcpy(static_cast<char*>(raw) + size, &mr, sizeof(mr));
-        return raw;
-    }
+    struct local_cache
+    {
+        recycling_frame_pool* owner = nullptr;
+        block* head[class_count] = {};
+        std::size_t count[class_count] = {};
 
-    static void
-    operator delete(void* ptr, std::size_t size) noexcept
+        ~local_cache()
+        {
+            if(owner)
+                owner->flush(*this);
+        }
+    };
+
+    std::pmr::memory_resource* upstream_;
+    std::atomic<block*> returned_[class_count] = {};
+
+    static local_cache* local() noexcept
     {
-        std::pmr::memory_resource* mr;
-        std::memcpy(&mr, static_cast<char*>(ptr) + size, sizeof(mr));
-        auto total = size + sizeof(std::pmr::memory_resource*);
-        mr->deallocate(ptr, total, alignof(std::max_align_t));
+        static thread_local local_cache c[cache_slots];
+        return c;
     }
 
-    ~io_awaitable_promise_base()
+    static constexpr std::size_t class_of(std::size_t bytes) noexcept
     {
-        if(cont_ != std::noop_coroutine())
-            cont_.destroy();
+        return bytes ? (bytes - 1) / granularity : 0;
     }
 
-    void set_continuation(std::coroutine_handle<> cont) noexcept
+    static constexpr std::size_t size_of(std::size_t index) noexcept
     {
-        cont_ = cont;
+        return (index + 1) * granularity;
     }
 
-    std::coroutine_handle<> continuation() const noexcept
+    static bool pooled(std::size_t bytes, std::size_t alignment) noexcept
     {
-        return std::exchange(cont_, std::noop_coroutine());
+        return bytes <= max_block_size &&
+            alignment <= alignof(std::max_align_t);
     }
 
-    void set_environment(io_env const* env) noexcept
+    void push_returned(std::size_t index, block* first, block* last) noexcept
     {
-        env_ = env;
+        auto& q = returned_[index];
+        block* old = q.load(std::memory_order_relaxed);
+        do
+        {
+            last->next = old;
+        }
+        while(!q.compare_exchange_weak(old, first,
+            std::memory_order_release, std::memory_order_relaxed));
     }
 
-    io_env const* environment() const noexcept
+    void release_chain(std::size_t index, block* b) noexcept
     {
-        return env_;
+        while(b)
+        {
+            block* next = b->next;
+            upstream_->deallocate(b, size_of(index), alignof(std::max_align_t));
+            b = next;
+        }
     }
 
-    template<typename A>
-    decltype(auto) transform_awaitable(A&& a)
+    void flush(local_cache& c) noexcept
     {
-        return std::forward<A>(a);
+        for(std::size_t i = 0; i < class_count; ++i)
+        {
+            block* first = c.head[i];
+            if(!first)
+                continue;
+            block* last = first;
+            while(last->next)
+                last = last->next;
+            push_returned(i, first, last);
+            c.head[i] = nullptr;
+            c.count[i] = 0;
+        }
+        c.owner = nullptr;
     }
 
-    template<typename T>
-    auto await_transform(T&& t)
+    // Returns this thread's cache for this pool, claiming a free
+    // slot for it on first use; null when every slot is taken.
+    local_cache* cache() noexcept
     {
-        using Tag = std::decay_t<T>;
-
-        if constexpr (std::is_same_v<Tag, this_coro::environment_tag>)
+        auto* c = local();
+        local_cache* unused = nullptr;
+        for(std::size_t i = 0; i < cache_slots; ++i)
         {
-            struct awaiter
-            {
-                io_env const* env_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                io_env const* await_resume() const noexcept { return env_; }
-            };
-            return awaiter{env_};
+            if(c[i].owner == this)
+                return &c[i];
+            if(!c[i].owner && !unused)
+                unused = &c[i];
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::executor_tag>)
+        if(unused)
+            unused->owner = this;
+        return unused;
+    }
+
+public:
+    // allocate and deallocate without the virtual call, for
+    // callers that know they have this pool
+    void* allocate_block(std::size_t bytes, std::size_t alignment)
+    {
+        if(!pooled(bytes, alignment))
+            return upstream_->allocate(bytes, alignment);
+
+        auto const i = class_of(bytes);
+        if(auto* c = cache())
         {
-            struct awaiter
+            block* b = c->head[i];
+            if(!b)
             {
-                executor_ref executor_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                executor_ref await_resume() const noexcept { return executor_; }
-            };
-            return awaiter{env_->executor};
+                b = returned_[i].exchange(nullptr, std::memory_order_acquire);
+                std::size_t n = 0;
+                for(block* p = b; p; p = p->next)
+                    ++n;
+                c->count[i] = n;
+            }
+            if(b)
+            {
+                c->head[i] = b->next;
+                --c->count[i];
+                return b;
+            }
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::stop_token_tag>)
+        else if(block* b = returned_[i].exchange(
+            nullptr, std::memory_order_acquire))
         {
-            struct awaiter
+            // Another pool owns this thread's cache: take one
+            // block and give the rest of the chain back.
+            if(block* rest = b->next)
             {
-                std::stop_token token_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                std::stop_token await_resume() const noexcept { return token_; }
-            };
-            return awaiter{env_->stop_token};
+                block* last = rest;
+                while(last->next)
+                    last = last->next;
+                push_returned(i, rest, last);
+            }
+            return b;
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::frame_allocator_tag>)
+        return upstream_->allocate(size_of(i), alignof(std::max_align_t));
+    }
+
+    void deallocate_block(
+        void* p, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        if(!pooled(bytes, alignment))
+            return upstream_->deallocate(p, bytes, alignment);
+
+        auto const i = class_of(bytes);
+        auto* b = static_cast<block*>(p);
+        auto* c = cache();
+        if(!c)
+            return push_returned(i, b, b);
+
+        b->next = c->head[i];
+        c->head[i] = b;
+        if(++c->count[i] <= cache_limit)
+            return;
+
+        // Spill the older half of the class to the return queue
+        block* last = b;
+        for(std::size_t n = 1; n < cache_limit / 2; ++n)
+            last = last->next;
+        block* first = last->next;
+        last->next = nullptr;
+        block* tail = first;
+        while(tail->next)
+            tail = tail->next;
+        c->count[i] = cache_limit / 2;
+        push_returned(i, first, tail);
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return allocate_block(bytes, alignment);
+    }
+
+    void do_deallocate(
+        void* p, std::size_t bytes, std::size_t alignment) noexcept override
+    {
+        deallocate_block(p, bytes, alignment);
+    }
+
+    bool do_is_equal(
+        std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// Process-wide pool used when no frame allocator is installed.
+// Constructed in static storage and never destroyed, so thread
+// caches may be flushed into it during any thread's exit.
+inline recycling_frame_pool&
+default_frame_pool() noexcept
+{
+    alignas(recycling_frame_pool) static unsigned char storage[
+        sizeof(recycling_frame_pool)];
+    static recycling_frame_pool* pool = ::new(storage) recycling_frame_pool();
+    return *pool;
+}
+
+// ============================================================
+// frame_arena - bump allocator for one coroutine tree
+//
+// A connection or request runs a tree of coroutines whose
+// frames all die with its root. frame_arena hands them out by
+// bumping a pointer through chunks taken from upstream, so
+// sibling frames sit next to each other, and the launcher
+// releases the whole arena in one call when the root is done:
+// see the run_async overloads taking a frame_arena.
+//
+// Frames are mostly freed in the reverse order they were made,
+// a child before its parent, so freeing the most recent block
+// moves the pointer back and the space is used again; any other
+// free is a no-op until release. That keeps a long-lived root,
+// which runs one child after another, from growing the arena.
+// Block sizes are rounded up to max_align_t so the pointer
+// stays aligned and a bump back reclaims the padding too.
+//
+// release() returns every chunk but the newest, which becomes
+// the arena's space for the next tree; without chunks the
+// arena uses the buffer it was constructed with, if any. An
+// arena belongs to one tree at a time, and the tree must not
+// allocate from two threads at once - run it on a loop or a
+// single-threaded pool.
+// ============================================================
+
+class frame_arena final : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t default_chunk_size = 4096;
+
+    explicit frame_arena(
+        std::size_t chunk_size = default_chunk_size,
+        std::pmr::memory_resource* upstream =
+            std::pmr::new_delete_resource()) noexcept
+        : upstream_(upstream)
+        , next_size_(chunk_size)
+    {
+    }
+
+    frame_arena(void* buffer, std::size_t size,
+        std::pmr::memory_resource* upstream =
+            std::pmr::new_delete_resource()) noexcept
+        : upstream_(upstream)
+        , buffer_(static_cast<unsigned char*>(buffer))
+        , buffer_size_(size)
+        , top_(buffer_)
+        , end_(buffer_ + size)
+        , next_size_(size ? size * 2 : default_chunk_size)
+    {
+    }
+
+    ~frame_arena()
+    {
+        release_chunks(chunks_);
+    }
+
+    frame_arena(frame_arena const&) = delete;
+    frame_arena& operator=(frame_arena const&) = delete;
+
+    void release() noexcept
+    {
+        if(chunks_)
         {
-            struct awaiter
-            {
-                std::pmr::memory_resource* frame_allocator_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                std::pmr::memory_resource* await_resume() const noexcept { return frame_allocator_; }
-            };
-            return awaiter{env_->frame_allocator};
+            release_chunks(chunks_->prev);
+            chunks_->prev = nullptr;
+            top_ = chunks_->data();
+            end_ = top_ + chunks_->size;
         }
         else
         {
-            return static_cast<Derived*>(this)->transform_awaitable(
-                std::forward<T>(t));
+            top_ = buffer_;
+            end_ = buffer_ + buffer_size_;
+        }
+    }
+
+    // Chunks taken from upstream and not yet returned
+    std::size_t chunk_count() const noexcept
+    {
+        std::size_t n = 0;
+        for(chunk* c = chunks_; c; c = c->prev)
+            ++n;
+        return n;
+    }
+
+private:
+    struct alignas(std::max_align_t) chunk
+    {
+        chunk* prev;
+        std::size_t size;
+
+        unsigned char* data() noexcept
+        {
+            return reinterpret_cast<unsigned char*>(this + 1);
+        }
+    };
+
+    std::pmr::memory_resource* upstream_;
+    unsigned char* buffer_ = nullptr;
+    std::size_t buffer_size_ = 0;
+    chunk* chunks_ = nullptr;
+    unsigned char* top_ = nullptr;
+    unsigned char* end_ = nullptr;
+    std::size_t next_size_;
+
+    void release_chunks(chunk* c) noexcept
+    {
+        while(c)
+        {
+            chunk* prev = c->prev;
+            upstream_->deallocate(c, sizeof(chunk) + c->size, alignof(chunk));
+            c = prev;
+        }
+    }
+
+    // Alignments are powers of two
+    static std::size_t padding(unsigned char* p, std::size_t alignment) noexcept
+    {
+        auto n = reinterpret_cast<std::uintptr_t>(p);
+        return (0 - n) & (alignment - 1);
+    }
+
+    static std::size_t round_up(std::size_t bytes) noexcept
+    {
+        constexpr std::size_t a = alignof(std::max_align_t);
+        return (bytes + a - 1) & ~(a - 1);
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        bytes = round_up(bytes);
+        std::size_t const pad = padding(top_, alignment);
+        unsigned char* p = top_ + pad;
+        if(!top_ || static_cast<std::size_t>(end_ - top_) < pad + bytes)
+        {
+            std::size_t size = next_size_;
+            while(size < bytes + alignment)
+                size *= 2;
+            void* raw = upstream_->allocate(sizeof(chunk) + size, alignof(chunk));
+            auto* c = ::new(raw) chunk{chunks_, size};
+            chunks_ = c;
+            next_size_ = size * 2;
+            end_ = c->data() + size;
+            p = c->data() + padding(c->data(), alignment);
         }
+        top_ = p + bytes;
+        return p;
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t) noexcept override
+    {
+        if(static_cast<unsigned char*>(p) + round_up(bytes) == top_)
+            top_ = static_cast<unsigned char*>(p);
+    }
+
+    bool do_is_equal(
+        std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
     }
 };
 
 // ============================================================
-// task<T> — lazy coroutine task satisfying IoRunnable
+// FrameAllocator - allocators known at compile time
+//
+// A task frame normally carries the memory_resource it came
+// from in a trailer, so operator delete can find it again, and
+// frees through a virtual call. A task declared with
+// use_frame_allocator<A> allocates through A's static members
+// instead: neither trailer nor indirection, and calls into A
+// can inline. A has no state, so it names one allocator for the
+// whole program - the default pool, or a thread's arena. The
+// pmr path in io_env::frame_allocator is unchanged for every
+// other task.
 // ============================================================
 
+template<class A>
+concept FrameAllocator =
+    requires(void* p, std::size_t n) {
+        { A::allocate(n) } -> std::same_as<void*>;
+        { A::deallocate(p, n) } noexcept;
+    };
+
+// default_frame_pool, called without the virtual dispatch
+struct pool_frame_allocator
+{
+    static void* allocate(std::size_t n)
+    {
+        return default_frame_pool().allocate_block(
+            n, alignof(std::max_align_t));
+    }
+
+    static void deallocate(void* p, std::size_t n) noexcept
+    {
+        default_frame_pool().deallocate_block(
+            p, n, alignof(std::max_align_t));
+    }
+};
+
+static_assert(FrameAllocator<pool_frame_allocator>);
+
+// The global operator new, which the optimizer can see through:
+// no thread_local lookup and no virtual call stand between the
+// frame and an allocation it may remove. Through
+// __builtin_operator_new where there is one, the call may be
+// elided like that of a new-expression.
+struct new_frame_allocator
+{
+    static void* allocate(std::size_t n)
+    {
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_operator_new)
+        return __builtin_operator_new(n);
+#endif
+#endif
+        return ::operator new(n);
+    }
+
+    static void deallocate(void* p, std::size_t n) noexcept
+    {
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_operator_delete)
+        return __builtin_operator_delete(p, n);
+#endif
+#endif
+        ::operator delete(p, n);
+    }
+};
+
+static_assert(FrameAllocator<new_frame_allocator>);
+
+// ============================================================
+// frame_telemetry - opt-in frame statistics
+//
+// Built with CAPY_FRAME_TELEMETRY=1, every task frame is
+// counted against the coroutine function that created it. The
+// promise takes a defaulted std::source_location, which the
+// compiler fills in with the coroutine's own location, and the
+// frame size is what operator new allocated just before, on
+// the same thread, trailer included. Each site records frames
+// created, frames live, the most live at once and the frame
+// size; the totals record live frames, live bytes, peak bytes
+// and a histogram over the recycling_frame_pool size classes -
+// the numbers to size the pool by, and to spot a frame that
+// grew after a change.
+//
+// Counting takes relaxed atomics in a fixed table: no locks
+// and no allocation. Sites past site_capacity still count in
+// the totals. Without the macro none of this is compiled into
+// the promise and frames are unchanged.
+// ============================================================
+
+struct frame_site_stats
+{
+    char const* function;
+    char const* file;
+    unsigned line;
+    std::size_t frame_size;
+    std::uint64_t frames;
+    std::uint64_t live;
+    std::uint64_t peak_live;
+};
+
+struct frame_totals
+{
+    static constexpr std::size_t bucket_count =
+        recycling_frame_pool::class_count + 1;
+
+    std::uint64_t frames = 0;
+    std::uint64_t live = 0;
+    std::size_t live_bytes = 0;
+    std::size_t peak_bytes = 0;
+
+    // Frames per pool size class; the last bucket counts
+    // frames larger than recycling_frame_pool::max_block_size
+    std::uint64_t buckets[bucket_count] = {};
+};
+
+class frame_telemetry
+{
+public:
+    static constexpr std::size_t site_capacity = 1024;
+
+    struct site
+    {
+        std::atomic<char const*> function{nullptr};
+        std::atomic<bool> ready{false};
+        char const* file = nullptr;
+        unsigned line = 0;
+        std::atomic<std::size_t> frame_size{0};
+        std::atomic<std::uint64_t> frames{0};
+        std::atomic<std::uint64_t> live{0};
+        std::atomic<std::uint64_t> peak_live{0};
+    };
+
+    // The site for loc, or null when the table is full
+    static site* find(std::source_location const& loc) noexcept
+    {
+        auto& st = state();
+        char const* fn = loc.function_name();
+        auto h = reinterpret_cast<std::uintptr_t>(fn);
+        h ^= h >> 17;
+        for(std::size_t i = 0; i < site_capacity; ++i)
+        {
+            auto& s = st.sites[(h + i) % site_capacity];
+            char const* cur = s.function.load(std::memory_order_acquire);
+            if(cur == fn)
+                return &s;
+            if(!cur && s.function.compare_exchange_strong(
+                cur, fn, std::memory_order_acq_rel))
+            {
+                s.file = loc.file_name();
+                s.line = loc.line();
+                s.ready.store(true, std::memory_order_release);
+                return &s;
+            }
+            if(cur == fn)
+                return &s;
+        }
+        return nullptr;
+    }
+
+    static void on_create(site* s, std::size_t size) noexcept
+    {
+        auto& st = state();
+        st.frames.fetch_add(1, std::memory_order_relaxed);
+        st.live.fetch_add(1, std::memory_order_relaxed);
+        raise(st.peak_bytes,
+            st.live_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+        auto const c = size > recycling_frame_pool::max_block_size
+            ? frame_totals::bucket_count - 1
+            : (size - 1) / recycling_frame_pool::granularity;
+        st.buckets[c].fetch_add(1, std::memory_order_relaxed);
+        if(!s)
+            return;
+        s->frame_size.store(size, std::memory_order_relaxed);
+        s->frames.fetch_add(1, std::memory_order_relaxed);
+        raise(s->peak_live,
+            s->live.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    static void on_destroy(site* s, std::size_t size) noexcept
+    {
+        auto& st = state();
+        st.live.fetch_sub(1, std::memory_order_relaxed);
+        st.live_bytes.fetch_sub(size, std::memory_order_relaxed);
+        if(s)
+            s->live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static frame_totals totals() noexcept
+    {
+        auto& st = state();
+        frame_totals t;
+        t.frames = st.frames.load(std::memory_order_relaxed);
+        t.live = st.live.load(std::memory_order_relaxed);
+        t.live_bytes = st.live_bytes.load(std::memory_order_relaxed);
+        t.peak_bytes = st.peak_bytes.load(std::memory_order_relaxed);
+        for(std::size_t i = 0; i < frame_totals::bucket_count; ++i)
+            t.buckets[i] = st.buckets[i].load(std::memory_order_relaxed);
+        return t;
+    }
+
+    // Calls f(frame_site_stats const&) for every site seen
+    template<class F>
+    static void for_each_site(F&& f)
+    {
+        for(auto& s : state().sites)
+        {
+            if(!s.ready.load(std::memory_order_acquire))
+                continue;
+            f(frame_site_stats{
+                s.function.load(std::memory_order_relaxed),
+                s.file, s.line,
+                s.frame_size.load(std::memory_order_relaxed),
+                s.frames.load(std::memory_order_relaxed),
+                s.live.load(std::memory_order_relaxed),
+                s.peak_live.load(std::memory_order_relaxed)});
+        }
+    }
+
+    static void dump(std::FILE* out)
+    {
+        auto t = totals();
+        std::fprintf(out, "frames: %llu created, %llu live, "
+            "%zu bytes live, %zu bytes peak\n",
+            static_cast<unsigned long long>(t.frames),
+            static_cast<unsigned long long>(t.live),
+            t.live_bytes, t.peak_bytes);
+        for(std::size_t i = 0; i < frame_totals::bucket_count; ++i)
+        {
+            if(!t.buckets[i])
+                continue;
+            if(i + 1 < frame_totals::bucket_count)
+                std::fprintf(out, "  <= %4zu bytes: %llu\n",
+                    (i + 1) * recycling_frame_pool::granularity,
+                    static_cast<unsigned long long>(t.buckets[i]));
+            else
+                std::fprintf(out, "   > %4zu bytes: %llu\n",
+                    recycling_frame_pool::max_block_size,
+                    static_cast<unsigned long long>(t.buckets[i]));
+        }
+        for_each_site([out](frame_site_stats const& s) {
+            std::fprintf(out, "%6zu bytes %8llu frames %6llu peak  %s (%s:%u)\n",
+                s.frame_size,
+                static_cast<unsigned long long>(s.frames),
+                static_cast<unsigned long long>(s.peak_live),
+                s.function, s.file, s.line);
+        });
+    }
+
+    // The size operator new was last asked for on this thread
+    static std::size_t& pending_size() noexcept
+    {
+        static thread_local std::size_t n = 0;
+        return n;
+    }
+
+private:
+    struct state_type
+    {
+        site sites[site_capacity];
+        std::atomic<std::uint64_t> frames{0};
+        std::atomic<std::uint64_t> live{0};
+        std::atomic<std::size_t> live_bytes{0};
+        std::atomic<std::size_t> peak_bytes{0};
+        std::atomic<std::uint64_t> buckets[frame_totals::bucket_count] = {};
+    };
+
+    // Never destroyed, so frames freed during exit still count
+    static state_type& state() noexcept
+    {
+        alignas(state_type) static unsigned char storage[sizeof(state_type)];
+        static state_type* st = ::new(storage) state_type();
+        return *st;
+    }
+
+    template<class T>
+    static void raise(std::atomic<T>& peak, T v) noexcept
+    {
+        T cur = peak.load(std::memory_order_relaxed);
+        while(cur < v && !peak.compare_exchange_weak(
+            cur, v, std::memory_order_relaxed))
+        {
+        }
+    }
+};
+
 namespace detail {
 
-template<typename T>
-struct task_return_base
+// Member of a telemetry-enabled promise: counts its frame for
+// the promise's lifetime
+class frame_record
 {
-    std::optional<T> result_;
+    frame_telemetry::site* site_;
+    std::size_t size_;
+
+public:
+    explicit frame_record(std::source_location const& loc) noexcept
+        : site_(frame_telemetry::find(loc))
+        , size_(frame_telemetry::pending_size())
+    {
+        frame_telemetry::on_create(site_, size_);
+    }
+
+    frame_record(frame_record const&) = delete;
+    frame_record& operator=(frame_record const&) = delete;
 
-    void return_value(T value) { result_ = std::move(value); }
-    T&& result() noexcept { return std::move(*result_); }
+    ~frame_record()
+    {
+        frame_telemetry::on_destroy(site_, size_);
+    }
 };
 
-template<>
-struct task_return_base<void>
+} // namespace detail
+
+// ============================================================
+// async_trace - opt-in suspend and resume tracing
+//
+// Built with CAPY_TRACE=1, every task records four kinds of
+// event: its creation, naming the coroutine function and the
+// task that was running when it was made; each suspension,
+// naming the awaitable's type; the resumption that follows;
+// and its completion. Each event is a 32-byte record stamped
+// with the cycle counter and written to a ring owned by the
+// calling thread: no locks, no atomic read-modify-write and no
+// allocation after a thread's first event. A full ring
+// overwrites its oldest records, so it holds the most recent
+// ring_capacity events of its thread.
+//
+// dump writes the rings in the Chrome trace event format, which
+// Perfetto and chrome://tracing open. Each task is an async
+// track spanning creation to completion, with a nested slice
+// for every suspension; both use the category "task", since
+// viewers nest async events by category and id. A dump may run
+// while threads trace: it copies each record, then drops it if
+// the ring's head has moved past it meanwhile. The copy still
+// races with the writer in the language's terms, so under
+// ThreadSanitizer dump only once traced threads are quiet.
+// Threads past max_threads are traced into rings that are never
+// dumped.
+// ============================================================
+
+enum class trace_event : std::uint8_t
 {
-    void return_void() {}
+    create,
+    suspend,
+    resume,
+    complete
 };
 
-} // namespace detail
+struct trace_record
+{
+    std::uint64_t tsc;
+    std::uint64_t task;
+    char const* what;           // function or awaitable type
+    std::uint64_t parent : 56;  // creating task, for create
+    std::uint64_t event : 8;
+};
+
+static_assert(sizeof(trace_record) == 32);
+
+namespace detail {
+
+inline std::uint64_t trace_clock() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    std::uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// The T out of "... [with T = X]" or "... [T = X]", the text of
+// async_trace::type_name<X>()
+inline std::string_view trim_type_name(std::string_view s) noexcept
+{
+    auto const at = s.find("T = ");
+    if(at == std::string_view::npos)
+        return s;
+    s.remove_prefix(at + 4);
+    return s.substr(0, s.find_first_of(";]"));
+}
+
+} // namespace detail
+
+class async_trace
+{
+public:
+    static constexpr std::size_t ring_capacity = 1 << 14;
+    static constexpr std::size_t max_threads = 256;
+
+    struct ring
+    {
+        // Written only by the owning thread; dump reads them
+        std::atomic<std::uint64_t> head{0};
+        std::uint64_t next_id = 0;
+        std::uint64_t current = 0;
+        std::uint64_t index = 0;
+        trace_record records[ring_capacity];
+    };
+
+    // The compiler's name for T, inside the text of the function
+    // name; dump trims it. A member rather than a function in
+    // detail, since GCC leaves off the qualification T shares
+    // with the function.
+    template<class T>
+    static constexpr char const* type_name() noexcept
+    {
+#if defined(__GNUC__)
+        return __PRETTY_FUNCTION__;
+#else
+        return "awaitable";
+#endif
+    }
+
+    // The calling thread's ring
+    static ring& local() noexcept
+    {
+        static thread_local ring* r = nullptr;
+        if(!r) [[unlikely]]
+            r = attach();
+        return *r;
+    }
+
+    static void record(ring& r, trace_event e, std::uint64_t task,
+        char const* what, std::uint64_t parent = 0) noexcept
+    {
+        auto const h = r.head.load(std::memory_order_relaxed);
+        auto& rec = r.records[h & (ring_capacity - 1)];
+        rec.tsc = detail::trace_clock();
+        rec.task = task;
+        rec.what = what;
+        rec.parent = parent;
+        rec.event = static_cast<std::uint8_t>(e);
+        r.head.store(h + 1, std::memory_order_release);
+    }
+
+    // A new task id, unique across threads: the ring's index
+    // above a per-ring count
+    static std::uint64_t next_id(ring& r) noexcept
+    {
+        return ((r.index + 1) << 40) | ++r.next_id;
+    }
+
+    static void dump(std::FILE* out)
+    {
+        auto& st = state();
+        auto const tsc1 = detail::trace_clock();
+        auto const ns1 = steady_ns();
+        double const ticks_per_us = ns1 > st.ns0
+            ? static_cast<double>(tsc1 - st.tsc0) * 1000.0 /
+                static_cast<double>(ns1 - st.ns0)
+            : 1000.0;
+
+        std::fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        char const* sep = "\n";
+        auto const n = st.count.load(std::memory_order_acquire);
+        for(std::size_t t = 0; t < n && t < max_threads; ++t)
+        {
+            auto* r = st.rings[t].load(std::memory_order_acquire);
+            if(!r)
+                continue;
+            auto const head = r->head.load(std::memory_order_acquire);
+            auto const first = head > ring_capacity ? head - ring_capacity : 0;
+            for(auto i = first; i < head; ++i)
+            {
+                trace_record const rec = r->records[i & (ring_capacity - 1)];
+                // The owner overwrites slot i while writing record
+                // i + ring_capacity, before it publishes the head
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(i + ring_capacity <= r->head.load(std::memory_order_relaxed))
+                    continue;
+                double const ts = static_cast<double>(rec.tsc - st.tsc0) /
+                    ticks_per_us;
+                auto const e = static_cast<trace_event>(rec.event);
+                auto const emit = [&](char const* ph, char const* cat,
+                    std::string_view name)
+                {
+                    std::fprintf(out, "%s{\"ph\":\"%s\",\"cat\":\"%s\","
+                        "\"name\":", sep, ph, cat);
+                    write_string(out, name);
+                    std::fprintf(out, ",\"id\":\"0x%llx\",\"ts\":%.3f,"
+                        "\"pid\":1,\"tid\":%zu",
+                        static_cast<unsigned long long>(rec.task), ts, t);
+                    sep = ",\n";
+                };
+                switch(e)
+                {
+                case trace_event::create:
+                    emit("b", "task", rec.what);
+                    std::fprintf(out, ",\"args\":{\"parent\":\"0x%llx\"}}",
+                        static_cast<unsigned long long>(rec.parent));
+                    emit("b", "task", "initial_suspend");
+                    std::fputc('}', out);
+                    break;
+                case trace_event::suspend:
+                case trace_event::resume:
+                    emit(e == trace_event::suspend ? "b" : "e", "task",
+                        detail::trim_type_name(rec.what));
+                    std::fputc('}', out);
+                    break;
+                case trace_event::complete:
+                    emit("e", "task", rec.what);
+                    std::fputc('}', out);
+                    break;
+                }
+            }
+        }
+        std::fprintf(out, "\n]}\n");
+    }
+
+private:
+    struct state_type
+    {
+        std::atomic<ring*> rings[max_threads] = {};
+        std::atomic<std::size_t> count{0};
+        std::uint64_t tsc0 = detail::trace_clock();
+        std::uint64_t ns0 = steady_ns();
+    };
+
+    // Never destroyed, so threads tracing during exit still
+    // find their rings
+    static state_type& state() noexcept
+    {
+        alignas(state_type) static unsigned char storage[sizeof(state_type)];
+        static state_type* st = ::new(storage) state_type();
+        return *st;
+    }
+
+    static std::uint64_t steady_ns() noexcept
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // Rings are never freed: dump reads those of threads that
+    // have exited
+    static ring* attach() noexcept
+    {
+        auto& st = state();
+        auto* r = new ring;
+        auto const i = st.count.fetch_add(1, std::memory_order_relaxed);
+        r->index = i;
+        if(i < max_threads)
+            st.rings[i].store(r, std::memory_order_release);
+        return r;
+    }
+
+    static void write_string(std::FILE* out, std::string_view s)
+    {
+        std::fputc('"', out);
+        for(char c : s)
+        {
+            if(c == '"' || c == '\\')
+                std::fputc('\\', out);
+            std::fputc(c, out);
+        }
+        std::fputc('"', out);
+    }
+};
+
+// ============================================================
+// async_stack - opt-in coroutine backtraces
+//
+// A suspended task knows its continuation only as a
+// coroutine_handle<>, which says nothing of the promise behind
+// it, so the chain of awaiting tasks cannot be walked from
+// there. Built with CAPY_ASYNC_STACK=1, every task carries an
+// async_frame instead: the coroutine's name, the co_await it
+// is stopped at, the type it awaits, and links to the task
+// awaiting it and the task it awaits. transform_awaiter links
+// a child task to its parent just before handing over to it;
+// the child unlinks itself at final_suspend.
+//
+// A task that starts with no parent is a root: one started by
+// run_async or run_sync, or by when_all or when_any, whose
+// runners are not tasks. dump prints the logical stack of every
+// live root, outermost first, down to the awaitable the
+// innermost task waits on - where a hung request is stuck, and
+// the off-CPU view of coroutine code. walk copies the stack of
+// the task running on the calling thread, innermost first, for
+// on-CPU samples. It reads only atomics and a thread_local, so
+// a profiler's signal handler may call it.
+//
+// dump locks the list of roots but not the frames under them;
+// a task finishing while its root is printed can be read after
+// it is freed. It is meant for a process that is stuck.
+// ============================================================
+
+struct async_frame
+{
+    std::atomic<async_frame*> parent{nullptr};
+    std::atomic<async_frame*> child{nullptr};
+    char const* function = nullptr;
+
+    // The last co_await, and the type of a suspended one
+    std::atomic<std::source_location> where{};
+    std::atomic<char const*> awaiting{nullptr};
+
+    // Root list links, under async_stack's mutex
+    async_frame* prev_root = nullptr;
+    async_frame* next_root = nullptr;
+    bool root = false;
+};
+
+class async_stack
+{
+public:
+    // The frame of the task running on this thread, if any
+    static async_frame*& current() noexcept
+    {
+        static thread_local async_frame* f = nullptr;
+        return f;
+    }
+
+    // Copies up to n frames of the running task's stack to out,
+    // innermost first, and returns how many
+    static std::size_t walk(async_frame const** out, std::size_t n) noexcept
+    {
+        std::size_t i = 0;
+        for(auto* f = current(); f && i < n;
+            f = f->parent.load(std::memory_order_relaxed))
+            out[i++] = f;
+        return i;
+    }
+
+    static void add_root(async_frame& f)
+    {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        f.root = true;
+        f.next_root = st.head;
+        if(st.head)
+            st.head->prev_root = &f;
+        st.head = &f;
+    }
+
+    static void remove_root(async_frame& f) noexcept
+    {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        if(!f.root)
+            return;
+        f.root = false;
+        if(f.prev_root)
+            f.prev_root->next_root = f.next_root;
+        else
+            st.head = f.next_root;
+        if(f.next_root)
+            f.next_root->prev_root = f.prev_root;
+        f.prev_root = f.next_root = nullptr;
+    }
+
+    // Calls fn(async_frame const&) for every live root, with
+    // the list locked
+    template<class F>
+    static void for_each_root(F&& fn)
+    {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        for(auto* f = st.head; f; f = f->next_root)
+            fn(static_cast<async_frame const&>(*f));
+    }
+
+    static void dump(std::FILE* out)
+    {
+        std::size_t n = 0;
+        for_each_root([&](async_frame const& root) {
+            std::fprintf(out, "async stack %zu:\n", n++);
+            async_frame const* f = &root;
+            async_frame const* last = f;
+            for(; f; f = f->child.load(std::memory_order_relaxed))
+            {
+                auto const where = f->where.load(std::memory_order_relaxed);
+                std::fprintf(out, "  %s\n      at %s:%u\n",
+                    f->function ? f->function : "?",
+                    where.file_name(), where.line());
+                last = f;
+            }
+            if(auto* a = last->awaiting.load(std::memory_order_relaxed))
+            {
+                auto const name = detail::trim_type_name(a);
+                std::fprintf(out, "  awaiting %.*s\n",
+                    static_cast<int>(name.size()), name.data());
+            }
+        });
+    }
+
+private:
+    struct state_type
+    {
+        std::mutex mutex;
+        async_frame* head = nullptr;
+    };
+
+    // Never destroyed, so roots freed during exit still unlink
+    static state_type& state() noexcept
+    {
+        alignas(state_type) static unsigned char storage[sizeof(state_type)];
+        static state_type* st = ::new(storage) state_type();
+        return *st;
+    }
+};
+
+// ============================================================
+// IoAwaitable concept
+// ============================================================
+
+template<typename A>
+concept IoAwaitable =
+    requires(
+        A a,
+        std::coroutine_handle<> h,
+        io_env const* env)
+    {
+        a.await_suspend(h, env);
+    };
+
+// ============================================================
+// IoRunnable concept
+// ============================================================
+
+template<typename T>
+concept IoRunnable =
+    IoAwaitable<T> &&
+    requires { typename T::promise_type; } &&
+    requires(T& t, T const& ct,
+             typename T::promise_type const& cp,
+             typename T::promise_type& p)
+    {
+        { ct.handle() } noexcept
+            -> std::same_as<std::coroutine_handle<typename T::promise_type>>;
+        { cp.exception() } noexcept -> std::same_as<std::exception_ptr>;
+        { t.release() } noexcept;
+        { p.set_continuation(std::coroutine_handle<>{}) } noexcept;
+        { p.set_environment(static_cast<io_env const*>(nullptr)) } noexcept;
+    } &&
+    (std::is_void_v<decltype(std::declval<T&>().await_resume())> ||
+     requires(typename T::promise_type& p) {
+         p.result();
+     });
+
+// ============================================================
+// io_awaitable_promise_base CRTP mixin
+// ============================================================
+
+template<typename Derived>
+class io_awaitable_promise_base
+{
+    io_env const* env_ = nullptr;
+    mutable std::coroutine_handle<> cont_{std::noop_coroutine()};
+    capy::continuation yield_;
+#if CAPY_RESUME_BUDGET
+    std::uint32_t budget_ = CAPY_RESUME_BUDGET;
+#endif
+#if CAPY_TRACE
+    std::uint64_t trace_id_ = 0;
+    char const* trace_name_ = nullptr;
+#endif
+#if CAPY_ASYNC_STACK
+    async_frame frame_;
+
+    // Leaves the root list, or the parent's child link
+    void stack_unlink() noexcept
+    {
+        if(frame_.root)
+            async_stack::remove_root(frame_);
+        else if(auto* p = frame_.parent.exchange(nullptr, std::memory_order_relaxed))
+        {
+            auto* self = &frame_;
+            p->child.compare_exchange_strong(self, nullptr,
+                std::memory_order_relaxed);
+        }
+    }
+#endif
+
+public:
+    static void*
+    operator new(std::size_t size)
+    {
+        auto* mr = get_cached_frame_allocator();
+        if(!mr)
+            mr = &default_frame_pool();
+
+        auto total = size + sizeof(std::pmr::memory_resource*);
+        void* raw = mr->allocate(total, alignof(std::max_align_t));
+        std::memcpy(static_cast<char*>(raw) + size, &mr, sizeof(mr));
+#if CAPY_FRAME_TELEMETRY
+        frame_telemetry::pending_size() = total;
+#endif
+        return raw;
+    }
+
+    static void
+    operator delete(void* ptr, std::size_t size) noexcept
+    {
+        std::pmr::memory_resource* mr;
+        std::memcpy(&mr, static_cast<char*>(ptr) + size, sizeof(mr));
+        auto total = size + sizeof(std::pmr::memory_resource*);
+        mr->deallocate(ptr, total, alignof(std::max_align_t));
+    }
+
+    ~io_awaitable_promise_base()
+    {
+#if CAPY_ASYNC_STACK
+        stack_unlink();
+#endif
+        if(cont_ != std::noop_coroutine())
+            cont_.destroy();
+    }
+
+    void set_continuation(std::coroutine_handle<> cont) noexcept
+    {
+        cont_ = cont;
+    }
+
+    std::coroutine_handle<> continuation() const noexcept
+    {
+        return std::exchange(cont_, std::noop_coroutine());
+    }
+
+    void set_environment(io_env const* env) noexcept
+    {
+        env_ = env;
+    }
+
+    io_env const* environment() const noexcept
+    {
+        return env_;
+    }
+
+#if CAPY_TRACE
+    // The derived promise's constructor names the coroutine. The
+    // task running on this thread, if any, is its parent.
+    void trace_create(char const* name) noexcept
+    {
+        auto& r = async_trace::local();
+        trace_id_ = async_trace::next_id(r);
+        trace_name_ = name;
+        async_trace::record(r, trace_event::create, trace_id_, name, r.current);
+    }
+
+    void trace_suspend(char const* what) noexcept
+    {
+        auto& r = async_trace::local();
+        r.current = 0;
+        async_trace::record(r, trace_event::suspend, trace_id_, what);
+    }
+
+    void trace_resume(char const* what) noexcept
+    {
+        auto& r = async_trace::local();
+        r.current = trace_id_;
+        async_trace::record(r, trace_event::resume, trace_id_, what);
+    }
+
+    void trace_complete() noexcept
+    {
+        auto& r = async_trace::local();
+        r.current = 0;
+        async_trace::record(r, trace_event::complete, trace_id_, trace_name_);
+    }
+#endif
+
+#if CAPY_ASYNC_STACK
+    async_frame& frame() noexcept
+    {
+        return frame_;
+    }
+
+    // A task started with no parent is a root
+    void stack_start()
+    {
+        if(!frame_.parent.load(std::memory_order_relaxed))
+            async_stack::add_root(frame_);
+        async_stack::current() = &frame_;
+    }
+
+    // Called before a suspends this coroutine. A child task is
+    // linked so the stack can be walked through it.
+    template<class A>
+    void stack_suspend(A& a) noexcept
+    {
+        frame_.awaiting.store(async_trace::type_name<A>(),
+            std::memory_order_relaxed);
+        if constexpr(requires { a.handle().promise().frame(); })
+        {
+            auto& child = a.handle().promise().frame();
+            child.parent.store(&frame_, std::memory_order_relaxed);
+            frame_.child.store(&child, std::memory_order_relaxed);
+        }
+        async_stack::current() = nullptr;
+    }
+
+    void stack_resume() noexcept
+    {
+        frame_.awaiting.store(nullptr, std::memory_order_relaxed);
+        async_stack::current() = &frame_;
+    }
+
+    void stack_finish() noexcept
+    {
+        stack_unlink();
+        async_stack::current() = nullptr;
+    }
+#endif
+
+    // Posts the coroutine to its executor. Returns false, posting
+    // nothing, when called from within such a post on this
+    // thread: an executor that resumes posts inline, such as
+    // inline_executor, would otherwise add a frame of stack per
+    // yield, so there the coroutine carries on instead.
+    bool post_self(std::coroutine_handle<> h)
+    {
+        auto& yielding = detail::tls_yielding();
+        if(yielding)
+            return false;
+#if CAPY_RESUME_BUDGET
+        budget_ = CAPY_RESUME_BUDGET;
+#endif
+        struct clear
+        {
+            bool& b;
+            ~clear() { b = false; }
+        };
+        yielding = true;
+        clear guard{yielding};
+        yield_.h = h;
+        env_->executor.post(yield_);
+        return true;
+    }
+
+#if CAPY_RESUME_BUDGET
+    // Counts an await that completed without suspending. True
+    // once the budget is spent, when the task should yield.
+    bool budget_spent() noexcept
+    {
+        return --budget_ == 0;
+    }
+
+    void reset_budget() noexcept
+    {
+        budget_ = CAPY_RESUME_BUDGET;
+    }
+#endif
+
+    // What this_coro::executor yields. Derived may shadow it to
+    // return a typed executor.
+    executor_ref executor() const noexcept
+    {
+        return env_->executor;
+    }
+
+    template<typename A>
+    decltype(auto) transform_awaitable(A&& a)
+    {
+        return std::forward<A>(a);
+    }
+
+    // The default argument is the co_await expression's location
+    template<typename T>
+    auto await_transform(T&& t,
+        std::source_location where = std::source_location::current())
+    {
+        using Tag = std::decay_t<T>;
+#if CAPY_ASYNC_STACK
+        frame_.where.store(where, std::memory_order_relaxed);
+#else
+        (void)where;
+#endif
+
+        if constexpr (std::is_same_v<Tag, this_coro::environment_tag>)
+        {
+            struct awaiter
+            {
+                io_env const* env_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                io_env const* await_resume() const noexcept { return env_; }
+            };
+            return awaiter{env_};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::executor_tag>)
+        {
+            using executor_type = decltype(
+                static_cast<Derived const*>(this)->executor());
+            struct awaiter
+            {
+                executor_type executor_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                executor_type await_resume() const noexcept { return executor_; }
+            };
+            return awaiter{static_cast<Derived const*>(this)->executor()};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::stop_token_tag>)
+        {
+            struct awaiter
+            {
+                std::stop_token token_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                std::stop_token await_resume() const noexcept { return token_; }
+            };
+            return awaiter{env_->stop_token};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::frame_allocator_tag>)
+        {
+            struct awaiter
+            {
+                std::pmr::memory_resource* frame_allocator_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                std::pmr::memory_resource* await_resume() const noexcept { return frame_allocator_; }
+            };
+            return awaiter{env_->frame_allocator};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::yield_tag>)
+        {
+            struct awaiter
+            {
+                io_awaitable_promise_base* p_;
+                bool await_ready() const noexcept { return false; }
+
+                bool await_suspend(std::coroutine_handle<> h) const
+                {
+                    return p_->post_self(h);
+                }
+
+                void await_resume() const noexcept
+                {
+                    detail::restore_frame_allocator(
+                        p_->env_->frame_allocator);
+                }
+            };
+            return awaiter{this};
+        }
+        else
+        {
+            return static_cast<Derived*>(this)->transform_awaitable(
+                std::forward<T>(t));
+        }
+    }
+};
+
+// ============================================================
+// task<T> — lazy coroutine task satisfying IoRunnable
+//
+// Options tune a task without changing how it is awaited:
+//
+//   use_executor<Ex>  this_coro::executor yields a
+//                     known_executor_ref<Ex>, which calls an Ex
+//                     directly. The task still runs on any
+//                     executor.
+//
+//   noexcept_tag      The task keeps no exception storage and
+//                     terminates if one escapes. Every task is
+//                     built this way when CAPY_HAS_EXCEPTIONS is
+//                     0.
+//
+//   use_frame_allocator<A>
+//                     The frame comes from FrameAllocator A, not
+//                     from the cached memory_resource, and has
+//                     no trailer.
+// ============================================================
+
+template<Executor Ex>
+struct use_executor {};
+
+struct noexcept_tag {};
+
+template<FrameAllocator A>
+struct use_frame_allocator {};
+
+namespace detail {
+
+template<class... Options>
+struct task_executor
+{
+    using type = executor_ref;
+};
+
+template<class Ex, class... Rest>
+struct task_executor<use_executor<Ex>, Rest...>
+{
+    using type = known_executor_ref<Ex>;
+};
+
+template<class First, class... Rest>
+struct task_executor<First, Rest...> : task_executor<Rest...>
+{
+};
+
+template<class... Options>
+struct task_frame_allocator
+{
+    using type = void;
+};
+
+template<class A, class... Rest>
+struct task_frame_allocator<use_frame_allocator<A>, Rest...>
+{
+    using type = A;
+};
+
+template<class First, class... Rest>
+struct task_frame_allocator<First, Rest...> : task_frame_allocator<Rest...>
+{
+};
+
+// Where a task keeps its outcome. The value and the exception
+// share one union, so the slot costs the larger of the two plus
+// a state byte, not an optional and an exception_ptr side by
+// side. Nothrow tasks keep no exception at all; an exception
+// that escapes one terminates.
+
+enum class result_state : unsigned char
+{
+    empty,
+    value,
+    exception
+};
+
+template<typename T, bool Nothrow>
+class task_return_base
+{
+    union
+    {
+        T value_;
+        std::exception_ptr ep_;
+    };
+    result_state state_ = result_state::empty;
+
+public:
+    task_return_base() noexcept {}
+
+    ~task_return_base()
+    {
+        if(state_ == result_state::value)
+            value_.~T();
+        else if(state_ == result_state::exception)
+            ep_.~exception_ptr();
+    }
+
+    void return_value(T value)
+    {
+        ::new(static_cast<void*>(&value_)) T(std::move(value));
+        state_ = result_state::value;
+    }
+
+    void unhandled_exception() noexcept
+    {
+        ::new(static_cast<void*>(&ep_)) std::exception_ptr(
+            std::current_exception());
+        state_ = result_state::exception;
+    }
+
+    std::exception_ptr exception() const noexcept
+    {
+        if(state_ == result_state::exception)
+            return ep_;
+        return {};
+    }
+
+    void rethrow_if_exception() const
+    {
+        if(state_ == result_state::exception)
+            std::rethrow_exception(ep_);
+    }
+
+    T&& result() noexcept { return std::move(value_); }
+};
+
+template<typename T>
+class task_return_base<T, true>
+{
+    union
+    {
+        T value_;
+    };
+    bool has_value_ = false;
+
+public:
+    task_return_base() noexcept {}
+
+    ~task_return_base()
+    {
+        if(has_value_)
+            value_.~T();
+    }
+
+    void return_value(T value)
+    {
+        ::new(static_cast<void*>(&value_)) T(std::move(value));
+        has_value_ = true;
+    }
+
+    void unhandled_exception() noexcept { std::terminate(); }
+    std::exception_ptr exception() const noexcept { return {}; }
+    void rethrow_if_exception() const noexcept {}
+
+    T&& result() noexcept { return std::move(value_); }
+};
+
+template<>
+class task_return_base<void, false>
+{
+    std::exception_ptr ep_;
+
+public:
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept
+    {
+        ep_ = std::current_exception();
+    }
+
+    std::exception_ptr exception() const noexcept { return ep_; }
+
+    void rethrow_if_exception() const
+    {
+        if(ep_)
+            std::rethrow_exception(ep_);
+    }
+};
+
+template<>
+class task_return_base<void, true>
+{
+public:
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+    std::exception_ptr exception() const noexcept { return {}; }
+    void rethrow_if_exception() const noexcept {}
+};
+
+static_assert(sizeof(task_return_base<long, false>) == 2 * sizeof(void*));
+static_assert(sizeof(task_return_base<void, true>) == 1);
+
+} // namespace detail
+
+template<typename T = void, class... Options>
+struct [[nodiscard]] task
+{
+    static constexpr bool is_nothrow = !CAPY_HAS_EXCEPTIONS ||
+        (std::is_same_v<Options, noexcept_tag> || ...);
+
+    struct promise_type
+        : io_awaitable_promise_base<promise_type>
+        , detail::task_return_base<T, is_nothrow>
+    {
+        using executor_type = typename detail::task_executor<Options...>::type;
+        using frame_allocator_type =
+            typename detail::task_frame_allocator<Options...>::type;
+
+        static void* operator new(std::size_t size)
+        {
+            if constexpr (std::is_void_v<frame_allocator_type>)
+            {
+                return io_awaitable_promise_base<promise_type>::operator new(size);
+            }
+            else
+            {
+#if CAPY_FRAME_TELEMETRY
+                frame_telemetry::pending_size() = size;
+#endif
+                return frame_allocator_type::allocate(size);
+            }
+        }
+
+        static void operator delete(void* ptr, std::size_t size) noexcept
+        {
+            if constexpr (std::is_void_v<frame_allocator_type>)
+                io_awaitable_promise_base<promise_type>::operator delete(ptr, size);
+            else
+                frame_allocator_type::deallocate(ptr, size);
+        }
+
+#if CAPY_FRAME_TELEMETRY
+        detail::frame_record record_;
+#endif
+
+#if CAPY_FRAME_TELEMETRY || CAPY_TRACE || CAPY_ASYNC_STACK
+        // The default argument names the coroutine, not this line
+        promise_type(std::source_location loc =
+            std::source_location::current()) noexcept
+#if CAPY_FRAME_TELEMETRY
+            : record_(loc)
+#endif
+        {
+#if CAPY_TRACE
+            this->trace_create(loc.function_name());
+#endif
+#if CAPY_ASYNC_STACK
+            this->frame().function = loc.function_name();
+            this->frame().where.store(loc, std::memory_order_relaxed);
+#endif
+            (void)loc;
+        }
+#endif
+
+        executor_type executor() const noexcept
+        {
+            return executor_type(this->environment()->executor);
+        }
+
+        task get_return_object()
+        {
+            return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        auto initial_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
+
+                void await_suspend(std::coroutine_handle<>) const noexcept
+                {
+                }
+
+                void await_resume() const noexcept
+                {
+#if CAPY_TRACE
+                    p_->trace_resume("initial_suspend");
+#endif
+#if CAPY_ASYNC_STACK
+                    p_->stack_start();
+#endif
+                    detail::restore_frame_allocator(
+                        p_->environment()->frame_allocator);
+                }
+            };
+            return awaiter{this};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
+                {
+#if CAPY_TRACE
+                    p_->trace_complete();
+#endif
+#if CAPY_ASYNC_STACK
+                    p_->stack_finish();
+#endif
+                    return p_->continuation();
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{this};
+        }
+
+        // Nothing else runs on this thread between a ready
+        // await_ready and await_resume, so a synchronous
+        // completion leaves the cached allocator alone.
+        //
+        // A ready await spends one unit of the task's resume
+        // budget. The await that spends the last suspends anyway
+        // and posts the task, which resumes into await_resume as
+        // if the awaitable had completed later. Any suspension
+        // refills the budget.
+        template<class Awaitable>
+        struct transform_awaiter
+        {
+            std::decay_t<Awaitable> a_;
+            promise_type* p_;
+            bool ready_ = false;
+#if CAPY_RESUME_BUDGET
+            bool yield_ = false;
+#endif
+
+            bool await_ready() noexcept
+            {
+                ready_ = a_.await_ready();
+#if CAPY_RESUME_BUDGET
+                if(ready_ && p_->budget_spent()) [[unlikely]]
+                {
+                    ready_ = false;
+                    yield_ = true;
+                }
+#endif
+                return ready_;
+            }
+
+            decltype(auto) await_resume()
+            {
+                if(!ready_)
+                {
+#if CAPY_TRACE
+                    p_->trace_resume(
+                        async_trace::type_name<std::decay_t<Awaitable>>());
+#endif
+#if CAPY_ASYNC_STACK
+                    p_->stack_resume();
+#endif
+                    detail::restore_frame_allocator(
+                        p_->environment()->frame_allocator);
+                }
+                return a_.await_resume();
+            }
+
+            // Traced before the awaitable sees the handle: once it
+            // does, the coroutine may resume, or be gone
+            template<class Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+            {
+#if CAPY_TRACE
+                p_->trace_suspend(
+                    async_trace::type_name<std::decay_t<Awaitable>>());
+#endif
+#if CAPY_ASYNC_STACK
+                p_->stack_suspend(a_);
+#endif
+#if CAPY_RESUME_BUDGET
+                p_->reset_budget();
+                if(yield_) [[unlikely]]
+                {
+                    yield_ = false;
+                    if(p_->post_self(h))
+                        return std::noop_coroutine();
+                    return h;
+                }
+#endif
+                using R = decltype(a_.await_suspend(h, p_->environment()));
+                if constexpr (std::is_void_v<R>)
+                {
+                    a_.await_suspend(h, p_->environment());
+                    return std::noop_coroutine();
+                }
+                else if constexpr (std::is_same_v<R, bool>)
+                {
+                    if(a_.await_suspend(h, p_->environment()))
+                        return std::noop_coroutine();
+                    return h;
+                }
+                else
+                {
+                    return a_.await_suspend(h, p_->environment());
+                }
+            }
+        };
+
+        template<class Awaitable>
+        auto transform_awaitable(Awaitable&& a)
+        {
+            using A = std::decay_t<Awaitable>;
+            if constexpr (IoAwaitable<A>)
+            {
+                return transform_awaiter<Awaitable>{
+                    std::forward<Awaitable>(a), this};
+            }
+            else
+            {
+                static_assert(sizeof(A) == 0, "requires IoAwaitable");
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> h_;
+
+    ~task()
+    {
+        if(h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    auto await_resume() noexcept(is_nothrow)
+    {
+        h_.promise().rethrow_if_exception();
+        if constexpr (! std::is_void_v<T>)
+            return h_.promise().result();
+        else
+            return;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont, io_env const* env)
+    {
+        h_.promise().set_continuation(cont);
+        h_.promise().set_environment(env);
+        return h_;
+    }
+
+    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+
+    void release() noexcept { h_ = nullptr; }
+
+    task(task const&) = delete;
+    task& operator=(task const&) = delete;
+
+    task(task&& other) noexcept
+        : h_(std::exchange(other.h_, nullptr))
+    {
+    }
+
+    task& operator=(task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h)
+        : h_(h)
+    {
+    }
+};
+
+// ============================================================
+// Concept satisfaction checks
+// ============================================================
+
+static_assert(IoAwaitable<task<int>>);
+static_assert(IoRunnable<task<int>>);
+static_assert(IoAwaitable<task<>>);
+static_assert(IoRunnable<task<>>);
+
+// ============================================================
+// inline_task<T> - a task whose frame its awaiter can hold
+//
+// A child task awaited at once, as in co_await compute(3),
+// lives and dies within the co_await expression, so its frame
+// could sit inside the parent's. A task frame comes from the
+// allocator cached in a thread_local, through a virtual call,
+// which hides the allocation from the optimizer; an inline_task
+// frame comes from FrameAllocator A, by default the global
+// operator new, with nothing in between.
+//
+// With Clang 20 and later, inline_task is also marked
+// coro_await_elidable: the call in co_await f(), made in a
+// coroutine that itself returns an inline_task, gets its frame
+// from the awaiting coroutine's frame and allocates nothing.
+// An inline_task kept in a variable, passed to when_all or
+// run_async, or awaited from a task is allocated as usual.
+// Other compilers treat it as a task<T, use_frame_allocator<A>>.
+//
+// The parent's frame grows by each child it holds, so an
+// inline_task suits small children on the hot path; a deep or
+// recursive chain is better left to task.
+// ============================================================
+
+template<class T = void, FrameAllocator A = new_frame_allocator>
+class CAPY_CORO_AWAIT_ELIDABLE [[nodiscard]] inline_task
+    : public task<T, use_frame_allocator<A>>
+{
+    using base = task<T, use_frame_allocator<A>>;
+
+public:
+    using promise_type = typename base::promise_type;
+
+    // From promise_type::get_return_object
+    inline_task(base&& t) noexcept
+        : base(std::move(t))
+    {
+    }
+};
+
+static_assert(IoAwaitable<inline_task<int>>);
+static_assert(IoRunnable<inline_task<int>>);
+
+// ============================================================
+// inline_executor — trivial synchronous executor for demo
+// ============================================================
+
+struct inline_context : execution_context {};
+
+struct inline_executor
+{
+    inline_context* ctx_;
+
+    execution_context& context() const noexcept { return *ctx_; }
+    void on_work_started() const noexcept {}
+    void on_work_finished() const noexcept {}
+
+    std::coroutine_handle<> dispatch(continuation& c) const
+    {
+        return c.h;
+    }
+
+    void post(continuation& c) const
+    {
+        safe_resume(c.h);
+    }
+
+    bool operator==(inline_executor const& other) const noexcept
+    {
+        return ctx_ == other.ctx_;
+    }
+};
+
+static_assert(Executor<inline_executor>);
+static_assert(any_executor::fits<inline_executor>);
+static_assert(Executor<known_executor_ref<inline_executor>>);
+static_assert(IoRunnable<task<int, use_executor<inline_executor>>>);
+
+// ============================================================
+// continuation_queue - intrusive lock-free MPSC queue
+//
+// Dmitry Vyukov's non-blocking MPSC node queue, linked through
+// continuation::next. Any number of threads may push; one
+// thread at a time may pop. A push is a single exchange no
+// matter how many continuations it carries, so a completion
+// thread can hand a whole chain of ready work to a consumer in
+// one atomic operation.
+//
+// pop() can report empty while a producer is between its
+// exchange and its link store. Every producer must therefore
+// wake the consumer after pushing, never before.
+// ============================================================
+
+class continuation_queue
+{
+    alignas(64) std::atomic<continuation*> head_;
+    alignas(64) continuation* tail_;
+    continuation stub_;
+
+    static std::atomic_ref<continuation*> link(continuation& c) noexcept
+    {
+        return std::atomic_ref<continuation*>(c.next);
+    }
+
+public:
+    continuation_queue() noexcept
+        : head_(&stub_)
+        , tail_(&stub_)
+    {
+    }
+
+    continuation_queue(continuation_queue const&) = delete;
+    continuation_queue& operator=(continuation_queue const&) = delete;
+
+    void push(continuation& c) noexcept
+    {
+        push(c, c);
+    }
+
+    // Splices the chain first..last, already linked through
+    // next, onto the queue.
+    void push(continuation& first, continuation& last) noexcept
+    {
+        link(last).store(nullptr, std::memory_order_relaxed);
+        auto* prev = head_.exchange(&last, std::memory_order_acq_rel);
+        link(*prev).store(&first, std::memory_order_release);
+    }
+
+    // Splices a null-terminated chain. Returns its length.
+    std::size_t push_chain(continuation* first) noexcept
+    {
+        if(!first)
+            return 0;
+        std::size_t n = 1;
+        auto* last = first;
+        while(last->next)
+        {
+            last = last->next;
+            ++n;
+        }
+        push(*first, *last);
+        return n;
+    }
+
+    continuation* pop() noexcept
+    {
+        auto* tail = tail_;
+        auto* next = link(*tail).load(std::memory_order_acquire);
+        if(tail == &stub_)
+        {
+            if(!next)
+                return nullptr;
+            tail_ = next;
+            tail = next;
+            next = link(*next).load(std::memory_order_acquire);
+        }
+        if(next)
+        {
+            tail_ = next;
+            tail->next = nullptr;
+            return tail;
+        }
+        if(tail != head_.load(std::memory_order_acquire))
+            return nullptr;
+        push(stub_);
+        next = link(*tail).load(std::memory_order_acquire);
+        if(next)
+        {
+            tail_ = next;
+            tail->next = nullptr;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    // Consumer only
+    bool empty() const noexcept
+    {
+        return head_.load(std::memory_order_acquire) == tail_ &&
+            tail_ == &stub_;
+    }
+};
+
+// ============================================================
+// work_deque - Chase-Lev work-stealing deque
+//
+// The owning worker pushes and pops at the bottom; any other
+// worker may steal from the top. Capacity is fixed, and a push
+// into a full deque fails so the caller can fall back to the
+// pool's injection queue. Memory orders follow Le, Pop, Cohen
+// and Zappa Nardelli, "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP 2013).
+// ============================================================
+
+namespace detail {
+
+class work_deque
+{
+public:
+    static constexpr std::int64_t capacity = 1024;
+
+    bool push(continuation* c) noexcept
+    {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_.load(std::memory_order_acquire);
+        if(b - t >= capacity)
+            return false;
+        buf_[b & mask].store(c, std::memory_order_relaxed);
+        // A release store rather than the paper's release fence:
+        // the same instructions, and visible to ThreadSanitizer,
+        // which ignores fences
+        bottom_.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    continuation* pop() noexcept
+    {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_relaxed);
+        if(t > b)
+        {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto* c = buf_[b & mask].load(std::memory_order_relaxed);
+        if(t == b)
+        {
+            // Last element: race against thieves for it
+            if(!top_.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
+                c = nullptr;
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return c;
+    }
+
+    continuation* steal() noexcept
+    {
+        auto t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_acquire);
+        if(t >= b)
+            return nullptr;
+        auto* c = buf_[t & mask].load(std::memory_order_relaxed);
+        if(!top_.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return c;
+    }
+
+    // A snapshot, for deciding whether to wake a thief; the
+    // owner and other thieves may change it at once
+    bool empty() const noexcept
+    {
+        auto t = top_.load(std::memory_order_acquire);
+        return bottom_.load(std::memory_order_acquire) <= t;
+    }
+
+private:
+    static constexpr std::int64_t mask = capacity - 1;
+
+    alignas(64) std::atomic<std::int64_t> top_{0};
+    alignas(64) std::atomic<std::int64_t> bottom_{0};
+    alignas(64) std::atomic<continuation*> buf_[capacity] = {};
+};
+
+// Tells the core the thread is in a spin-wait loop, so it backs
+// off the pipeline and gives a sibling hyperthread its turn
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+} // namespace detail
+
+// ============================================================
+// thread_pool - multi-threaded work-stealing execution_context
+//
+// Each worker owns a work_deque and a LIFO slot. A post from a
+// worker thread goes into its LIFO slot, so the continuation
+// posted last runs next and stays hot in cache; whatever was in
+// the slot moves to the deque, where idle workers can steal it.
+// Posts from outside the pool, and overflow from a full deque,
+// go to a continuation_queue. Producers never lock; workers
+// take turns as its single consumer, moving a batch into their
+// own deque where the others can steal it.
+//
+// Outstanding work counts queued continuations plus every
+// on_work_started not yet matched by on_work_finished. run()
+// uses the calling thread as worker 0, starts the rest, and
+// returns once outstanding work reaches zero.
+//
+// A worker that runs out of work goes idle in three steps, set
+// by an idle_policy: it polls the queues with a pause between
+// polls, then polls with a yield between them, then parks on a
+// futex until a post wakes it. Only one worker at a time spins
+// and yields, the searcher; the rest park at once, so a burst
+// of posts wakes one thread rather than a herd. While a searcher
+// is out, posts wake no one, since it will find the work. When
+// it does, it wakes a parked worker to search in its place, and
+// a woken worker starts out as the searcher, so each one that
+// finds work wakes the next while work keeps arriving.
+// Spinning is turned off on a single CPU, where the spinner
+// would only be holding up the thread it waits for.
+// ============================================================
+
+// How long an idle worker looks for work before parking.
+// Zero for both parks at once.
+struct idle_policy
+{
+    // Polls of the queues with a pause instruction between them
+    unsigned spins = 64;
+
+    // Polls with a yield of the time slice between them, after
+    // the spins
+    unsigned yields = 4;
+};
+
+class thread_pool : public execution_context
+{
+    struct worker
+    {
+        detail::work_deque deque;
+        continuation* lifo = nullptr;
+        thread_pool* pool = nullptr;
+        std::uint32_t seed = 0;
+        std::uint32_t ticks = 0;
+        std::uint32_t lifo_runs = 0;
+
+        // Written only by the worker's own thread
+        std::atomic<std::uint64_t> spins{0};
+        std::atomic<std::uint64_t> yields{0};
+        std::atomic<std::uint64_t> parks{0};
+    };
+
+    std::size_t size_;
+    std::unique_ptr<worker[]> workers_;
+    idle_policy policy_;
+    alignas(64) std::atomic<std::size_t> work_{0};
+    alignas(64) std::atomic<std::size_t> idle_{0};
+    std::atomic<bool> searching_{false};
+
+    continuation_queue inject_;
+    std::atomic<bool> draining_{false};
+
+    // The futex word parked workers wait on; a wakeup bumps it
+    alignas(64) std::atomic<std::uint32_t> epoch_{0};
+    std::atomic<std::uint64_t> wakeups_{0};
+
+    static worker*& current() noexcept
+    {
+        static thread_local worker* w = nullptr;
+        return w;
+    }
+
+public:
+    class executor_type
+    {
+        thread_pool* pool_;
+
+    public:
+        explicit executor_type(thread_pool& pool) noexcept
+            : pool_(&pool)
+        {
+        }
+
+        thread_pool& context() const noexcept { return *pool_; }
+
+        void on_work_started() const noexcept
+        {
+            pool_->work_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void on_work_finished() const noexcept
+        {
+            pool_->work_finished();
+        }
+
+        std::coroutine_handle<> dispatch(continuation& c) const
+        {
+            if(pool_->running_in_this_thread())
+                return c.h;
+            post(c);
+            return std::noop_coroutine();
+        }
+
+        void post(continuation& c) const
+        {
+            pool_->post(c);
+        }
+
+        // Posts a null-terminated chain linked through next
+        // with one queue operation and one wakeup.
+        void post_batch(continuation* head) const
+        {
+            pool_->post_batch(head);
+        }
+
+        bool operator==(executor_type const& other) const noexcept
+        {
+            return pool_ == other.pool_;
+        }
+    };
+
+    // Totals over all workers since construction
+    struct idle_stats
+    {
+        std::uint64_t spins = 0;    // polls between pauses
+        std::uint64_t yields = 0;   // polls between yields
+        std::uint64_t parks = 0;    // futex waits
+        std::uint64_t wakeups = 0;  // futex wakes of a parked worker
+    };
+
+    explicit thread_pool(
+        std::size_t threads = std::thread::hardware_concurrency(),
+        idle_policy policy = {})
+        : size_(threads ? threads : 1)
+        , workers_(new worker[size_])
+        , policy_(policy)
+    {
+        if(std::thread::hardware_concurrency() == 1)
+            policy_.spins = 0;
+        for(std::size_t i = 0; i < size_; ++i)
+        {
+            workers_[i].pool = this;
+            workers_[i].seed = static_cast<std::uint32_t>(i * 2654435761u + 1);
+        }
+    }
+
+    executor_type get_executor() noexcept { return executor_type(*this); }
+
+    std::size_t size() const noexcept { return size_; }
+
+    idle_policy policy() const noexcept { return policy_; }
+
+    idle_stats stats() const noexcept
+    {
+        idle_stats s;
+        for(std::size_t i = 0; i < size_; ++i)
+        {
+            s.spins += workers_[i].spins.load(std::memory_order_relaxed);
+            s.yields += workers_[i].yields.load(std::memory_order_relaxed);
+            s.parks += workers_[i].parks.load(std::memory_order_relaxed);
+        }
+        s.wakeups = wakeups_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    bool running_in_this_thread() const noexcept
+    {
+        auto* w = current();
+        return w && w->pool == this;
+    }
+
+    void run()
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(size_ - 1);
+        for(std::size_t i = 1; i < size_; ++i)
+            threads.emplace_back([this, i] { worker_loop(workers_[i]); });
+        worker_loop(workers_[0]);
+        for(auto& t : threads)
+            t.join();
+    }
+
+private:
+    void post(continuation& c)
+    {
+        work_.fetch_add(1, std::memory_order_relaxed);
+        auto* w = current();
+        // A yielding coroutine goes behind all the queued work,
+        // not into the LIFO slot to run next
+        if(w && w->pool == this && !detail::tls_yielding())
+        {
+            auto* displaced = std::exchange(w->lifo, &c);
+            if(!displaced)
+                return;
+            if(!w->deque.push(displaced))
+                inject_.push(*displaced);
+        }
+        else
+        {
+            inject_.push(c);
+        }
+        wake_one();
+    }
+
+    void post_batch(continuation* head)
+    {
+        if(!head)
+            return;
+        continuation* last;
+        auto const n = detail::chain_length(head, last);
+        work_.fetch_add(n, std::memory_order_relaxed);
+        inject_.push(*head, *last);
+        wake_one();
+    }
+
+    // One worker at a time consumes the injection queue. It
+    // keeps the first continuation and moves up to a deque's
+    // worth more into its own deque, then wakes a helper if it
+    // left work behind in either.
+    continuation* take_injected(worker& w)
+    {
+        if(draining_.load(std::memory_order_relaxed) ||
+            draining_.exchange(true, std::memory_order_acquire))
+            return nullptr;
+        auto* c = inject_.pop();
+        bool moved = false;
+        if(c)
+        {
+            for(std::int64_t i = 0; i < detail::work_deque::capacity / 2; ++i)
+            {
+                auto* more = inject_.pop();
+                if(!more)
+                    break;
+                if(!w.deque.push(more))
+                {
+                    inject_.push(*more);
+                    break;
+                }
+                moved = true;
+            }
+        }
+        bool const more = moved || (c && !inject_.empty());
+        draining_.store(false, std::memory_order_release);
+        if(more)
+            wake_one();
+        return c;
+    }
+
+    continuation* steal(worker& self) noexcept
+    {
+        if(size_ == 1)
+            return nullptr;
+        // xorshift32 picks where the scan starts
+        self.seed ^= self.seed << 13;
+        self.seed ^= self.seed >> 17;
+        self.seed ^= self.seed << 5;
+        auto start = self.seed % size_;
+        for(std::size_t i = 0; i < size_; ++i)
+        {
+            auto& victim = workers_[(start + i) % size_];
+            if(&victim == &self)
+                continue;
+            if(auto* c = victim.deque.steal())
+            {
+                // The victim is busy; what is left may need
+                // another thief
+                if(!victim.deque.empty())
+                    wake_one();
+                return c;
+            }
+        }
+        return nullptr;
+    }
+
+    // Two limits keep a worker from serving only the work it
+    // feeds itself. The LIFO slot runs at most max_lifo_runs
+    // times in a row, or a coroutine that keeps posting itself,
+    // as one yielding does, would never let the deque run; and
+    // every inject_interval-th search takes from the injection
+    // queue first, so posts from outside the pool get a turn.
+    static constexpr std::uint32_t max_lifo_runs = 3;
+    static constexpr std::uint32_t inject_interval = 61;
+
+    continuation* find_work(worker& w)
+    {
+        if(++w.ticks == inject_interval) [[unlikely]]
+        {
+            w.ticks = 0;
+            if(auto* c = take_injected(w))
+                return pass_over_lifo(w, c);
+        }
+        if(w.lifo)
+        {
+            if(w.lifo_runs < max_lifo_runs)
+            {
+                ++w.lifo_runs;
+                return std::exchange(w.lifo, nullptr);
+            }
+            if(auto* c = find_queued(w))
+                return pass_over_lifo(w, c);
+            w.lifo_runs = 0;
+            return std::exchange(w.lifo, nullptr);
+        }
+        w.lifo_runs = 0;
+        return find_queued(w);
+    }
+
+    continuation* find_queued(worker& w)
+    {
+        if(auto* c = w.deque.pop())
+            return c;
+        if(auto* c = take_injected(w))
+            return c;
+        return steal(w);
+    }
+
+    // Moves the LIFO slot, passed over for c, where it can be
+    // stolen
+    continuation* pass_over_lifo(worker& w, continuation* c)
+    {
+        w.lifo_runs = 0;
+        if(auto* l = std::exchange(w.lifo, nullptr))
+        {
+            if(!w.deque.push(l))
+                inject_.push(*l);
+            wake_one();
+        }
+        return c;
+    }
+
+    // A searcher will find the work without being woken; the
+    // fence pairs with the one a searcher issues as it gives up,
+    // and with the announcement of a worker about to park.
+    void wake_one()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(searching_.load(std::memory_order_relaxed) ||
+            idle_.load(std::memory_order_relaxed) == 0)
+            return;
+        epoch_.fetch_add(1, std::memory_order_release);
+        epoch_.notify_one();
+        wakeups_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void wake_all()
+    {
+        epoch_.fetch_add(1, std::memory_order_release);
+        epoch_.notify_all();
+    }
+
+    void work_finished() noexcept
+    {
+        if(work_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            wake_all();
+    }
+
+    static void add(std::atomic<std::uint64_t>& counter, std::uint64_t n) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+
+    bool start_search() noexcept
+    {
+        return !searching_.load(std::memory_order_relaxed) &&
+            !searching_.exchange(true, std::memory_order_acquire);
+    }
+
+    // Posts skipped their wakeup while we searched, so more work
+    // may be queued behind what the search found. The fence
+    // pairs with the one in wake_one.
+    void end_search(bool found)
+    {
+        searching_.store(false, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(found)
+            wake_one();
+    }
+
+    // Polls for work under the idle policy if no other worker is
+    // searching, or if this one already is. Returns null once the
+    // policy is spent, or once outstanding work reaches zero.
+    continuation* search(worker& w, bool searching)
+    {
+        if(!searching && (
+            (policy_.spins == 0 && policy_.yields == 0) || !start_search()))
+            return nullptr;
+
+        continuation* c = nullptr;
+        auto const done = [&] {
+            return (c = find_work(w)) ||
+                work_.load(std::memory_order_acquire) == 0;
+        };
+        bool stop = false;
+        unsigned spins = 0;
+        unsigned yields = 0;
+        while(!stop && spins < policy_.spins)
+        {
+            ++spins;
+            detail::cpu_relax();
+            stop = done();
+        }
+        while(!stop && yields < policy_.yields)
+        {
+            ++yields;
+            std::this_thread::yield();
+            stop = done();
+        }
+        add(w.spins, spins);
+        add(w.yields, yields);
+        end_search(c != nullptr);
+        return c;
+    }
+
+    void worker_loop(worker& w)
+    {
+        auto* saved = std::exchange(current(), &w);
+        auto const run_one = [this](continuation* c) {
+            auto h = c->h;
+            safe_resume(h);
+            work_finished();
+        };
+        // Set while this worker, woken from a park, is the searcher
+        bool searching = false;
+        for(;;)
+        {
+            if(auto* c = find_work(w))
+            {
+                if(std::exchange(searching, false))
+                    end_search(true);
+                run_one(c);
+                continue;
+            }
+            if(work_.load(std::memory_order_acquire) == 0)
+            {
+                if(searching)
+                    end_search(false);
+                break;
+            }
+            if(auto* c = search(w, std::exchange(searching, false)))
+            {
+                run_one(c);
+                continue;
+            }
+            if(work_.load(std::memory_order_acquire) == 0)
+                break;
+
+            // Announce the intent to sleep, then search once more
+            // so a post that missed the announcement is not lost.
+            auto const epoch = epoch_.load(std::memory_order_acquire);
+            idle_.fetch_add(1, std::memory_order_seq_cst);
+            if(auto* c = find_work(w))
+            {
+                idle_.fetch_sub(1, std::memory_order_relaxed);
+                run_one(c);
+                continue;
+            }
+            add(w.parks, 1);
+            while(epoch_.load(std::memory_order_acquire) == epoch &&
+                work_.load(std::memory_order_acquire) != 0)
+                epoch_.wait(epoch, std::memory_order_acquire);
+            idle_.fetch_sub(1, std::memory_order_relaxed);
+            // The post that woke us queued work; look for it as
+            // the searcher, so finding it wakes the next worker
+            searching = start_search();
+        }
+        current() = saved;
+    }
+};
+
+static_assert(Executor<thread_pool::executor_type>);
+static_assert(BatchExecutor<thread_pool::executor_type>);
+static_assert(any_executor::fits<thread_pool::executor_type>);
+
+// ============================================================
+// strand - serialized execution on another executor
+//
+// Continuations posted through a strand run one at a time, in
+// the order posted, on the strand's underlying executor. State
+// touched only from a strand, such as one connection's, needs
+// no mutex, even when the executor is a thread pool.
+//
+// strand_state holds the queue and must outlive the strand
+// executors made from it and all the work they post. The
+// executor, strand<Ex>, is a single pointer to it; it is
+// trivially copyable and fits in any_executor.
+//
+// Queuing allocates nothing: continuations are linked through
+// continuation::next into a continuation_queue. A count of the
+// queued continuations decides who schedules: the post that
+// takes it from zero posts the strand's runner, a coroutine
+// made once with the strand_state, to the underlying executor.
+// Each run resumes up to batch_size continuations, then gives
+// the thread back to the executor, reposting itself if more
+// work is queued.
+//
+// dispatch from a coroutine already running in the strand
+// returns the continuation's handle for symmetric transfer
+// instead of queuing it.
+// ============================================================
+
+namespace detail {
+
+// A coroutine resumed once per batch, for the life of its
+// strand_state
+struct strand_runner
+{
+    struct promise_type
+    {
+        strand_runner get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// The strand_state whose continuations this thread is resuming
+inline void const*& current_strand() noexcept
+{
+    static thread_local void const* s = nullptr;
+    return s;
+}
+
+} // namespace detail
+
+template<Executor Ex>
+class strand;
+
+template<Executor Ex>
+class strand_state
+{
+    template<Executor> friend class strand;
+
+    Ex ex_;
+    continuation_queue queue_;
+    alignas(64) std::atomic<std::size_t> pending_{0};
+    continuation runner_;
+
+    // Settles the count once the runner is suspended, so a
+    // post that finds it at zero never resumes a runner that
+    // is still running
+    struct batch_done
+    {
+        strand_state* self;
+        std::size_t n;
+
+        bool await_ready() const noexcept { return false; }
+
+        // The awaiter lives in the runner's frame, which the
+        // next batch reuses as soon as the count reaches zero;
+        // nothing in it is read after the fetch_sub
+        void await_suspend(std::coroutine_handle<>) const
+        {
+            auto* const s = self;
+            auto const k = n;
+            if(s->pending_.fetch_sub(k, std::memory_order_acq_rel) != k)
+                s->ex_.post(s->runner_);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    detail::strand_runner run()
+    {
+        for(;;)
+            co_await batch_done{this, drain()};
+    }
+
+    // Resumes up to batch_size continuations. A producer caught
+    // between its two queue stores can make the batch end
+    // early; its continuation is still counted, so the runner
+    // comes back for it.
+    std::size_t drain() noexcept
+    {
+        auto* saved = std::exchange(detail::current_strand(), this);
+        std::size_t n = 0;
+        while(n < batch_size)
+        {
+            auto* c = queue_.pop();
+            if(!c)
+                break;
+            ++n;
+            safe_resume(c->h);
+        }
+        detail::current_strand() = saved;
+        return n;
+    }
+
+    // The count is raised before the push, so it never trails
+    // the queue: a continuation the runner pops is always
+    // counted, and only the post that takes the count from zero
+    // posts the runner
+    void post(continuation& c)
+    {
+        bool const idle = pending_.fetch_add(1, std::memory_order_acq_rel) == 0;
+        queue_.push(c);
+        if(idle)
+            ex_.post(runner_);
+    }
+
+    void post_batch(continuation* head)
+    {
+        if(!head)
+            return;
+        continuation* last;
+        auto const n = detail::chain_length(head, last);
+        bool const idle = pending_.fetch_add(n, std::memory_order_acq_rel) == 0;
+        queue_.push(*head, *last);
+        if(idle)
+            ex_.post(runner_);
+    }
+
+public:
+    static constexpr std::size_t batch_size = 32;
+
+    explicit strand_state(Ex ex)
+        : ex_(std::move(ex))
+        , runner_{run().h}
+    {
+    }
+
+    ~strand_state()
+    {
+        runner_.h.destroy();
+    }
+
+    strand_state(strand_state const&) = delete;
+    strand_state& operator=(strand_state const&) = delete;
+
+    strand<Ex> get_executor() noexcept;
+
+    Ex const& inner_executor() const noexcept { return ex_; }
+
+    bool running_in_this_thread() const noexcept
+    {
+        return detail::current_strand() == this;
+    }
+};
+
+template<Executor Ex>
+class strand
+{
+    strand_state<Ex>* state_;
+
+public:
+    explicit strand(strand_state<Ex>& state) noexcept
+        : state_(&state)
+    {
+    }
+
+    decltype(auto) context() const noexcept
+    {
+        return state_->ex_.context();
+    }
+
+    void on_work_started() const noexcept
+    {
+        state_->ex_.on_work_started();
+    }
+
+    void on_work_finished() const noexcept
+    {
+        state_->ex_.on_work_finished();
+    }
+
+    std::coroutine_handle<> dispatch(continuation& c) const
+    {
+        if(state_->running_in_this_thread())
+            return c.h;
+        state_->post(c);
+        return std::noop_coroutine();
+    }
+
+    void post(continuation& c) const
+    {
+        state_->post(c);
+    }
+
+    void post_batch(continuation* head) const
+    {
+        state_->post_batch(head);
+    }
+
+    bool running_in_this_thread() const noexcept
+    {
+        return state_->running_in_this_thread();
+    }
+
+    bool operator==(strand const& other) const noexcept
+    {
+        return state_ == other.state_;
+    }
+};
+
+template<Executor Ex>
+strand<Ex>
+strand_state<Ex>::get_executor() noexcept
+{
+    return strand<Ex>(*this);
+}
+
+static_assert(Executor<strand<thread_pool::executor_type>>);
+static_assert(BatchExecutor<strand<thread_pool::executor_type>>);
+static_assert(any_executor::fits<strand<thread_pool::executor_type>>);
+
+// ============================================================
+// io_result - error code and value
+//
+// I/O awaitables report failure in their result instead of
+// throwing. Routine conditions - EAGAIN, a reset connection,
+// the end of a stream - cost a branch rather than an unwind,
+// and the value that came with the error, such as a partial
+// byte count, is not lost:
+//
+//     auto [ec, n] = co_await read_some(ctx, fd, buf);
+//     if(ec == error::eof)
+//         ...
+//
+// io_result<void> carries only the code. A read that returns
+// no bytes into a non-empty buffer reports error::eof.
+// ============================================================
+
+enum class error
+{
+    eof = 1,
+    buffer_full,
+    channel_closed
+};
+
+} // namespace capy
+
+template<>
+struct std::is_error_code_enum<capy::error> : std::true_type {};
+
+namespace capy {
+
+namespace detail {
+
+class error_category_impl : public std::error_category
+{
+public:
+    char const* name() const noexcept override { return "capy"; }
+
+    std::string message(int ev) const override
+    {
+        switch(static_cast<error>(ev))
+        {
+        case error::eof: return "end of file";
+        case error::buffer_full: return "buffer full";
+        case error::channel_closed: return "channel closed";
+        }
+        return "unknown error";
+    }
+};
+
+} // namespace detail
+
+inline std::error_category const&
+error_category() noexcept
+{
+    static detail::error_category_impl const cat;
+    return cat;
+}
+
+inline std::error_code
+make_error_code(error e) noexcept
+{
+    return {static_cast<int>(e), error_category()};
+}
+
+template<class T = void>
+struct [[nodiscard]] io_result
+{
+    std::error_code ec;
+    T value{};
+};
+
+template<>
+struct [[nodiscard]] io_result<void>
+{
+    std::error_code ec;
+};
+
+namespace detail {
+
+// The result of reading n bytes into a buffer of size requested
+inline io_result<std::size_t>
+read_result(std::error_code ec, std::size_t n, std::size_t requested) noexcept
+{
+    if(!ec && n == 0 && requested != 0)
+        ec = error::eof;
+    return {ec, n};
+}
+
+} // namespace detail
+
+// ============================================================
+// Buffers
+// ============================================================
+
+struct mutable_buffer
+{
+    void* data = nullptr;
+    std::size_t size = 0;
+};
+
+struct const_buffer
+{
+    void const* data = nullptr;
+    std::size_t size = 0;
+
+    const_buffer() = default;
+
+    const_buffer(void const* p, std::size_t n) noexcept
+        : data(p)
+        , size(n)
+    {
+    }
+
+    const_buffer(mutable_buffer b) noexcept
+        : data(b.data)
+        , size(b.size)
+    {
+    }
+};
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+
+namespace detail {
+
+// The first max_iov non-empty buffers of a sequence, for one
+// readv or writev. It lives in the operation, so the array
+// stays put while the kernel holds on to it.
+struct iovec_array
+{
+    static constexpr std::size_t max_iov = 16;
+
+    iovec iov[max_iov];
+    unsigned count = 0;
+
+    explicit iovec_array(std::span<const_buffer const> bufs) noexcept
+    {
+        for(auto const& b : bufs)
+        {
+            if(count == max_iov)
+                break;
+            if(b.size != 0)
+                iov[count++] = {const_cast<void*>(b.data), b.size};
+        }
+    }
+};
+
+} // namespace detail
+
+#endif
+
+// ============================================================
+// basic_event_loop - single-threaded loop scheduling
+//
+// Shared by the I/O contexts. Posts from the loop thread go to
+// a local FIFO; posts from other threads go to a
+// continuation_queue and wake the loop if it is asleep. Derived
+// supplies poll(int timeout), which waits up to timeout
+// milliseconds for I/O (forever when -1, not at all when 0),
+// and wake_loop(), which interrupts a blocked poll from any
+// thread.
+//
+// The loop owns a timer_wheel, advanced every iteration; the
+// next expiry bounds how long poll may block.
+//
+// Outstanding work counts queued continuations, operations in
+// flight, and unmatched on_work_started; run() returns when it
+// reaches zero.
+//
+// request() hands a loop_request to the loop thread from any
+// thread; requests run at the start of the next iteration.
+//
+// Completed operations resume through resume_completion: at
+// once when the coroutine runs on this loop, otherwise gathered
+// by executor, so that a thread_pool or strand waiting on many
+// completions gets them in one post_batch per iteration.
+// Operations use this to cancel themselves from a stop
+// callback, which may fire on any thread.
+// ============================================================
+
+namespace detail {
+
+// Posts a waiter that was counted as outstanding work when it
+// parked, then retires that work. The executor is copied first:
+// once posted, the waiter may resume on another thread and free
+// the environment before post returns.
+inline void
+post_waiter(io_env const* env, continuation& c)
+{
+    any_executor const ex = env->executor;
+    ex.post(c);
+    ex.on_work_finished();
+}
+
+inline void
+resume_on(io_env const* env, continuation& c)
+{
+    auto h = env->executor.dispatch(c);
+    if(h != std::noop_coroutine())
+        safe_resume(h);
+}
+
+// The same, speculating that the environment's executor is the
+// completing context's own, as it nearly always is
+template<class Ex>
+void
+resume_on(io_env const* env, continuation& c)
+{
+    auto h = known_executor_ref<Ex>(env->executor).dispatch(c);
+    if(h != std::noop_coroutine())
+        safe_resume(h);
+}
+
+struct loop_request
+{
+    loop_request* next = nullptr;
+    void (*fn)(void* target) noexcept = nullptr;
+    void* target = nullptr;
+};
+
+// ------------------------------------------------------------
+// stop_registration - allocation-free stop_callback for an
+// operation. The std::stop_callback is constructed in place in
+// the awaitable when it suspends; when stop is requested it
+// queues the operation's cancel request on the loop.
+//
+// disarm() runs on the loop thread when the operation
+// completes. Destroying the callback waits for one that is
+// running elsewhere, and any request it queued is drained
+// before the operation's memory can go away.
+//
+// It is not copyable; an operation copied before it suspends
+// gives the copy a fresh registration of its own.
+// ------------------------------------------------------------
+
+template<class Loop>
+class stop_registration
+{
+    struct callback
+    {
+        stop_registration* self;
+
+        void operator()() const noexcept
+        {
+            self->queued_.store(true, std::memory_order_release);
+            self->loop_->request(self->request_);
+        }
+    };
+
+    using callback_type = std::stop_callback<callback>;
+
+    alignas(callback_type) unsigned char storage_[sizeof(callback_type)];
+    bool armed_ = false;
+    std::atomic<bool> queued_{false};
+    Loop* loop_ = nullptr;
+    loop_request request_;
+
+public:
+    stop_registration(void (*fn)(void*) noexcept, void* target) noexcept
+    {
+        request_.fn = fn;
+        request_.target = target;
+    }
+
+    stop_registration(stop_registration const&) = delete;
+    stop_registration& operator=(stop_registration const&) = delete;
+
+    ~stop_registration()
+    {
+        disarm();
+    }
+
+    void arm(Loop& loop, std::stop_token const& token)
+    {
+        if(!token.stop_possible())
+            return;
+        loop_ = &loop;
+        ::new(static_cast<void*>(storage_)) callback_type(token, callback{this});
+        armed_ = true;
+    }
+
+    void disarm() noexcept
+    {
+        if(!armed_)
+            return;
+        std::launder(reinterpret_cast<callback_type*>(storage_))->~callback_type();
+        armed_ = false;
+        if(queued_.exchange(false, std::memory_order_acquire))
+            loop_->drain_requests();
+    }
+};
+
+} // namespace detail
+
+// ============================================================
+// timer_wheel - hierarchical timing wheel
+//
+// Four levels of 256 slots at a 1ms tick span about 49 days;
+// longer timers are clamped to that. A timer goes in the
+// lowest level whose span reaches its expiry and cascades one
+// level down each time the level below wraps, so scheduling
+// and cancelling are O(1). Advancing visits one slot per tick,
+// and skips ahead 256 ticks at a time while level 0 is empty.
+//
+// Nodes are intrusive: each lives in the awaitable waiting on
+// it, so scheduling a timer allocates nothing.
+//
+// A wheel is single-threaded and belongs to the event loop
+// that drives it. The loop advances it every iteration and
+// bounds its wait by the next expiry; other threads reach it
+// through request(), which forwards to the loop.
+// ============================================================
+
+class timer_wheel
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct node
+    {
+        node* next = nullptr;
+        node** pprev = nullptr;
+        std::uint64_t expiry = 0;
+        unsigned level = 0;
+        void (*fire)(void* target) noexcept = nullptr;
+        void* target = nullptr;
+
+        bool linked() const noexcept { return pprev != nullptr; }
+    };
+
+    static constexpr unsigned slot_bits = 8;
+    static constexpr unsigned slots = 1u << slot_bits;
+    static constexpr unsigned levels = 4;
+
+private:
+    static constexpr std::uint64_t mask = slots - 1;
+    static constexpr std::uint64_t max_delta =
+        (std::uint64_t(1) << (slot_bits * levels)) - 1;
+
+    node* wheel_[levels][slots] = {};
+    std::size_t level_count_[levels] = {};
+    std::size_t count_ = 0;
+    std::uint64_t now_ = 0;
+    clock::time_point origin_ = clock::now();
+
+    void* loop_ = nullptr;
+    void (*request_)(void*, detail::loop_request&) noexcept = nullptr;
+    void (*drain_)(void*) noexcept = nullptr;
+    bool (*on_loop_)(void const*) noexcept = nullptr;
+
+    std::uint64_t ticks(clock::time_point t) const noexcept
+    {
+        if(t <= origin_)
+            return 0;
+        return static_cast<std::uint64_t>(
+            std::chrono::ceil<std::chrono::milliseconds>(t - origin_).count());
+    }
+
+    void link(node& n) noexcept
+    {
+        if(n.expiry <= now_)
+            n.expiry = now_ + 1;
+        std::uint64_t delta = n.expiry - now_;
+        if(delta > max_delta)
+        {
+            delta = max_delta;
+            n.expiry = now_ + max_delta;
+        }
+        unsigned level = 0;
+        while(delta >> (slot_bits * (level + 1)))
+            ++level;
+        auto& head = wheel_[level][(n.expiry >> (slot_bits * level)) & mask];
+        n.level = level;
+        n.next = head;
+        n.pprev = &head;
+        if(head)
+            head->pprev = &n.next;
+        head = &n;
+        ++level_count_[level];
+        ++count_;
+    }
+
+    void unlink(node& n) noexcept
+    {
+        *n.pprev = n.next;
+        if(n.next)
+            n.next->pprev = n.pprev;
+        n.next = nullptr;
+        n.pprev = nullptr;
+        --level_count_[n.level];
+        --count_;
+    }
+
+    // Re-files the timers of a higher-level slot that has come
+    // within reach of the level below
+    void cascade(unsigned level, std::uint64_t index) noexcept
+    {
+        while(auto* n = wheel_[level][index])
+        {
+            unlink(*n);
+            link(*n);
+        }
+    }
+
+    void tick()
+    {
+        ++now_;
+        auto index = now_ & mask;
+        for(unsigned level = 1; index == 0 && level < levels; ++level)
+        {
+            index = (now_ >> (slot_bits * level)) & mask;
+            cascade(level, index);
+        }
+        // A timer fired here may schedule or cancel others; none
+        // can land in the slot being emptied.
+        auto& slot = wheel_[0][now_ & mask];
+        while(auto* n = slot)
+        {
+            unlink(*n);
+            n->fire(n->target);
+        }
+    }
+
+public:
+    timer_wheel() = default;
+    timer_wheel(timer_wheel const&) = delete;
+    timer_wheel& operator=(timer_wheel const&) = delete;
+
+    // Called by the owning loop before it runs
+    template<class Loop>
+    void bind(Loop& loop) noexcept
+    {
+        loop_ = &loop;
+        request_ = [](void* l, detail::loop_request& r) noexcept {
+            static_cast<Loop*>(l)->request(r);
+        };
+        drain_ = [](void* l) noexcept {
+            static_cast<Loop*>(l)->drain_requests();
+        };
+        on_loop_ = [](void const* l) noexcept {
+            return static_cast<Loop const*>(l)->running_in_this_thread();
+        };
+    }
+
+    bool running_in_this_thread() const noexcept { return on_loop_(loop_); }
+
+    // Runs r on the loop thread; callable from any thread
+    void request(detail::loop_request& r) noexcept { request_(loop_, r); }
+
+    // Loop thread only
+    void drain_requests() noexcept { drain_(loop_); }
+
+    bool empty() const noexcept { return count_ == 0; }
+
+    // Loop thread only. n fires on the first advance at or after
+    // the tick containing t, never before t.
+    void schedule(node& n, clock::time_point t) noexcept
+    {
+        n.expiry = ticks(t);
+        link(n);
+    }
+
+    // Loop thread only
+    void cancel(node& n) noexcept
+    {
+        if(n.linked())
+            unlink(n);
+    }
+
+    // Loop thread only. Fires every timer that is due at t.
+    void advance(clock::time_point t)
+    {
+        auto const target = static_cast<std::uint64_t>(
+            std::chrono::floor<std::chrono::milliseconds>(t - origin_).count());
+        while(now_ < target)
+        {
+            if(count_ == 0)
+            {
+                now_ = target;
+                break;
+            }
+            if(level_count_[0] == 0)
+            {
+                // Nothing can fire before level 0 next wraps
+                auto const wrap = (now_ | mask) + 1;
+                if(wrap > target)
+                {
+                    now_ = target;
+                    break;
+                }
+                now_ = wrap - 1;
+            }
+            tick();
+        }
+    }
+
+    // Milliseconds from t until the wheel next needs advancing,
+    // or -1 when no timer is scheduled. A timer beyond level 0
+    // wakes the loop when its level cascades.
+    int timeout(clock::time_point t) const noexcept
+    {
+        if(count_ == 0)
+            return -1;
+        std::uint64_t due = (now_ | mask) + 1;
+        if(level_count_[0] != 0)
+        {
+            for(std::uint64_t i = now_ + 1; i < due; ++i)
+            {
+                if(wheel_[0][i & mask])
+                {
+                    due = i;
+                    break;
+                }
+            }
+        }
+        auto const at = origin_ + std::chrono::milliseconds(due);
+        if(at <= t)
+            return 0;
+        auto const ms = std::chrono::ceil<std::chrono::milliseconds>(at - t).count();
+        return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+    }
+};
+
+namespace detail {
+
+template<class Derived>
+class basic_event_loop : public execution_context
+{
+    continuation* ready_head_ = nullptr;
+    continuation* ready_tail_ = nullptr;
+    loop_request* draining_ = nullptr;
+
+    continuation_queue remote_;
+    alignas(64) std::atomic<std::size_t> work_{0};
+    alignas(64) std::atomic<bool> sleeping_{false};
+    alignas(64) std::atomic<loop_request*> requests_{nullptr};
+
+    timer_wheel timers_;
+
+    // Completions bound for other executors, by executor
+    struct deferred_chain
+    {
+        any_executor ex;
+        continuation* head;
+        continuation* tail;
+    };
+    deferred_chain deferred_[4];
+    std::size_t deferred_count_ = 0;
+
+    static basic_event_loop*& current() noexcept
+    {
+        static thread_local basic_event_loop* loop = nullptr;
+        return loop;
+    }
+
+    Derived& derived() noexcept { return *static_cast<Derived*>(this); }
+
+public:
+    basic_event_loop() noexcept
+    {
+        timers_.bind(*this);
+    }
+
+    class executor_type
+    {
+        Derived* loop_;
+
+    public:
+        explicit executor_type(Derived& loop) noexcept
+            : loop_(&loop)
+        {
+        }
+
+        Derived& context() const noexcept { return *loop_; }
+
+        void on_work_started() const noexcept
+        {
+            loop_->work_started();
+        }
+
+        void on_work_finished() const noexcept
+        {
+            loop_->work_finished();
+        }
+
+        std::coroutine_handle<> dispatch(continuation& c) const
+        {
+            if(loop_->running_in_this_thread())
+                return c.h;
+            post(c);
+            return std::noop_coroutine();
+        }
+
+        void post(continuation& c) const
+        {
+            loop_->post(c);
+        }
+
+        void post_batch(continuation* head) const
+        {
+            loop_->post_batch(head);
+        }
+
+        bool operator==(executor_type const& other) const noexcept
+        {
+            return loop_ == other.loop_;
+        }
+    };
+
+    executor_type get_executor() noexcept { return executor_type(derived()); }
+
+    timer_wheel* timers() noexcept override { return &timers_; }
+
+    bool running_in_this_thread() const noexcept
+    {
+        return current() == this;
+    }
+
+    void run()
+    {
+        auto* saved = std::exchange(current(), this);
+        for(;;)
+        {
+            drain_requests();
+            drain_remote();
+            timers_.advance(timer_wheel::clock::now());
+            run_ready();
+            flush_deferred();
+            if(work_.load(std::memory_order_acquire) == 0)
+                break;
+            int timeout = 0;
+            if(!ready_head_ && !prepare_to_sleep())
+                timeout = timers_.empty() ? -1 :
+                    timers_.timeout(timer_wheel::clock::now());
+            derived().poll(timeout);
+            sleeping_.store(false, std::memory_order_relaxed);
+            flush_deferred();
+        }
+        current() = saved;
+    }
+
+    void work_started() noexcept
+    {
+        work_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The loop may be asleep waiting for the last of its work
+    void work_finished() noexcept
+    {
+        if(work_.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+            !running_in_this_thread())
+            wake();
+    }
+
+    void post(continuation& c)
+    {
+        work_.fetch_add(1, std::memory_order_relaxed);
+        if(running_in_this_thread())
+        {
+            c.next = nullptr;
+            if(ready_tail_)
+                ready_tail_->next = &c;
+            else
+                ready_head_ = &c;
+            ready_tail_ = &c;
+            return;
+        }
+        remote_.push(c);
+        wake();
+    }
+
+    void post_batch(continuation* head)
+    {
+        if(!head)
+            return;
+        continuation* last;
+        auto const n = detail::chain_length(head, last);
+        work_.fetch_add(n, std::memory_order_relaxed);
+        if(running_in_this_thread())
+        {
+            if(ready_tail_)
+                ready_tail_->next = head;
+            else
+                ready_head_ = head;
+            ready_tail_ = last;
+            return;
+        }
+        remote_.push(*head, *last);
+        wake();
+    }
+
+    // Resumes an operation's continuation from the loop thread:
+    // at once when this loop runs its executor, otherwise
+    // deferred so that each other executor gets one post_batch
+    // for all of an iteration's completions
+    void resume_completion(io_env const* env, continuation& c)
+    {
+        auto* ex = env->executor.template target<executor_type>();
+        if(ex && &ex->context() == this)
+            return safe_resume(c.h);
+        c.next = nullptr;
+        for(std::size_t i = 0; i < deferred_count_; ++i)
+        {
+            auto& d = deferred_[i];
+            if(d.ex == env->executor)
+            {
+                d.tail->next = &c;
+                d.tail = &c;
+                return;
+            }
+        }
+        if(deferred_count_ == std::size(deferred_))
+            flush_deferred();
+        deferred_[deferred_count_++] = {env->executor, &c, &c};
+    }
+
+    void request(loop_request& r) noexcept
+    {
+        auto* head = requests_.load(std::memory_order_relaxed);
+        do
+        {
+            r.next = head;
+        }
+        while(!requests_.compare_exchange_weak(head, &r,
+            std::memory_order_release, std::memory_order_relaxed));
+        if(!running_in_this_thread())
+            wake();
+    }
+
+    // Loop thread only. A request may resume a coroutine that
+    // ends another queued operation, whose disarm() drains again
+    // before its request goes away; the nested call carries on
+    // through the list taken here, so no request is left in it
+    // once its memory can be freed.
+    void drain_requests() noexcept
+    {
+        for(;;)
+        {
+            if(!draining_)
+                draining_ = requests_.exchange(nullptr,
+                    std::memory_order_acquire);
+            if(!draining_)
+                return;
+            auto* r = std::exchange(draining_, draining_->next);
+            r->fn(r->target);
+        }
+    }
+
+private:
+    void wake() noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(sleeping_.load(std::memory_order_relaxed))
+            derived().wake_loop();
+    }
+
+    void flush_deferred()
+    {
+        for(std::size_t i = 0; i < deferred_count_; ++i)
+            deferred_[i].ex.post_batch(deferred_[i].head);
+        deferred_count_ = 0;
+    }
+
+    void drain_remote() noexcept
+    {
+        while(auto* c = remote_.pop())
+        {
+            if(ready_tail_)
+                ready_tail_->next = c;
+            else
+                ready_head_ = c;
+            ready_tail_ = c;
+        }
+    }
+
+    // Runs the continuations queued so far. Ones posted while
+    // running wait for the next iteration, so I/O is not
+    // starved by a coroutine that keeps posting itself.
+    void run_ready()
+    {
+        auto* c = std::exchange(ready_head_, nullptr);
+        ready_tail_ = nullptr;
+        while(c)
+        {
+            auto* next = c->next;
+            c->next = nullptr;
+            safe_resume(c->h);
+            work_.fetch_sub(1, std::memory_order_release);
+            c = next;
+        }
+    }
+
+    // Announces that the loop is about to block. Returns true
+    // if remote work arrived or the last work finished
+    // meanwhile, so it must not block.
+    bool prepare_to_sleep() noexcept
+    {
+        sleeping_.store(true, std::memory_order_seq_cst);
+        drain_remote();
+        return ready_head_ != nullptr ||
+            requests_.load(std::memory_order_seq_cst) != nullptr ||
+            work_.load(std::memory_order_seq_cst) == 0;
+    }
+};
+
+} // namespace detail
+
+// ============================================================
+// timer_context - the shared timer loop
+//
+// thread_pool, inline_context and the strands over them have no
+// event loop to advance a timer_wheel. execution_context's
+// timers() lends them the wheel of a timer_context instead: a
+// basic_event_loop that runs nothing but timers and requests,
+// on a thread of its own. It is started on first use and never
+// stopped, like default_frame_pool. Timers fire on that thread,
+// and delay and with_deadline resume the awaiting coroutine
+// through its own executor, which posts it back to the pool.
+// ============================================================
+
+class timer_context
+    : public detail::basic_event_loop<timer_context>
+{
+    friend class detail::basic_event_loop<timer_context>;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool woken_ = false;
+
+    void wake_loop() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            woken_ = true;
+        }
+        cv_.notify_one();
+    }
+
+    void poll(int timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto const woken = [this] { return woken_; };
+        if(timeout < 0)
+            cv_.wait(lock, woken);
+        else if(timeout > 0)
+            cv_.wait_for(lock, std::chrono::milliseconds(timeout), woken);
+        woken_ = false;
+    }
+};
+
+static_assert(any_executor::fits<timer_context::executor_type>);
+
+// Constructed in static storage and never destroyed; the work it
+// starts with is never finished, so run() does not return.
+inline timer_context&
+shared_timer_context()
+{
+    alignas(timer_context) static unsigned char storage[
+        sizeof(timer_context)];
+    static timer_context* ctx = [] {
+        auto* c = ::new(storage) timer_context();
+        c->work_started();
+        std::thread([c] { c->run(); }).detach();
+        return c;
+    }();
+    return *ctx;
+}
+
+inline timer_wheel* execution_context::timers() noexcept
+{
+    return shared_timer_context().timers();
+}
+
+// ============================================================
+// delay, with_deadline - timer awaitables
+//
+// Both find their timer_wheel through the io_env executor's
+// context: the loop's own, or timer_context's; one whose
+// timers() is null fails with operation_not_supported. The
+// wheel node lives in the awaitable, so a timer costs no
+// allocation. A coroutine suspending on another thread hands
+// the insertion to the loop with a loop_request.
+//
+// The timer counts as outstanding work on the coroutine's
+// executor until the coroutine has been resumed or posted, so
+// a thread_pool waiting on nothing else does not run out of
+// work in between.
+//
+// co_await delay(d) resumes the coroutine once d has elapsed.
+// Stopping io_env::stop_token unlinks the node in O(1) and the
+// delay completes with operation_canceled in its io_result.
+//
+// co_await with_deadline(t, d) runs t with a stop_token that
+// is stopped when d elapses or when the awaiting coroutine's
+// own token is stopped. Operations in t observe it like any
+// other stop request; the result is whatever t produces.
+// ============================================================
+
+namespace detail {
+
+// Links a child stop_source to a parent token: registered on the
+// parent, it requests stop on the child
+struct forward_stop
+{
+    std::stop_source* source;
+
+    void operator()() const noexcept { source->request_stop(); }
+};
+
+class delay_awaitable
+{
+    using clock = timer_wheel::clock;
+
+    clock::time_point when_;
+    timer_wheel::node node_;
+    timer_wheel* wheel_ = nullptr;
+    io_env const* env_ = nullptr;
+    continuation cont_;
+    int error_ = 0;
+    bool started_ = false;
+    bool cancelled_ = false;
+    loop_request start_;
+    stop_registration<timer_wheel> stop_{&delay_awaitable::on_stop, this};
+
+    // The executor is copied first: resuming may finish the
+    // coroutine and free this awaitable
+    void complete(int error) noexcept
+    {
+        error_ = error;
+        stop_.disarm();
+        any_executor const ex = env_->executor;
+        resume_on(env_, cont_);
+        ex.on_work_finished();
+    }
+
+    // Loop thread; the insertion of a delay that suspended on
+    // another thread
+    static void on_start(void* p) noexcept
+    {
+        auto* self = static_cast<delay_awaitable*>(p);
+        self->started_ = true;
+        if(self->cancelled_)
+            self->complete(ECANCELED);
+        else
+            self->wheel_->schedule(self->node_, self->when_);
+    }
+
+    static void on_fire(void* p) noexcept
+    {
+        static_cast<delay_awaitable*>(p)->complete(0);
+    }
+
+    // Loop thread, in response to a stop request. One that
+    // arrives before on_start leaves a mark for it.
+    static void on_stop(void* p) noexcept
+    {
+        auto* self = static_cast<delay_awaitable*>(p);
+        if(self->node_.linked())
+        {
+            self->wheel_->cancel(self->node_);
+            self->complete(ECANCELED);
+        }
+        else if(!self->started_)
+        {
+            self->cancelled_ = true;
+        }
+    }
+
+public:
+    explicit delay_awaitable(clock::time_point when) noexcept
+        : when_(when)
+    {
+        node_.fire = &on_fire;
+        node_.target = this;
+        start_.fn = &on_start;
+        start_.target = this;
+    }
+
+    delay_awaitable(delay_awaitable const& other) noexcept
+        : delay_awaitable(other.when_)
+    {
+    }
+
+    bool await_ready() const noexcept { return when_ <= clock::now(); }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        if(env->stop_token.stop_requested())
+        {
+            error_ = ECANCELED;
+            return h;
+        }
+        wheel_ = env->executor.context().timers();
+        if(!wheel_)
+        {
+            error_ = ENOTSUP;
+            return h;
+        }
+        env_ = env;
+        cont_.h = h;
+        env->executor.on_work_started();
+        stop_.arm(*wheel_, env->stop_token);
+        if(wheel_->running_in_this_thread())
+        {
+            started_ = true;
+            wheel_->schedule(node_, when_);
+        }
+        else
+        {
+            wheel_->request(start_);
+        }
+        return std::noop_coroutine();
+    }
+
+    io_result<> await_resume() const noexcept
+    {
+        if(error_)
+            return {{error_, std::generic_category()}};
+        return {};
+    }
+};
+
+// The coroutine a with_deadline runs its child from, so that the
+// child's completion comes back to the awaitable, which settles
+// the timer before the parent resumes. Created suspended and
+// destroyed with the awaitable, in whose frame it lives when it
+// fits.
+template<class Owner>
+struct deadline_runner
+{
+    struct promise_type
+    {
+        Owner* owner_;
+
+        explicit promise_type(Owner& o) noexcept
+            : owner_(&o)
+        {
+        }
+
+        static void* operator new(std::size_t size, Owner& o)
+        {
+            return o.allocate_runner(size);
+        }
+
+        static void operator delete(void* p, std::size_t size) noexcept
+        {
+            Owner::deallocate_runner(p, size);
+        }
+
+        deadline_runner get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> h) const noexcept
+                {
+                    return h.promise().owner_->child_done();
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{};
+        }
+
+        void return_void() noexcept {}
+
+        // The child keeps its own exception for await_resume
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+template<class Task>
+class deadline_awaitable
+{
+    using clock = timer_wheel::clock;
+    using runner_type = deadline_runner<deadline_awaitable>;
+    friend runner_type;
+
+    static constexpr std::size_t runner_frame_size = 128;
+
+    Task task_;
+    clock::time_point when_;
+    std::stop_source source_;
+    std::optional<std::stop_callback<forward_stop>> forward_;
+    io_env env_;
+    io_env const* parent_env_ = nullptr;
+    continuation parent_;
+    timer_wheel::node node_;
+    timer_wheel* wheel_ = nullptr;
+    continuation runner_;
+    loop_request start_;
+    loop_request cancel_;
+    alignas(std::max_align_t) unsigned char runner_frame_[runner_frame_size];
+
+    // Who has the timer. Until the child finishes it belongs to
+    // the wheel, and on_fire moves it from armed to fired. A
+    // child finishing off the loop claims it with cancelling and
+    // leaves the parent to on_cancel; one finishing during a fire
+    // marks it finished and leaves the parent to on_fire.
+    enum : int { idle, armed, firing, fired, cancelling, finished };
+    std::atomic<int> state_{idle};
+
+    void* allocate_runner(std::size_t size)
+    {
+        if(size <= runner_frame_size)
+            return runner_frame_;
+        return ::operator new(size);
+    }
+
+    static void deallocate_runner(void* p, std::size_t size) noexcept
+    {
+        if(size > runner_frame_size)
+            ::operator delete(p, size);
+    }
+
+    struct start_child
+    {
+        deadline_awaitable* self;
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+        {
+            return self->task_.await_suspend(h, &self->env_);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    static runner_type run(deadline_awaitable& self)
+    {
+        co_await start_child{&self};
+    }
+
+    void schedule() noexcept
+    {
+        state_.store(armed, std::memory_order_relaxed);
+        wheel_->schedule(node_, when_);
+    }
+
+    void resume_parent() noexcept
+    {
+        resume_on(parent_env_, parent_);
+    }
+
+    // Loop thread; starts a child whose parent suspended on
+    // another thread
+    static void on_start(void* p) noexcept
+    {
+        auto* self = static_cast<deadline_awaitable*>(p);
+        self->schedule();
+        resume_on(&self->env_, self->runner_);
+    }
+
+    static void on_fire(void* p) noexcept
+    {
+        auto* self = static_cast<deadline_awaitable*>(p);
+        int s = armed;
+        if(!self->state_.compare_exchange_strong(s, firing,
+            std::memory_order_relaxed, std::memory_order_relaxed))
+            return;
+        self->source_.request_stop();
+        any_executor const ex = self->env_.executor;
+        s = firing;
+        if(!self->state_.compare_exchange_strong(s, fired,
+            std::memory_order_acq_rel, std::memory_order_acquire))
+            self->resume_parent();
+        ex.on_work_finished();
+    }
+
+    // Loop thread; the cancel of a child that finished elsewhere.
+    // The node may have fired meanwhile, and on_fire left it.
+    static void on_cancel(void* p) noexcept
+    {
+        auto* self = static_cast<deadline_awaitable*>(p);
+        if(self->node_.linked())
+            self->wheel_->cancel(self->node_);
+        any_executor const ex = self->env_.executor;
+        self->resume_parent();
+        ex.on_work_finished();
+    }
+
+    // The runner, as the child finishes. On the loop thread the
+    // timer is cancelled here; elsewhere the wheel cannot be
+    // touched, so the cancel goes through the loop's request
+    // queue and the parent resumes from there.
+    std::coroutine_handle<> child_done() noexcept
+    {
+        int s = state_.load(std::memory_order_acquire);
+        if(s == armed && wheel_->running_in_this_thread())
+        {
+            state_.store(fired, std::memory_order_relaxed);
+            wheel_->cancel(node_);
+            env_.executor.on_work_finished();
+            return parent_.h;
+        }
+        while(s == armed || s == firing)
+        {
+            int const next = s == armed ? cancelling : finished;
+            if(state_.compare_exchange_weak(s, next,
+                std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                if(next == cancelling)
+                    wheel_->request(cancel_);
+                return std::noop_coroutine();
+            }
+        }
+        return parent_.h;
+    }
+
+public:
+    // Not noexcept: the stop_source allocates its shared state
+    deadline_awaitable(Task t, clock::time_point when)
+        : task_(std::move(t))
+        , when_(when)
+    {
+        node_.fire = &on_fire;
+        node_.target = this;
+        start_.fn = &on_start;
+        start_.target = this;
+        cancel_.fn = &on_cancel;
+        cancel_.target = this;
+    }
+
+    // Only before it is awaited, like every awaitable here
+    deadline_awaitable(deadline_awaitable&& other)
+        : deadline_awaitable(std::move(other.task_), other.when_)
+    {
+    }
+
+    ~deadline_awaitable()
+    {
+        if(runner_.h)
+            runner_.h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        wheel_ = env->executor.context().timers();
+        if(!wheel_)
+            throw_system_error(
+                std::make_error_code(std::errc::operation_not_supported),
+                "with_deadline");
+        parent_env_ = env;
+        parent_.h = h;
+        env_.executor = env->executor;
+        env_.stop_token = source_.get_token();
+        env_.frame_allocator = env->frame_allocator;
+        if(env->stop_token.stop_possible())
+            forward_.emplace(env->stop_token, forward_stop{&source_});
+
+        runner_.h = run(*this).h;
+        env_.executor.on_work_started();
+        if(wheel_->running_in_this_thread())
+        {
+            schedule();
+            return runner_.h;
+        }
+        wheel_->request(start_);
+        return std::noop_coroutine();
+    }
+
+    // The timer is settled before the parent resumes
+    decltype(auto) await_resume()
+    {
+        forward_.reset();
+        return task_.await_resume();
+    }
+};
+
+} // namespace detail
+
+template<class Rep, class Period>
+detail::delay_awaitable
+delay(std::chrono::duration<Rep, Period> d) noexcept
+{
+    return detail::delay_awaitable(timer_wheel::clock::now() +
+        std::chrono::ceil<timer_wheel::clock::duration>(d));
+}
+
+template<IoRunnable Task>
+detail::deadline_awaitable<Task>
+with_deadline(Task t, timer_wheel::clock::time_point when)
+{
+    return detail::deadline_awaitable<Task>(std::move(t), when);
+}
+
+template<IoRunnable Task, class Rep, class Period>
+detail::deadline_awaitable<Task>
+with_deadline(Task t, std::chrono::duration<Rep, Period> d)
+{
+    return with_deadline(std::move(t), timer_wheel::clock::now() +
+        std::chrono::ceil<timer_wheel::clock::duration>(d));
+}
+
+static_assert(IoAwaitable<detail::delay_awaitable>);
+static_assert(IoAwaitable<detail::deadline_awaitable<task<int>>>);
+
+// ============================================================
+// when_all, when_any - concurrent composition
+//
+// Each child is awaited by a small runner coroutine that the
+// combinator starts when it suspends; the runner passes the
+// child an io_env and reports its completion to the state held
+// in the combinator's awaiter. The parent resumes on the thread
+// of the last child to finish, after every child has finished.
+//
+// The variadic forms size their result storage at compile time
+// and build the runner frames in the awaiter too, so launching
+// them allocates nothing unless a frame outgrows its slot, and
+// start the runners inline. The range form takes the runner
+// frames and results from io_env::frame_allocator and starts
+// its runners with one post_batch to the parent's executor; on
+// a thread_pool they spread across the workers from there.
+//
+// when_all passes the parent's io_env through and returns every
+// result, rethrowing the first exception once all children are
+// done. when_any gives its children a stop_token chained to the
+// parent's, stops the rest once one finishes, and returns the
+// index and result of the first; void results are
+// std::monostate in both.
+// ============================================================
+
+namespace detail {
+
+template<class A>
+using child_result_t = decltype(std::declval<A&>().await_resume());
+
+template<class A>
+using stored_result_t = std::conditional_t<
+    std::is_void_v<child_result_t<A>>,
+    std::monostate,
+    std::decay_t<child_result_t<A>>>;
+
+// Awaits an IoAwaitable from a coroutine that has no
+// await_transform of its own
+template<class A>
+struct child_awaiter
+{
+    A& a;
+    io_env const* env;
+
+    bool await_ready() { return a.await_ready(); }
+
+    decltype(auto) await_suspend(std::coroutine_handle<> h)
+    {
+        return a.await_suspend(h, env);
+    }
+
+    decltype(auto) await_resume() { return a.await_resume(); }
+};
+
+// Completion count and runner frames shared by the children of
+// a combinator. The count starts one above the number of
+// children so the parent cannot be resumed while the rest are
+// still being launched; launching drops the extra count.
+//
+// Runner frames go in the inline slots when they fit, and to
+// the frame allocator otherwise. A trailer records which.
+class join_state
+{
+    std::atomic<std::size_t> remaining_{0};
+    std::coroutine_handle<> parent_;
+    unsigned char* slots_ = nullptr;
+    std::size_t slot_size_ = 0;
+    std::pmr::memory_resource* mr_ = nullptr;
+
+    static constexpr std::size_t trailer = sizeof(std::pmr::memory_resource*);
+
+protected:
+    void set_slots(unsigned char* slots, std::size_t slot_size) noexcept
+    {
+        slots_ = slots;
+        slot_size_ = slot_size;
+    }
+
+    void begin(std::coroutine_handle<> parent, std::size_t n,
+        std::pmr::memory_resource* mr) noexcept
+    {
+        parent_ = parent;
+        mr_ = mr ? mr : &default_frame_pool();
+        remaining_.store(n + 1, std::memory_order_relaxed);
+    }
+
+    // True when every child has already finished
+    bool end_launch() noexcept
+    {
+        return remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+public:
+    join_state() = default;
+    join_state(join_state const&) = delete;
+    join_state& operator=(join_state const&) = delete;
+
+    std::coroutine_handle<> child_done() noexcept
+    {
+        if(remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            return parent_;
+        return std::noop_coroutine();
+    }
+
+    void* allocate_frame(std::size_t index, std::size_t size)
+    {
+        auto const total = size + trailer;
+        std::pmr::memory_resource* mr = nullptr;
+        void* p;
+        if(slots_ && total <= slot_size_)
+        {
+            p = slots_ + index * slot_size_;
+        }
+        else
+        {
+            mr = mr_;
+            p = mr->allocate(total, alignof(std::max_align_t));
+        }
+        std::memcpy(static_cast<char*>(p) + size, &mr, sizeof(mr));
+        return p;
+    }
+
+    static void deallocate_frame(void* p, std::size_t size) noexcept
+    {
+        std::pmr::memory_resource* mr;
+        std::memcpy(&mr, static_cast<char*>(p) + size, sizeof(mr));
+        if(mr)
+            mr->deallocate(p, size + trailer, alignof(std::max_align_t));
+    }
+};
+
+// Runner coroutines are created suspended, started by the
+// combinator, and destroyed with its awaiter. Their first two
+// parameters are always the join_state and the child's index.
+struct runner
+{
+    struct promise_type
+    {
+        join_state* state_;
+
+        template<class... Args>
+        promise_type(join_state& s, std::size_t, Args&...) noexcept
+            : state_(&s)
+        {
+        }
+
+        template<class... Args>
+        static void* operator new(std::size_t size,
+            join_state& s, std::size_t index, Args&...)
+        {
+            return s.allocate_frame(index, size);
+        }
+
+        static void operator delete(void* p, std::size_t size) noexcept
+        {
+            join_state::deallocate_frame(p, size);
+        }
+
+        runner get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> h) const noexcept
+                {
+                    return h.promise().state_->child_done();
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{};
+        }
+
+        void return_void() noexcept {}
+
+        // Runner bodies catch everything
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// Runner frames are 100 to 150 bytes with current compilers;
+// a larger one falls back to the frame allocator
+inline constexpr std::size_t runner_slot_size = 192;
+
+template<class... As>
+class when_all_awaitable : public join_state
+{
+    static constexpr std::size_t N = sizeof...(As);
+
+    std::tuple<As...> children_;
+    std::tuple<std::optional<stored_result_t<As>>...> results_;
+    std::atomic<bool> failed_{false};
+    std::exception_ptr ep_;
+    io_env const* env_ = nullptr;
+    std::coroutine_handle<> runners_[N] = {};
+    alignas(std::max_align_t) unsigned char frames_[N][runner_slot_size];
+
+    void fail(std::exception_ptr ep) noexcept
+    {
+        if(!failed_.exchange(true, std::memory_order_relaxed))
+            ep_ = std::move(ep);
+    }
+
+    template<std::size_t I>
+    static runner run(join_state&, std::size_t, when_all_awaitable& self)
+    {
+        auto& child = std::get<I>(self.children_);
+        CAPY_TRY
+        {
+            if constexpr (std::is_void_v<child_result_t<std::tuple_element_t<I, std::tuple<As...>>>>)
+            {
+                co_await child_awaiter<decltype(child)>{child, self.env_};
+                std::get<I>(self.results_).emplace();
+            }
+            else
+            {
+                std::get<I>(self.results_).emplace(
+                    co_await child_awaiter<decltype(child)>{child, self.env_});
+            }
+        }
+        CAPY_CATCH(...)
+        {
+            self.fail(std::current_exception());
+        }
+    }
+
+    template<std::size_t... Is>
+    void launch(std::index_sequence<Is...>)
+    {
+        ((runners_[Is] = run<Is>(*this, Is, *this).h), ...);
+        for(auto h : runners_)
+            safe_resume(h);
+    }
+
+public:
+    explicit when_all_awaitable(As... children)
+        : children_(std::move(children)...)
+    {
+        set_slots(&frames_[0][0], runner_slot_size);
+    }
+
+    // Only before it is awaited, like every awaitable here
+    when_all_awaitable(when_all_awaitable&& other)
+        : children_(std::move(other.children_))
+    {
+        set_slots(&frames_[0][0], runner_slot_size);
+    }
+
+    ~when_all_awaitable()
+    {
+        for(auto h : runners_)
+            if(h)
+                h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        env_ = env;
+        begin(h, N, env->frame_allocator);
+        launch(std::index_sequence_for<As...>{});
+        if(end_launch())
+            return h;
+        return std::noop_coroutine();
+    }
+
+    std::tuple<stored_result_t<As>...> await_resume()
+    {
+        if(ep_)
+            std::rethrow_exception(ep_);
+        return std::apply([](auto&... r) {
+            return std::tuple<stored_result_t<As>...>(std::move(*r)...);
+        }, results_);
+    }
+};
+
+template<class... As>
+class when_any_awaitable : public join_state
+{
+    static constexpr std::size_t N = sizeof...(As);
+    static constexpr std::size_t none = std::size_t(-1);
+
+    using variant_type = std::variant<stored_result_t<As>...>;
+
+    std::tuple<As...> children_;
+    std::optional<variant_type> result_;
+    std::exception_ptr ep_;
+    std::atomic<std::size_t> winner_{none};
+    std::stop_source source_;
+    std::optional<std::stop_callback<forward_stop>> forward_;
+    io_env env_;
+    std::coroutine_handle<> runners_[N] = {};
+    alignas(std::max_align_t) unsigned char frames_[N][runner_slot_size];
+
+    // The first child to finish wins and stops the others
+    bool claim(std::size_t index) noexcept
+    {
+        auto expected = none;
+        if(!winner_.compare_exchange_strong(expected, index,
+            std::memory_order_relaxed))
+            return false;
+        source_.request_stop();
+        return true;
+    }
+
+    template<std::size_t I>
+    static runner run(join_state&, std::size_t, when_any_awaitable& self)
+    {
+        auto& child = std::get<I>(self.children_);
+        CAPY_TRY
+        {
+            if constexpr (std::is_void_v<child_result_t<std::tuple_element_t<I, std::tuple<As...>>>>)
+            {
+                co_await child_awaiter<decltype(child)>{child, &self.env_};
+                if(self.claim(I))
+                    self.result_.emplace(std::in_place_index<I>);
+            }
+            else
+            {
+                auto&& value = co_await child_awaiter<decltype(child)>{child, &self.env_};
+                if(self.claim(I))
+                    self.result_.emplace(std::in_place_index<I>,
+                        std::forward<decltype(value)>(value));
+            }
+        }
+        CAPY_CATCH(...)
+        {
+            if(self.claim(I))
+                self.ep_ = std::current_exception();
+        }
+    }
+
+    template<std::size_t... Is>
+    void launch(std::index_sequence<Is...>)
+    {
+        ((runners_[Is] = run<Is>(*this, Is, *this).h), ...);
+        for(auto h : runners_)
+            safe_resume(h);
+    }
+
+public:
+    explicit when_any_awaitable(As... children)
+        : children_(std::move(children)...)
+    {
+        set_slots(&frames_[0][0], runner_slot_size);
+    }
+
+    // Only before it is awaited, like every awaitable here
+    when_any_awaitable(when_any_awaitable&& other)
+        : children_(std::move(other.children_))
+    {
+        set_slots(&frames_[0][0], runner_slot_size);
+    }
+
+    ~when_any_awaitable()
+    {
+        for(auto h : runners_)
+            if(h)
+                h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        env_.executor = env->executor;
+        env_.stop_token = source_.get_token();
+        env_.frame_allocator = env->frame_allocator;
+        if(env->stop_token.stop_possible())
+            forward_.emplace(env->stop_token, forward_stop{&source_});
+        begin(h, N, env->frame_allocator);
+        launch(std::index_sequence_for<As...>{});
+        if(end_launch())
+            return h;
+        return std::noop_coroutine();
+    }
+
+    std::pair<std::size_t, variant_type> await_resume()
+    {
+        forward_.reset();
+        if(ep_)
+            std::rethrow_exception(ep_);
+        return {winner_.load(std::memory_order_relaxed), std::move(*result_)};
+    }
+};
+
+template<class Range>
+concept awaitable_range =
+    requires(Range& r)
+    {
+        std::begin(r);
+        std::end(r);
+        std::size(r);
+    } &&
+    IoAwaitable<std::remove_cvref_t<decltype(*std::begin(std::declval<Range&>()))>>;
+
+// Range holds the tasks by reference when when_all is given an
+// lvalue, and by value when it is given an rvalue
+template<class Range>
+class when_all_range_awaitable : public join_state
+{
+    using child_type = std::remove_cvref_t<decltype(*std::begin(std::declval<Range&>()))>;
+    using value_type = stored_result_t<child_type>;
+    static constexpr bool is_void = std::is_void_v<child_result_t<child_type>>;
+
+    // Emplaced with the frame allocator on suspension
+    Range children_;
+    std::optional<std::pmr::vector<std::optional<value_type>>> results_;
+    std::optional<std::pmr::vector<continuation>> runners_;
+    std::atomic<bool> failed_{false};
+    std::exception_ptr ep_;
+    io_env const* env_ = nullptr;
+
+    static runner run(join_state&, std::size_t index,
+        when_all_range_awaitable& self, child_type& child)
+    {
+        CAPY_TRY
+        {
+            if constexpr (is_void)
+            {
+                co_await child_awaiter<child_type>{child, self.env_};
+                (*self.results_)[index].emplace();
+            }
+            else
+            {
+                (*self.results_)[index].emplace(
+                    co_await child_awaiter<child_type>{child, self.env_});
+            }
+        }
+        CAPY_CATCH(...)
+        {
+            if(!self.failed_.exchange(true, std::memory_order_relaxed))
+                self.ep_ = std::current_exception();
+        }
+    }
+
+    void destroy_runners() noexcept
+    {
+        if(!runners_)
+            return;
+        for(auto& r : *runners_)
+            r.h.destroy();
+        runners_->clear();
+    }
+
+public:
+    explicit when_all_range_awaitable(Range&& children)
+        : children_(std::forward<Range>(children))
+    {
+    }
+
+    // Only before it is awaited, like every awaitable here
+    when_all_range_awaitable(when_all_range_awaitable&& other)
+        : children_(std::forward<Range>(other.children_))
+    {
+    }
+
+    ~when_all_range_awaitable()
+    {
+        destroy_runners();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        env_ = env;
+        auto const n = static_cast<std::size_t>(std::size(children_));
+        auto* mr = env->frame_allocator ? env->frame_allocator : &default_frame_pool();
+        results_.emplace(n, mr);
+        runners_.emplace(mr);
+        runners_->reserve(n);
+
+        // Create every runner before starting any, so a failed
+        // allocation leaves nothing running
+        begin(h, n, mr);
+        CAPY_TRY
+        {
+            std::size_t i = 0;
+            for(auto& child : children_)
+            {
+                runners_->push_back({run(*this, i, *this, child).h});
+                ++i;
+            }
+        }
+        CAPY_CATCH(...)
+        {
+            destroy_runners();
+            CAPY_RETHROW;
+        }
+
+        // One queue operation and one wakeup start them all
+        if(n > 0)
+        {
+            for(std::size_t k = 0; k + 1 < n; ++k)
+                (*runners_)[k].next = &(*runners_)[k + 1];
+            env->executor.post_batch(&runners_->front());
+        }
+        if(end_launch())
+            return h;
+        return std::noop_coroutine();
+    }
+
+    auto await_resume()
+    {
+        if(ep_)
+            std::rethrow_exception(ep_);
+        if constexpr (!is_void)
+        {
+            std::pmr::vector<value_type> values(results_->get_allocator());
+            values.reserve(results_->size());
+            for(auto& r : *results_)
+                values.push_back(std::move(*r));
+            return values;
+        }
+    }
+};
+
+} // namespace detail
+
+template<IoAwaitable... As>
+    requires (sizeof...(As) > 0)
+detail::when_all_awaitable<As...>
+when_all(As... children)
+{
+    return detail::when_all_awaitable<As...>(std::move(children)...);
+}
+
+template<IoAwaitable... As>
+    requires (sizeof...(As) > 0)
+detail::when_any_awaitable<As...>
+when_any(As... children)
+{
+    return detail::when_any_awaitable<As...>(std::move(children)...);
+}
+
+template<detail::awaitable_range Range>
+detail::when_all_range_awaitable<Range>
+when_all(Range&& children)
+{
+    return detail::when_all_range_awaitable<Range>(std::forward<Range>(children));
+}
+
+static_assert(IoAwaitable<detail::when_all_awaitable<task<int>, task<>>>);
+static_assert(IoAwaitable<detail::when_any_awaitable<task<int>, task<>>>);
+static_assert(IoAwaitable<detail::when_all_range_awaitable<std::vector<task<int>>&>>);
+
+// ============================================================
+// channel - bounded queue between coroutines
+//
+// A ring of capacity values shared by any number of senders
+// and receivers, in place of a queue guarded by a mutex and a
+// condition variable. co_await ch.send(v) suspends only while
+// the ring is full and co_await ch.receive() only while it is
+// empty; a channel of capacity 0 hands each value from sender
+// to receiver directly.
+//
+// A suspended sender or receiver is a node in the awaitable,
+// linked into the channel's list for its side, so waiting
+// costs no allocation. An operation that completes a waiter on
+// the other side resumes it through the waiter's own executor:
+// when that is the executor of the completing coroutine, the
+// waiter runs at once by symmetric transfer and the completing
+// coroutine is posted behind it; otherwise the waiter is posted
+// and the completing coroutine carries on. A suspended waiter
+// counts as outstanding work, like a pending timer.
+//
+// close() fails every waiting sender and every later send with
+// error::channel_closed. Receivers drain what the ring holds
+// and then fail the same way. Stopping io_env::stop_token
+// unlinks a waiting sender or receiver, which then completes
+// with operation_canceled; a cancelled send sends nothing.
+// ============================================================
+
+namespace detail {
+
+// A suspended send or receive. value points at the sender's
+// value or at the receiver's slot.
+struct channel_waiter
+{
+    channel_waiter* prev = nullptr;
+    channel_waiter* next = nullptr;
+    io_env const* env = nullptr;
+    continuation cont;
+    void* value = nullptr;
+    std::error_code ec;
+    bool linked = false;
+};
+
+// FIFO of waiters, with O(1) removal for cancellation
+class channel_wait_list
+{
+    channel_waiter* head_ = nullptr;
+    channel_waiter* tail_ = nullptr;
+
+public:
+    void push_back(channel_waiter& w) noexcept
+    {
+        w.prev = tail_;
+        w.next = nullptr;
+        w.linked = true;
+        if(tail_)
+            tail_->next = &w;
+        else
+            head_ = &w;
+        tail_ = &w;
+    }
+
+    channel_waiter* pop_front() noexcept
+    {
+        channel_waiter* w = head_;
+        if(w)
+            remove(*w);
+        return w;
+    }
+
+    void remove(channel_waiter& w) noexcept
+    {
+        if(w.prev)
+            w.prev->next = w.next;
+        else
+            head_ = w.next;
+        if(w.next)
+            w.next->prev = w.prev;
+        else
+            tail_ = w.prev;
+        w.prev = w.next = nullptr;
+        w.linked = false;
+    }
+};
+
+// Resumes a waiter completed by another coroutine or thread
+inline void wake(channel_waiter& w)
+{
+    post_waiter(w.env, w.cont);
+}
+
+// Resumes peer, completed by the coroutine suspended in self.
+// Within a post of self on this thread, as with post_self, peer
+// is posted instead: an executor that resumes posts inline would
+// otherwise nest a frame of stack per value.
+inline std::coroutine_handle<>
+hand_off(channel_waiter& self, channel_waiter& peer)
+{
+    static thread_local bool handing_off = false;
+    any_executor const ex = peer.env->executor;
+    if(ex == self.env->executor && !handing_off)
+    {
+        struct clear
+        {
+            bool& b;
+            ~clear() { b = false; }
+        };
+        handing_off = true;
+        {
+            clear guard{handing_off};
+            ex.post(self.cont);
+        }
+        ex.on_work_finished();
+        return peer.cont.h;
+    }
+    wake(peer);
+    return self.cont.h;
+}
+
+} // namespace detail
+
+template<class T>
+class channel
+{
+    std::mutex mutex_;
+    std::unique_ptr<std::optional<T>[]> ring_;
+    std::size_t capacity_;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+    detail::channel_wait_list senders_;
+    detail::channel_wait_list receivers_;
+    bool closed_ = false;
+
+    void push(T&& v)
+    {
+        ring_[(head_ + size_) % capacity_].emplace(std::move(v));
+        ++size_;
+    }
+
+    T pop()
+    {
+        auto& slot = ring_[head_];
+        T v = std::move(*slot);
+        slot.reset();
+        head_ = (head_ + 1) % capacity_;
+        --size_;
+        return v;
+    }
+
+    // Registered on the waiter's stop_token while it is linked
+    struct cancel
+    {
+        channel* ch;
+        detail::channel_wait_list* list;
+        detail::channel_waiter* w;
+
+        void operator()() const noexcept
+        {
+            {
+                std::lock_guard lock(ch->mutex_);
+                if(!w->linked)
+                    return;
+                list->remove(*w);
+                w->ec = {ECANCELED, std::generic_category()};
+            }
+            detail::wake(*w);
+        }
+    };
+
+    // The part of send and receive that does not depend on the
+    // direction: the node, and the stop callback that unlinks it
+    class operation
+    {
+    protected:
+        channel* ch_;
+        detail::channel_waiter w_;
+        std::optional<std::stop_callback<cancel>> stop_;
+
+        explicit operation(channel& ch) noexcept
+            : ch_(&ch)
+        {
+        }
+
+        // Before the channel is locked: a stop callback cannot
+        // take the lock while it is held. A stop requested
+        // after this is seen by the check in suspend() or by the
+        // callback, whichever comes second.
+        bool start(std::coroutine_handle<> h, io_env const* env,
+            detail::channel_wait_list& list)
+        {
+            w_.env = env;
+            w_.cont.h = h;
+            if(env->stop_token.stop_requested())
+            {
+                w_.ec = {ECANCELED, std::generic_category()};
+                return false;
+            }
+            if(env->stop_token.stop_possible())
+                stop_.emplace(env->stop_token, cancel{ch_, &list, &w_});
+            return true;
+        }
+
+        // With the lock held; links the node on its side
+        std::coroutine_handle<> suspend(detail::channel_wait_list& list)
+        {
+            if(w_.env->stop_token.stop_requested())
+            {
+                w_.ec = {ECANCELED, std::generic_category()};
+                return w_.cont.h;
+            }
+            w_.env->executor.on_work_started();
+            list.push_back(w_);
+            return std::noop_coroutine();
+        }
+
+        // Copies and moves share the channel only; they are made
+        // before the await begins
+        operation(operation const& other) noexcept
+            : ch_(other.ch_)
+        {
+        }
+
+        operation(operation&& other) noexcept
+            : ch_(other.ch_)
+        {
+        }
+
+    public:
+        bool await_ready() const noexcept { return false; }
+    };
+
+public:
+    class send_awaitable : public operation
+    {
+        friend class channel;
+
+        T value_;
+
+        send_awaitable(channel& ch, T v)
+            : operation(ch)
+            , value_(std::move(v))
+        {
+        }
+
+    public:
+        send_awaitable(send_awaitable const&) = default;
+        send_awaitable(send_awaitable&&) = default;
+
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> h, io_env const* env)
+        {
+            auto& ch = *this->ch_;
+            if(!this->start(h, env, ch.senders_))
+                return h;
+            this->w_.value = &value_;
+            std::unique_lock lock(ch.mutex_);
+            if(ch.closed_)
+            {
+                this->w_.ec = error::channel_closed;
+                return h;
+            }
+            if(auto* r = ch.receivers_.pop_front())
+            {
+                static_cast<std::optional<T>*>(r->value)->emplace(std::move(value_));
+                lock.unlock();
+                return detail::hand_off(this->w_, *r);
+            }
+            if(ch.size_ < ch.capacity_)
+            {
+                ch.push(std::move(value_));
+                return h;
+            }
+            return this->suspend(ch.senders_);
+        }
+
+        io_result<> await_resume() noexcept
+        {
+            this->stop_.reset();
+            return {this->w_.ec};
+        }
+    };
+
+    class receive_awaitable : public operation
+    {
+        friend class channel;
+
+        std::optional<T> value_;
+
+        explicit receive_awaitable(channel& ch) noexcept
+            : operation(ch)
+        {
+        }
+
+    public:
+        receive_awaitable(receive_awaitable const&) = default;
+        receive_awaitable(receive_awaitable&&) = default;
+
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> h, io_env const* env)
+        {
+            auto& ch = *this->ch_;
+            if(!this->start(h, env, ch.receivers_))
+                return h;
+            this->w_.value = &value_;
+            std::unique_lock lock(ch.mutex_);
+            if(ch.size_ > 0)
+            {
+                value_.emplace(ch.pop());
+                auto* s = ch.senders_.pop_front();
+                if(!s)
+                    return h;
+                ch.push(std::move(*static_cast<T*>(s->value)));
+                lock.unlock();
+                return detail::hand_off(this->w_, *s);
+            }
+            if(auto* s = ch.senders_.pop_front())
+            {
+                value_.emplace(std::move(*static_cast<T*>(s->value)));
+                lock.unlock();
+                return detail::hand_off(this->w_, *s);
+            }
+            if(ch.closed_)
+            {
+                this->w_.ec = error::channel_closed;
+                return h;
+            }
+            return this->suspend(ch.receivers_);
+        }
+
+        io_result<T> await_resume()
+        {
+            this->stop_.reset();
+            if(this->w_.ec)
+                return {this->w_.ec};
+            return {{}, std::move(*value_)};
+        }
+    };
+
+    explicit channel(std::size_t capacity)
+        : ring_(capacity ? new std::optional<T>[capacity] : nullptr)
+        , capacity_(capacity)
+    {
+    }
+
+    channel(channel const&) = delete;
+    channel& operator=(channel const&) = delete;
+
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    send_awaitable send(T v) { return send_awaitable(*this, std::move(v)); }
+
+    receive_awaitable receive() noexcept { return receive_awaitable(*this); }
+
+    // For producers that are not coroutines. Moves from v only
+    // when it returns true; a waiting receiver is posted.
+    bool try_send(T& v)
+    {
+        std::unique_lock lock(mutex_);
+        if(closed_)
+            return false;
+        if(auto* r = receivers_.pop_front())
+        {
+            static_cast<std::optional<T>*>(r->value)->emplace(std::move(v));
+            lock.unlock();
+            detail::wake(*r);
+            return true;
+        }
+        if(size_ == capacity_)
+            return false;
+        push(std::move(v));
+        return true;
+    }
+
+    void close()
+    {
+        detail::channel_wait_list woken;
+        {
+            std::lock_guard lock(mutex_);
+            if(closed_)
+                return;
+            closed_ = true;
+            for(auto* list : {&senders_, &receivers_})
+            {
+                while(auto* w = list->pop_front())
+                {
+                    w->ec = error::channel_closed;
+                    woken.push_back(*w);
+                }
+            }
+        }
+        // Outside the lock: an inline executor resumes the waiter
+        // within wake, and it may use the channel again
+        while(auto* w = woken.pop_front())
+            detail::wake(*w);
+    }
+};
+
+static_assert(IoAwaitable<channel<int>::send_awaitable>);
+static_assert(IoAwaitable<channel<int>::receive_awaitable>);
+static_assert(IoAwaitable<channel<std::unique_ptr<int>>::send_awaitable>);
+
+// ============================================================
+// async_mutex, async_semaphore, async_event
+//
+// Synchronization between tasks that suspends the task, never
+// the thread. Uncontended, each is one atomic read-modify-write:
+// co_await m.lock() on a free mutex, co_await s.acquire() with a
+// permit left, co_await e.wait() on a set event complete without
+// suspending.
+//
+// A task that has to wait links a node in its awaitable, so
+// waiting costs no allocation, and waiters are served in the
+// order they arrived. The mutex and the event push waiters onto
+// a lock-free stack in their state word, which the unlocking or
+// setting thread reverses; the semaphore, whose count and
+// waiters must agree, keeps its waiters behind a lock taken only
+// when a task waits or a release finds one waiting.
+//
+// unlock() hands the mutex straight to the oldest waiter, and
+// release() a permit; set() resumes every waiter. A waiter is
+// resumed with a post to its own executor, never inline in the
+// thread that released it, and counts as outstanding work while
+// it waits. Waits are not cancellable.
+// ============================================================
+
+namespace detail {
+
+// A task suspended on an async_mutex, async_semaphore or
+// async_event
+struct sync_waiter
+{
+    sync_waiter* next = nullptr;
+    io_env const* env = nullptr;
+    continuation cont;
+
+    void wake()
+    {
+        post_waiter(env, cont);
+    }
+};
+
+// Reverses a stack of waiters, newest first, into arrival order
+inline sync_waiter* oldest_first(sync_waiter* w) noexcept
+{
+    sync_waiter* r = nullptr;
+    while(w)
+        r = std::exchange(w, std::exchange(w->next, r));
+    return r;
+}
+
+} // namespace detail
+
+class async_mutex;
+
+// Unlocks an async_mutex when destroyed; the result of
+// co_await m.scoped_lock()
+class [[nodiscard]] async_mutex_lock
+{
+    async_mutex* m_;
+
+public:
+    async_mutex_lock(async_mutex& m, std::adopt_lock_t) noexcept
+        : m_(&m)
+    {
+    }
+
+    async_mutex_lock(async_mutex_lock&& other) noexcept
+        : m_(std::exchange(other.m_, nullptr))
+    {
+    }
+
+    async_mutex_lock& operator=(async_mutex_lock&&) = delete;
+
+    inline ~async_mutex_lock();
+};
+
+class async_mutex
+{
+    // not_locked, locked_no_waiters, or the newest waiter
+    static constexpr std::uintptr_t not_locked = 1;
+    static constexpr std::uintptr_t locked_no_waiters = 0;
+
+    std::atomic<std::uintptr_t> state_{not_locked};
+
+    // Waiters taken from state_, oldest first; only the holder
+    // touches the list
+    detail::sync_waiter* waiters_ = nullptr;
+
+    class lock_awaitable
+    {
+    protected:
+        async_mutex* m_;
+        detail::sync_waiter w_;
+
+    public:
+        explicit lock_awaitable(async_mutex& m) noexcept
+            : m_(&m)
+        {
+        }
+
+        lock_awaitable(lock_awaitable const& other) noexcept
+            : m_(other.m_)
+        {
+        }
+
+        bool await_ready() noexcept { return m_->try_lock(); }
+
+        bool await_suspend(std::coroutine_handle<> h, io_env const* env)
+        {
+            w_.env = env;
+            w_.cont.h = h;
+            env->executor.on_work_started();
+            auto old = m_->state_.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                if(old == not_locked)
+                {
+                    if(m_->state_.compare_exchange_weak(old, locked_no_waiters,
+                        std::memory_order_acquire, std::memory_order_relaxed))
+                    {
+                        env->executor.on_work_finished();
+                        return false;
+                    }
+                    continue;
+                }
+                w_.next = reinterpret_cast<detail::sync_waiter*>(old);
+                if(m_->state_.compare_exchange_weak(old,
+                    reinterpret_cast<std::uintptr_t>(&w_),
+                    std::memory_order_release, std::memory_order_relaxed))
+                    return true;
+            }
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    class scoped_lock_awaitable : public lock_awaitable
+    {
+    public:
+        using lock_awaitable::lock_awaitable;
+
+        async_mutex_lock await_resume() const noexcept
+        {
+            return {*this->m_, std::adopt_lock};
+        }
+    };
+
+public:
+    async_mutex() = default;
+    async_mutex(async_mutex const&) = delete;
+    async_mutex& operator=(async_mutex const&) = delete;
+
+    ~async_mutex()
+    {
+        assert(state_.load(std::memory_order_relaxed) == not_locked);
+    }
+
+    bool try_lock() noexcept
+    {
+        auto old = not_locked;
+        return state_.compare_exchange_strong(old, locked_no_waiters,
+            std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    // co_await lock() acquires the mutex; the task unlocks it
+    lock_awaitable lock() noexcept { return lock_awaitable(*this); }
+
+    // co_await scoped_lock() acquires the mutex and returns an
+    // async_mutex_lock that unlocks it
+    scoped_lock_awaitable scoped_lock() noexcept
+    {
+        return scoped_lock_awaitable(*this);
+    }
+
+    void unlock()
+    {
+        auto* w = waiters_;
+        if(!w)
+        {
+            auto old = locked_no_waiters;
+            if(state_.compare_exchange_strong(old, not_locked,
+                std::memory_order_release, std::memory_order_relaxed))
+                return;
+            old = state_.exchange(locked_no_waiters, std::memory_order_acquire);
+            w = detail::oldest_first(reinterpret_cast<detail::sync_waiter*>(old));
+        }
+        // The mutex stays locked, now held by w
+        waiters_ = w->next;
+        w->wake();
+    }
+};
+
+async_mutex_lock::~async_mutex_lock()
+{
+    if(m_)
+        m_->unlock();
+}
+
+class async_semaphore
+{
+    // Permits left; below zero, the number of tasks waiting or
+    // about to
+    std::atomic<std::ptrdiff_t> count_;
+
+    std::mutex mutex_;
+    detail::sync_waiter* head_ = nullptr;
+    detail::sync_waiter* tail_ = nullptr;
+
+    // Permits released to a task that took its place in count_
+    // but had not yet linked its node
+    std::ptrdiff_t pending_ = 0;
+
+    class acquire_awaitable
+    {
+        async_semaphore* s_;
+        detail::sync_waiter w_;
+
+    public:
+        explicit acquire_awaitable(async_semaphore& s) noexcept
+            : s_(&s)
+        {
+        }
+
+        acquire_awaitable(acquire_awaitable const& other) noexcept
+            : s_(other.s_)
+        {
+        }
+
+        bool await_ready() noexcept { return s_->try_acquire(); }
+
+        bool await_suspend(std::coroutine_handle<> h, io_env const* env)
+        {
+            auto& s = *s_;
+            if(s.count_.fetch_sub(1, std::memory_order_acquire) > 0)
+                return false;
+            std::lock_guard lock(s.mutex_);
+            if(s.pending_ > 0)
+            {
+                --s.pending_;
+                return false;
+            }
+            w_.env = env;
+            w_.cont.h = h;
+            env->executor.on_work_started();
+            if(s.tail_)
+                s.tail_->next = &w_;
+            else
+                s.head_ = &w_;
+            s.tail_ = &w_;
+            return true;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+public:
+    explicit async_semaphore(std::ptrdiff_t permits) noexcept
+        : count_(permits)
+    {
+    }
+
+    async_semaphore(async_semaphore const&) = delete;
+    async_semaphore& operator=(async_semaphore const&) = delete;
+
+    bool try_acquire() noexcept
+    {
+        auto c = count_.load(std::memory_order_relaxed);
+        while(c > 0)
+        {
+            if(count_.compare_exchange_weak(c, c - 1,
+                std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    // co_await acquire() takes a permit
+    acquire_awaitable acquire() noexcept { return acquire_awaitable(*this); }
+
+    void release(std::ptrdiff_t n = 1)
+    {
+        for(; n > 0; --n)
+        {
+            if(count_.fetch_add(1, std::memory_order_release) >= 0)
+                continue;
+            detail::sync_waiter* w;
+            {
+                std::lock_guard lock(mutex_);
+                w = head_;
+                if(!w)
+                {
+                    ++pending_;
+                    continue;
+                }
+                head_ = w->next;
+                if(!head_)
+                    tail_ = nullptr;
+            }
+            w->wake();
+        }
+    }
+};
+
+// A manual-reset event: set() releases every waiting task and
+// every later wait until reset()
+class async_event
+{
+    // this when set; otherwise null or the newest waiter
+    std::atomic<void*> state_;
+
+    class wait_awaitable
+    {
+        async_event* e_;
+        detail::sync_waiter w_;
+
+    public:
+        explicit wait_awaitable(async_event& e) noexcept
+            : e_(&e)
+        {
+        }
+
+        wait_awaitable(wait_awaitable const& other) noexcept
+            : e_(other.e_)
+        {
+        }
+
+        bool await_ready() const noexcept { return e_->is_set(); }
+
+        bool await_suspend(std::coroutine_handle<> h, io_env const* env)
+        {
+            w_.env = env;
+            w_.cont.h = h;
+            env->executor.on_work_started();
+            void* old = e_->state_.load(std::memory_order_acquire);
+            for(;;)
+            {
+                if(old == e_)
+                {
+                    env->executor.on_work_finished();
+                    return false;
+                }
+                w_.next = static_cast<detail::sync_waiter*>(old);
+                if(e_->state_.compare_exchange_weak(old, &w_,
+                    std::memory_order_release, std::memory_order_acquire))
+                    return true;
+            }
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+public:
+    explicit async_event(bool set = false) noexcept
+        : state_(set ? this : nullptr)
+    {
+    }
+
+    async_event(async_event const&) = delete;
+    async_event& operator=(async_event const&) = delete;
+
+    bool is_set() const noexcept
+    {
+        return state_.load(std::memory_order_acquire) == this;
+    }
+
+    // co_await wait() resumes the task once the event is set
+    wait_awaitable wait() noexcept { return wait_awaitable(*this); }
+
+    void set()
+    {
+        void* old = state_.exchange(this, std::memory_order_acq_rel);
+        if(old == this)
+            return;
+        auto* w = detail::oldest_first(static_cast<detail::sync_waiter*>(old));
+        while(w)
+            std::exchange(w, w->next)->wake();
+    }
+
+    void reset() noexcept
+    {
+        void* old = this;
+        state_.compare_exchange_strong(old, nullptr, std::memory_order_relaxed);
+    }
+};
+
+static_assert(IoAwaitable<decltype(std::declval<async_mutex&>().lock())>);
+static_assert(IoAwaitable<decltype(std::declval<async_mutex&>().scoped_lock())>);
+static_assert(IoAwaitable<decltype(std::declval<async_semaphore&>().acquire())>);
+static_assert(IoAwaitable<decltype(std::declval<async_event&>().wait())>);
+
+#if defined(__linux__)
+
+// ============================================================
+// io_uring_context - io_uring proactor execution_context
+//
+// A single-threaded event loop over one io_uring instance,
+// driven by run() and set up with raw system calls so the demo
+// needs no liburing. Awaitables prepare their SQE in
+// await_suspend and are resumed through the executor of the
+// io_env they were suspended with: inline when the loop thread
+// runs that executor, otherwise in a post_batch per executor
+// per iteration.
+//
+// SQEs are queued as coroutines suspend and published to the
+// kernel together, so one io_uring_enter per loop iteration
+// both submits the batch and waits for completions.
+//
+// Scheduling comes from basic_event_loop; an eventfd kept
+// armed in the ring wakes the loop when it is asleep.
+//
+// Operations must be started from the loop thread; the
+// submission queue has no lock. They may resume elsewhere.
+//
+// Registered buffers (read_some_fixed, write_some_fixed) skip
+// per-operation page pinning, fixed files (fixed_file) skip
+// the file table lookup, and multishot_accept keeps a single
+// ACCEPT armed for a stream of connections.
+// ============================================================
+
+// Index into the table passed to register_files
+struct fixed_file
+{
+    unsigned index;
+};
+
+class io_uring_context
+    : public detail::basic_event_loop<io_uring_context>
+{
+    friend class detail::basic_event_loop<io_uring_context>;
+
+public:
+    struct op_base
+    {
+        void (*complete)(op_base*, int res, unsigned flags) noexcept;
+    };
+
+private:
+    int ring_fd_ = -1;
+    int wake_fd_ = -1;
+
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    std::size_t sq_size_ = 0;
+    std::size_t cq_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    unsigned sq_local_tail_ = 0;
+    unsigned pending_ = 0;
+    bool ext_arg_ = false;
+
+    struct wake_op : op_base
+    {
+        io_uring_context* self;
+    };
+
+    wake_op wake_op_{};
+    std::uint64_t wake_value_ = 0;
+    bool wake_armed_ = false;
+
+    static unsigned load_acquire(unsigned* p) noexcept
+    {
+        return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+    }
+
+    static void store_release(unsigned* p, unsigned v) noexcept
+    {
+        std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+    }
+
+    [[noreturn]] static void fail(int err, char const* what)
+    {
+        detail::throw_system_error({err, std::system_category()}, what);
+    }
+
+public:
+    explicit io_uring_context(unsigned entries = 256)
+    {
+        io_uring_params params{};
+        ring_fd_ = static_cast<int>(
+            ::syscall(__NR_io_uring_setup, entries, &params));
+        if(ring_fd_ < 0)
+            fail(errno, "io_uring_setup");
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool const single = params.features & IORING_FEAT_SINGLE_MMAP;
+        ext_arg_ = params.features & IORING_FEAT_EXT_ARG;
+        if(single)
+            sq_size_ = cq_size_ = (std::max)(sq_size_, cq_size_);
+
+        sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if(sq_ptr_ == MAP_FAILED)
+            cleanup_and_fail("mmap sq");
+        if(single)
+        {
+            cq_ptr_ = sq_ptr_;
+        }
+        else
+        {
+            cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if(cq_ptr_ == MAP_FAILED)
+                cleanup_and_fail("mmap cq");
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        auto* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED)
+            cleanup_and_fail("mmap sqes");
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq = static_cast<char*>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_local_tail_ = *sq_tail_;
+
+        auto* cq = static_cast<char*>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        wake_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(wake_fd_ < 0)
+            cleanup_and_fail("eventfd");
+        wake_op_.complete = [](op_base* op, int, unsigned) noexcept {
+            static_cast<wake_op*>(op)->self->wake_armed_ = false;
+        };
+        wake_op_.self = this;
+        arm_wake();
+    }
+
+    ~io_uring_context()
+    {
+        cleanup();
+    }
+
+    // --------------------------------------------------------
+    // Registration
+    // --------------------------------------------------------
+
+    void register_buffers(iovec const* iov, unsigned n)
+    {
+        if(::syscall(__NR_io_uring_register, ring_fd_,
+            IORING_REGISTER_BUFFERS, iov, n) < 0)
+            fail(errno, "IORING_REGISTER_BUFFERS");
+    }
+
+    void unregister_buffers()
+    {
+        ::syscall(__NR_io_uring_register, ring_fd_,
+            IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    }
+
+    void register_files(int const* fds, unsigned n)
+    {
+        if(::syscall(__NR_io_uring_register, ring_fd_,
+            IORING_REGISTER_FILES, fds, n) < 0)
+            fail(errno, "IORING_REGISTER_FILES");
+    }
+
+    void unregister_files()
+    {
+        ::syscall(__NR_io_uring_register, ring_fd_,
+            IORING_UNREGISTER_FILES, nullptr, 0);
+    }
+
+    // --------------------------------------------------------
+    // Submission, for awaitables
+    // --------------------------------------------------------
+
+    // Asks the kernel to cancel the SQE submitted for op. The
+    // cancel's own completion is ignored. Loop thread only.
+    void cancel(op_base& op) noexcept
+    {
+        auto& sqe = prepare(nullptr);
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.addr = reinterpret_cast<std::uint64_t>(&op);
+    }
+
+    // Returns a zeroed SQE whose user_data is op, or zero when
+    // op is null and the completion should be ignored. The SQE
+    // is published to the kernel on the next loop iteration.
+    // Loop thread only.
+    io_uring_sqe& prepare(op_base* op)
+    {
+        if(sq_local_tail_ - load_acquire(sq_head_) == sq_entries_)
+            enter(false);
+        auto const index = sq_local_tail_ & sq_mask_;
+        auto& sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = reinterpret_cast<std::uint64_t>(op);
+        sq_array_[index] = index;
+        ++sq_local_tail_;
+        ++pending_;
+        return sqe;
+    }
+
+private:
+    void cleanup() noexcept
+    {
+        if(wake_fd_ >= 0)
+            ::close(wake_fd_);
+        if(sqes_)
+            ::munmap(sqes_, sqes_size_);
+        if(cq_ptr_ && cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+            ::munmap(cq_ptr_, cq_size_);
+        if(sq_ptr_ && sq_ptr_ != MAP_FAILED)
+            ::munmap(sq_ptr_, sq_size_);
+        if(ring_fd_ >= 0)
+            ::close(ring_fd_);
+    }
+
+    [[noreturn]] void cleanup_and_fail(char const* what)
+    {
+        int const err = errno;
+        cleanup();
+        fail(err, what);
+    }
+
+    // Queues the eventfd read. Its completion only clears
+    // wake_armed_, and poll re-arms it before the next enter:
+    // prepare may enter the ring to make room, which can throw.
+    void arm_wake()
+    {
+        auto& sqe = prepare(&wake_op_);
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = wake_fd_;
+        sqe.addr = reinterpret_cast<std::uint64_t>(&wake_value_);
+        sqe.len = sizeof(wake_value_);
+        wake_armed_ = true;
+    }
+
+    void wake_loop() noexcept
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+    void poll(int timeout)
+    {
+        if(!wake_armed_)
+            arm_wake();
+        if(timeout > 0 && !ext_arg_)
+        {
+            // Before Linux 5.11 io_uring_enter cannot bound its
+            // wait, but the ring fd polls readable on completion
+            enter(false);
+            pollfd p{ring_fd_, POLLIN, 0};
+            ::poll(&p, 1, timeout);
+        }
+        else
+        {
+            enter(timeout != 0, timeout);
+        }
+        reap();
+    }
+
+    // Submits the queued SQEs; when wait is true, also waits for
+    // a completion, for at most timeout milliseconds unless it
+    // is negative
+    void enter(bool wait, int timeout = -1)
+    {
+        if(!pending_ && !wait)
+            return;
+        store_release(sq_tail_, sq_local_tail_);
+
+        __kernel_timespec ts{};
+        io_uring_getevents_arg arg{};
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0u;
+        void* argp = nullptr;
+        std::size_t argsz = 0;
+        if(wait && timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        for(;;)
+        {
+            auto const n = ::syscall(__NR_io_uring_enter, ring_fd_,
+                pending_, wait ? 1u : 0u, flags, argp, argsz);
+            if(n >= 0)
+            {
+                pending_ -= static_cast<unsigned>(n);
+                return;
+            }
+            // Timed out with nothing submitted
+            if(errno == ETIME)
+                return;
+            if(errno == EINTR)
+                continue;
+            if(errno == EBUSY || errno == EAGAIN)
+            {
+                // Completion queue is backed up; reap and retry
+                reap();
+                continue;
+            }
+            fail(errno, "io_uring_enter");
+        }
+    }
+
+    void reap() noexcept
+    {
+        unsigned head = *cq_head_;
+        for(;;)
+        {
+            if(head == load_acquire(cq_tail_))
+                break;
+            auto const& cqe = cqes_[head & cq_mask_];
+            auto* op = reinterpret_cast<op_base*>(cqe.user_data);
+            int const res = cqe.res;
+            unsigned const flags = cqe.flags;
+            store_release(cq_head_, ++head);
+            if(op)
+                op->complete(op, res, flags);
+        }
+    }
+};
+
+static_assert(Executor<io_uring_context::executor_type>);
+static_assert(BatchExecutor<io_uring_context::executor_type>);
+static_assert(any_executor::fits<io_uring_context::executor_type>);
+
+// ============================================================
+// io_uring awaitables
+// ============================================================
+
+namespace detail {
+
+// Sets the descriptor of an SQE from a plain or fixed file
+struct uring_file
+{
+    int fd;
+    bool fixed;
+
+    uring_file(int f) noexcept : fd(f), fixed(false) {}
+    uring_file(fixed_file f) noexcept : fd(static_cast<int>(f.index)), fixed(true) {}
+
+    void apply(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.fd = fd;
+        if(fixed)
+            sqe.flags |= IOSQE_FIXED_FILE;
+    }
+};
+
+// Common base of single-shot operations. Derived provides
+// prepare(io_uring_sqe&); the CQE result becomes res_.
+//
+// A stop request submits IORING_OP_ASYNC_CANCEL for the SQE,
+// and the operation completes with ECANCELED as soon as the
+// kernel drops it.
+template<class Derived>
+struct uring_op : io_uring_context::op_base
+{
+    io_uring_context* ctx_;
+    io_env const* env_ = nullptr;
+    continuation cont_;
+    int res_ = 0;
+    bool done_ = false;
+    stop_registration<io_uring_context> stop_{&uring_op::on_stop, this};
+
+    explicit uring_op(io_uring_context& ctx) noexcept
+        : op_base{&uring_op::on_complete}
+        , ctx_(&ctx)
+    {
+    }
+
+    uring_op(uring_op const& other) noexcept
+        : op_base{&uring_op::on_complete}
+        , ctx_(other.ctx_)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        if(env->stop_token.stop_requested())
+        {
+            res_ = -ECANCELED;
+            return h;
+        }
+        env_ = env;
+        cont_.h = h;
+        static_cast<Derived*>(this)->prepare(ctx_->prepare(this));
+        ctx_->work_started();
+        stop_.arm(*ctx_, env->stop_token);
+        return std::noop_coroutine();
+    }
+
+    static void on_complete(op_base* base, int res, unsigned) noexcept
+    {
+        auto* self = static_cast<uring_op*>(base);
+        self->done_ = true;
+        self->stop_.disarm();
+        self->res_ = res;
+        self->ctx_->work_finished();
+        self->ctx_->resume_completion(self->env_, self->cont_);
+    }
+
+    // Loop thread, in response to a stop request
+    static void on_stop(void* p) noexcept
+    {
+        auto* self = static_cast<uring_op*>(p);
+        if(self->done_)
+            return;
+        self->ctx_->cancel(*self);
+    }
+
+    std::error_code error() const noexcept
+    {
+        if(res_ < 0)
+            return {-res_, std::system_category()};
+        return {};
+    }
+
+    std::size_t transferred() const noexcept
+    {
+        return res_ < 0 ? 0 : static_cast<std::size_t>(res_);
+    }
+};
+
+} // namespace detail
+
+struct uring_read_some : detail::uring_op<uring_read_some>
+{
+    detail::uring_file file_;
+    mutable_buffer buf_;
+    std::uint64_t offset_;
+
+    uring_read_some(io_uring_context& ctx, detail::uring_file f,
+        mutable_buffer b, std::uint64_t offset) noexcept
+        : uring_op(ctx), file_(f), buf_(b), offset_(offset)
+    {
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = IORING_OP_READ;
+        file_.apply(sqe);
+        sqe.addr = reinterpret_cast<std::uint64_t>(buf_.data);
+        sqe.len = static_cast<unsigned>(buf_.size);
+        sqe.off = offset_;
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return detail::read_result(error(), transferred(), buf_.size);
+    }
+};
+
+struct uring_write_some : detail::uring_op<uring_write_some>
+{
+    detail::uring_file file_;
+    const_buffer buf_;
+    std::uint64_t offset_;
+
+    uring_write_some(io_uring_context& ctx, detail::uring_file f,
+        const_buffer b, std::uint64_t offset) noexcept
+        : uring_op(ctx), file_(f), buf_(b), offset_(offset)
+    {
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = IORING_OP_WRITE;
+        file_.apply(sqe);
+        sqe.addr = reinterpret_cast<std::uint64_t>(buf_.data);
+        sqe.len = static_cast<unsigned>(buf_.size);
+        sqe.off = offset_;
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return {error(), transferred()};
+    }
+};
+
+// Gathers up to iovec_array::max_iov buffers into one WRITEV
+struct uring_writev : detail::uring_op<uring_writev>
+{
+    detail::uring_file file_;
+    detail::iovec_array iov_;
+
+    uring_writev(io_uring_context& ctx, detail::uring_file f,
+        std::span<const_buffer const> bufs) noexcept
+        : uring_op(ctx), file_(f), iov_(bufs)
+    {
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = IORING_OP_WRITEV;
+        file_.apply(sqe);
+        sqe.addr = reinterpret_cast<std::uint64_t>(iov_.iov);
+        sqe.len = iov_.count;
+        sqe.off = static_cast<std::uint64_t>(-1);
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return {error(), transferred()};
+    }
+};
+
+// Read or write through a buffer registered with register_buffers
+struct uring_rw_fixed : detail::uring_op<uring_rw_fixed>
+{
+    detail::uring_file file_;
+    mutable_buffer buf_;
+    unsigned buf_index_;
+    std::uint8_t opcode_;
+
+    uring_rw_fixed(io_uring_context& ctx, std::uint8_t opcode,
+        detail::uring_file f, mutable_buffer b, unsigned buf_index) noexcept
+        : uring_op(ctx), file_(f), buf_(b), buf_index_(buf_index), opcode_(opcode)
+    {
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = opcode_;
+        file_.apply(sqe);
+        sqe.addr = reinterpret_cast<std::uint64_t>(buf_.data);
+        sqe.len = static_cast<unsigned>(buf_.size);
+        sqe.off = static_cast<std::uint64_t>(-1);
+        sqe.buf_index = static_cast<std::uint16_t>(buf_index_);
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        if(opcode_ == IORING_OP_READ_FIXED)
+            return detail::read_result(error(), transferred(), buf_.size);
+        return {error(), transferred()};
+    }
+};
+
+struct uring_accept : detail::uring_op<uring_accept>
+{
+    detail::uring_file file_;
+
+    uring_accept(io_uring_context& ctx, detail::uring_file f) noexcept
+        : uring_op(ctx), file_(f)
+    {
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = IORING_OP_ACCEPT;
+        file_.apply(sqe);
+        sqe.accept_flags = SOCK_CLOEXEC;
+    }
+
+    io_result<int> await_resume() const noexcept
+    {
+        if(res_ < 0)
+            return {error(), -1};
+        return {{}, res_};
+    }
+};
+
+struct uring_connect : detail::uring_op<uring_connect>
+{
+    detail::uring_file file_;
+    sockaddr_storage addr_;
+    socklen_t len_;
+
+    uring_connect(io_uring_context& ctx, detail::uring_file f,
+        sockaddr const* addr, socklen_t len) noexcept
+        : uring_op(ctx), file_(f), len_(len)
+    {
+        std::memcpy(&addr_, addr, len);
+    }
+
+    void prepare(io_uring_sqe& sqe) const noexcept
+    {
+        sqe.opcode = IORING_OP_CONNECT;
+        file_.apply(sqe);
+        sqe.addr = reinterpret_cast<std::uint64_t>(&addr_);
+        sqe.off = len_;
+    }
+
+    io_result<> await_resume() const noexcept { return {error()}; }
+};
+
+static_assert(IoAwaitable<uring_read_some>);
+static_assert(IoAwaitable<uring_write_some>);
+static_assert(IoAwaitable<uring_writev>);
+static_assert(IoAwaitable<uring_rw_fixed>);
+static_assert(IoAwaitable<uring_accept>);
+static_assert(IoAwaitable<uring_connect>);
+
+// ============================================================
+// uring_acceptor - multishot accept
+//
+// One ACCEPT with IORING_ACCEPT_MULTISHOT stays armed and posts
+// a CQE per connection. Descriptors that arrive while nobody
+// is waiting are kept in a small ring; when it fills, the SQE
+// is cancelled and re-armed once next() drains it.
+//
+// The kernel may still post CQEs after the acceptor is
+// destroyed, so the armed state lives in a separately
+// allocated block that the final CQE frees.
+// ============================================================
+
+class uring_acceptor
+{
+    struct state : io_uring_context::op_base
+    {
+        static constexpr unsigned capacity = 64;
+
+        io_uring_context* ctx;
+        int listen_fd;
+        bool armed = false;
+        bool orphaned = false;
+        bool waiting = false;
+        unsigned head = 0;
+        unsigned count = 0;
+        int error = 0;
+        int fds[capacity];
+
+        bool cancelled = false;
+
+        io_env const* env = nullptr;
+        continuation waiter;
+        detail::stop_registration<io_uring_context> stop{&state::on_stop, this};
+
+        // Resumes the waiter. Loop thread only.
+        void resume() noexcept
+        {
+            waiting = false;
+            stop.disarm();
+            detail::resume_on<io_uring_context::executor_type>(env, waiter);
+        }
+
+        // A stop request abandons the wait; the SQE stays armed
+        static void on_stop(void* p) noexcept
+        {
+            auto* s = static_cast<state*>(p);
+            if(!s->waiting)
+                return;
+            s->cancelled = true;
+            s->resume();
+        }
+
+        static void on_complete(op_base* base, int res, unsigned flags) noexcept
+        {
+            auto* s = static_cast<state*>(base);
+            bool const more = flags & IORING_CQE_F_MORE;
+            if(!more)
+            {
+                s->armed = false;
+                s->ctx->work_finished();
+            }
+            if(s->orphaned)
+            {
+                if(res >= 0)
+                    ::close(res);
+                if(!more)
+                    delete s;
+                return;
+            }
+            if(res >= 0)
+            {
+                // Connections beyond capacity are refused by
+                // closing them; the SQE is re-armed once next()
+                // drains the ring.
+                if(s->count < capacity)
+                    s->fds[(s->head + s->count++) % capacity] = res;
+                else
+                    ::close(res);
+                if(s->count == capacity && s->armed)
+                    s->cancel();
+            }
+            else if(res != -ECANCELED)
+            {
+                s->error = -res;
+            }
+            if(!s->waiting)
+                return;
+            if(s->count || s->error)
+                s->resume();
+            else if(!s->armed)
+            {
+                s->arm();
+            }
+        }
+
+        void arm() noexcept
+        {
+            auto& sqe = ctx->prepare(this);
+            sqe.opcode = IORING_OP_ACCEPT;
+            sqe.fd = listen_fd;
+            sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe.accept_flags = SOCK_CLOEXEC;
+            armed = true;
+            ctx->work_started();
+        }
+
+        // The cancel's own CQE is ignored, since it may arrive
+        // after the final CQE has freed the state.
+        void cancel() noexcept
+        {
+            ctx->cancel(*this);
+        }
+    };
+
+    state* s_;
+
+public:
+    uring_acceptor(io_uring_context& ctx, int listen_fd)
+        : s_(new state)
+    {
+        s_->complete = &state::on_complete;
+        s_->ctx = &ctx;
+        s_->listen_fd = listen_fd;
+    }
+
+    ~uring_acceptor()
+    {
+        while(s_->count)
+        {
+            ::close(s_->fds[s_->head]);
+            s_->head = (s_->head + 1) % state::capacity;
+            --s_->count;
+        }
+        if(!s_->armed)
+        {
+            delete s_;
+            return;
+        }
+        s_->orphaned = true;
+        s_->cancel();
+    }
+
+    uring_acceptor(uring_acceptor const&) = delete;
+    uring_acceptor& operator=(uring_acceptor const&) = delete;
+
+    struct next_awaitable
+    {
+        state* s_;
+
+        bool await_ready() const noexcept
+        {
+            return s_->count != 0 || s_->error != 0;
+        }
+
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> h, io_env const* env)
+        {
+            if(env->stop_token.stop_requested())
+            {
+                s_->cancelled = true;
+                return h;
+            }
+            s_->env = env;
+            s_->waiter.h = h;
+            s_->waiting = true;
+            if(!s_->armed)
+                s_->arm();
+            s_->stop.arm(*s_->ctx, env->stop_token);
+            return std::noop_coroutine();
+        }
+
+        io_result<int> await_resume() const noexcept
+        {
+            if(std::exchange(s_->cancelled, false))
+                return {{ECANCELED, std::system_category()}, -1};
+            if(s_->count == 0)
+            {
+                int const err = std::exchange(s_->error, 0);
+                return {{err ? err : ECANCELED, std::system_category()}, -1};
+            }
+            int fd = s_->fds[s_->head];
+            s_->head = (s_->head + 1) % state::capacity;
+            --s_->count;
+            return {{}, fd};
+        }
+    };
+
+    // Awaits the next accepted connection
+    next_awaitable next() noexcept { return {s_}; }
+};
+
+static_assert(IoAwaitable<uring_acceptor::next_awaitable>);
+
+// ============================================================
+// io_uring_context operations
+// ============================================================
+
+inline uring_read_some
+read_some(io_uring_context& ctx, detail::uring_file f, mutable_buffer b)
+{
+    return {ctx, f, b, static_cast<std::uint64_t>(-1)};
+}
+
+inline uring_read_some
+read_some_at(io_uring_context& ctx, detail::uring_file f,
+    std::uint64_t offset, mutable_buffer b)
+{
+    return {ctx, f, b, offset};
+}
+
+inline uring_write_some
+write_some(io_uring_context& ctx, detail::uring_file f, const_buffer b)
+{
+    return {ctx, f, b, static_cast<std::uint64_t>(-1)};
+}
+
+// Writes the first iovec_array::max_iov non-empty buffers
+inline uring_writev
+write_some(io_uring_context& ctx, detail::uring_file f,
+    std::span<const_buffer const> bufs)
+{
+    return {ctx, f, bufs};
+}
+
+inline uring_write_some
+write_some_at(io_uring_context& ctx, detail::uring_file f,
+    std::uint64_t offset, const_buffer b)
+{
+    return {ctx, f, b, offset};
+}
+
+// b must lie inside registered buffer buf_index
+inline uring_rw_fixed
+read_some_fixed(io_uring_context& ctx, detail::uring_file f,
+    mutable_buffer b, unsigned buf_index)
+{
+    return {ctx, IORING_OP_READ_FIXED, f, b, buf_index};
+}
+
+inline uring_rw_fixed
+write_some_fixed(io_uring_context& ctx, detail::uring_file f,
+    mutable_buffer b, unsigned buf_index)
+{
+    return {ctx, IORING_OP_WRITE_FIXED, f, b, buf_index};
+}
+
+inline uring_accept
+accept(io_uring_context& ctx, detail::uring_file f)
+{
+    return {ctx, f};
+}
+
+inline uring_connect
+connect(io_uring_context& ctx, detail::uring_file f,
+    sockaddr const* addr, socklen_t len)
+{
+    return {ctx, f, addr, len};
+}
+
+// ============================================================
+// sharded_context - one pinned io_uring loop per core
+//
+// A single pool shared by every core keeps moving the same
+// cache lines between them. Sharding keeps each connection on
+// one core instead: every shard is an io_uring_context run by
+// its own thread, pinned to one CPU of the process's affinity
+// mask, with its own recycling_frame_pool.
+//
+// The shard's thread pins itself before it creates anything,
+// then builds its ring and pool and installs the pool as its
+// cached frame allocator. Under the kernel's default local
+// allocation policy, the ring and every block the pool takes
+// from upstream come from the shard's NUMA node. Tasks created
+// on the shard get frames from its pool, and an io_env made
+// there carries the shard's executor and frame_allocator.
+//
+// Shards share nothing. Work moves between them by posting to
+// another shard's executor, which pushes onto that loop's MPSC
+// continuation_queue and wakes it. A frame freed on a shard
+// other than its own goes back through its pool's return
+// queue.
+//
+// run(fn) starts the shards and calls fn(shard&) on each once
+// all of them exist. The loops keep running, even with
+// nothing to do, until stop(); run then returns when every
+// shard is out of work. The loops and pools exist only while
+// run is running.
+//
+// open_reuseport_listener gives each shard its own listening
+// socket on one port, and the kernel spreads incoming
+// connections across them.
+// ============================================================
+
+class sharded_context
+{
+public:
+    class shard
+    {
+        friend class sharded_context;
+
+        unsigned index_ = 0;
+        int cpu_ = -1;
+        unsigned node_ = 0;
+        std::optional<recycling_frame_pool> pool_;
+        std::optional<io_uring_context> ctx_;
+
+    public:
+        unsigned index() const noexcept { return index_; }
+
+        // The CPU the shard's thread is pinned to, or -1
+        int cpu() const noexcept { return cpu_; }
+
+        unsigned numa_node() const noexcept { return node_; }
+
+        io_uring_context& context() noexcept { return *ctx_; }
+
+        io_uring_context::executor_type get_executor() noexcept
+        {
+            return ctx_->get_executor();
+        }
+
+        recycling_frame_pool& frame_pool() noexcept { return *pool_; }
+    };
+
+    explicit sharded_context(
+        unsigned shards = std::thread::hardware_concurrency())
+        : size_(shards ? shards : 1)
+        , shards_(new shard[size_])
+    {
+        // Shard i gets the i-th CPU the process may run on
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        std::vector<int> cpus;
+        if(::sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if(CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+        for(unsigned i = 0; i < size_; ++i)
+        {
+            shards_[i].index_ = i;
+            if(!cpus.empty())
+                shards_[i].cpu_ = cpus[i % cpus.size()];
+        }
+    }
+
+    sharded_context(sharded_context const&) = delete;
+    sharded_context& operator=(sharded_context const&) = delete;
+
+    std::size_t size() const noexcept { return size_; }
+
+    shard& operator[](std::size_t i) noexcept { return shards_[i]; }
+
+    // The shard whose thread this is, or null
+    static shard* current() noexcept { return local(); }
+
+    template<class Fn>
+    void run(Fn fn)
+    {
+        stopped_.store(false, std::memory_order_relaxed);
+        std::latch ready(static_cast<std::ptrdiff_t>(size_));
+        std::vector<std::thread> threads;
+        threads.reserve(size_);
+        for(std::size_t i = 0; i < size_; ++i)
+            threads.emplace_back([this, &ready, &fn, &s = shards_[i]] {
+                run_shard(s, ready, fn);
+            });
+        for(auto& t : threads)
+            t.join();
+
+        // Not before every thread is done: a work_finished from
+        // another shard may still be waking a loop that has just
+        // returned. Thread exit flushed the caches into the pools.
+        for(std::size_t i = 0; i < size_; ++i)
+        {
+            shards_[i].ctx_.reset();
+            shards_[i].pool_.reset();
+        }
+    }
+
+    // Lets every loop return once it runs out of work. Any
+    // thread may call this while run is running.
+    void stop() noexcept
+    {
+        if(stopped_.exchange(true, std::memory_order_acq_rel))
+            return;
+        for(std::size_t i = 0; i < size_; ++i)
+            shards_[i].get_executor().on_work_finished();
+    }
+
+private:
+    std::size_t size_;
+    std::unique_ptr<shard[]> shards_;
+    std::atomic<bool> stopped_{false};
+
+    static shard*& local() noexcept
+    {
+        static thread_local shard* s = nullptr;
+        return s;
+    }
+
+    template<class Fn>
+    void run_shard(shard& s, std::latch& ready, Fn& fn)
+    {
+        if(s.cpu_ >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(s.cpu_, &set);
+            ::sched_setaffinity(0, sizeof(set), &set);
+        }
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if(::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+            s.node_ = node;
+
+        s.pool_.emplace();
+        s.ctx_.emplace();
+        auto* saved_allocator = get_cached_frame_allocator();
+        set_cached_frame_allocator(&*s.pool_);
+        auto* saved_shard = std::exchange(local(), &s);
+
+        // Held until stop(), so an idle shard stays up for
+        // work other shards post to it
+        s.get_executor().on_work_started();
+        ready.arrive_and_wait();
+        fn(s);
+        s.ctx_->run();
+
+        local() = saved_shard;
+        set_cached_frame_allocator(saved_allocator);
+    }
+};
+
+// A listening socket with SO_REUSEPORT, bound to addr. One per
+// shard on the same port lets the kernel balance accepts
+// across the shards. A zero port is replaced in addr by the
+// one the kernel picked, for the next shard to reuse.
+inline int
+open_reuseport_listener(sockaddr_in& addr, int backlog = SOMAXCONN)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    socklen_t len = sizeof(addr);
+    if(fd < 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        ::bind(fd, reinterpret_cast<sockaddr*>(&addr), len) < 0 ||
+        ::listen(fd, backlog) < 0 ||
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+    {
+        int err = errno;
+        if(fd >= 0)
+            ::close(fd);
+        detail::throw_system_error({err, std::system_category()}, "listen");
+    }
+    return fd;
+}
+
+#endif // defined(__linux__)
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+
+// ============================================================
+// reactor_context - epoll / kqueue readiness execution_context
+//
+// Fallback for hosts without io_uring, with the same
+// read_some, write_some, accept and connect operations.
+// Descriptors are set non-blocking and registered once, edge
+// triggered (EPOLLET, or EV_CLEAR with kqueue), for both
+// directions.
+//
+// Every operation first attempts its system call in
+// await_ready. When data is already buffered it completes
+// there, and the coroutine never suspends. Only on EAGAIN does
+// it park in the descriptor's reader or writer slot until the
+// next edge.
+//
+// Operations must be started from the loop thread. Close a
+// descriptor with close(fd) so it is removed before the number
+// can be reused.
+// ============================================================
+
+class reactor_context
+    : public detail::basic_event_loop<reactor_context>
+{
+    friend class detail::basic_event_loop<reactor_context>;
+
+public:
+    struct descriptor_state;
+
+    // A stop request removes the operation from its descriptor
+    // and completes it with ECANCELED.
+    struct op_base
+    {
+        // Retries the system call; returns false on EAGAIN
+        bool (*perform)(op_base*) noexcept;
+        reactor_context* ctx;
+        io_env const* env = nullptr;
+        continuation cont;
+        int error = 0;
+        descriptor_state* desc = nullptr;
+        detail::stop_registration<reactor_context> stop{&op_base::on_stop, this};
+
+        op_base(bool (*fn)(op_base*) noexcept, reactor_context& c) noexcept
+            : perform(fn)
+            , ctx(&c)
+        {
+        }
+
+        op_base(op_base const& other) noexcept
+            : perform(other.perform)
+            , ctx(other.ctx)
+        {
+        }
+
+        static void on_stop(void* p) noexcept;
+    };
+
+    struct descriptor_state
+    {
+        int fd = -1;
+        bool registered = false;
+        op_base* reader = nullptr;
+        op_base* writer = nullptr;
+    };
+
+private:
+    int poll_fd_ = -1;
+#if defined(CAPY_REACTOR_EPOLL)
+    int wake_fd_ = -1;
+#endif
+    std::vector<std::unique_ptr<descriptor_state>> descriptors_;
+
+    [[noreturn]] static void fail(int err, char const* what)
+    {
+        detail::throw_system_error({err, std::system_category()}, what);
+    }
+
+public:
+    reactor_context()
+    {
+#if defined(CAPY_REACTOR_EPOLL)
+        poll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if(poll_fd_ < 0)
+            fail(errno, "epoll_create1");
+        wake_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(wake_fd_ < 0)
+        {
+            int const err = errno;
+            ::close(poll_fd_);
+            fail(err, "eventfd");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr;
+        ::epoll_ctl(poll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+#else
+        poll_fd_ = ::kqueue();
+        if(poll_fd_ < 0)
+            fail(errno, "kqueue");
+        struct kevent ev;
+        EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+        ::kevent(poll_fd_, &ev, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    ~reactor_context()
+    {
+#if defined(CAPY_REACTOR_EPOLL)
+        ::close(wake_fd_);
+#endif
+        ::close(poll_fd_);
+    }
+
+    // Returns the state for fd, making it non-blocking and
+    // registering it on first use.
+    descriptor_state& descriptor(int fd)
+    {
+        if(static_cast<std::size_t>(fd) >= descriptors_.size())
+            descriptors_.resize(fd + 1);
+        auto& d = descriptors_[fd];
+        if(!d)
+        {
+            d = std::make_unique<descriptor_state>();
+            d->fd = fd;
+        }
+        if(!d->registered)
+        {
+            int const flags = ::fcntl(fd, F_GETFL);
+            if(flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+                fail(errno, "fcntl");
+#if defined(CAPY_REACTOR_EPOLL)
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = d.get();
+            if(::epoll_ctl(poll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+                fail(errno, "epoll_ctl");
+#else
+            struct kevent ev[2];
+            EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, d.get());
+            EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, d.get());
+            if(::kevent(poll_fd_, ev, 2, nullptr, 0, nullptr) < 0)
+                fail(errno, "kevent");
+#endif
+            d->registered = true;
+        }
+        return *d;
+    }
+
+    // Deregisters and closes fd. Pending operations complete
+    // with ECANCELED.
+    void close(int fd) noexcept
+    {
+        if(static_cast<std::size_t>(fd) < descriptors_.size() &&
+            descriptors_[fd] && descriptors_[fd]->registered)
+        {
+            auto& d = *descriptors_[fd];
+#if defined(CAPY_REACTOR_EPOLL)
+            ::epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#else
+            struct kevent ev[2];
+            EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+            EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+            ::kevent(poll_fd_, ev, 2, nullptr, 0, nullptr);
+#endif
+            d.registered = false;
+            // Cancelling may resume a coroutine inline that waits
+            // on the descriptor again, so detach both first
+            auto* reader = std::exchange(d.reader, nullptr);
+            auto* writer = std::exchange(d.writer, nullptr);
+            cancel(reader);
+            cancel(writer);
+        }
+        ::close(fd);
+    }
+
+    // Parks op until its direction of fd becomes ready
+    void wait_read(descriptor_state& d, op_base& op)
+    {
+        d.reader = &op;
+        op.desc = &d;
+        work_started();
+        op.stop.arm(*this, op.env->stop_token);
+    }
+
+    void wait_write(descriptor_state& d, op_base& op)
+    {
+        d.writer = &op;
+        op.desc = &d;
+        work_started();
+        op.stop.arm(*this, op.env->stop_token);
+    }
+
+private:
+    friend struct op_base;
+
+    void cancel(op_base* op) noexcept
+    {
+        if(!op)
+            return;
+        op->error = ECANCELED;
+        complete(*op);
+    }
+
+    void complete(op_base& op) noexcept
+    {
+        op.stop.disarm();
+        work_finished();
+        resume_completion(op.env, op.cont);
+    }
+
+    void cancel_wait(op_base& op) noexcept
+    {
+        auto* d = op.desc;
+        if(d && d->reader == &op)
+            d->reader = nullptr;
+        else if(d && d->writer == &op)
+            d->writer = nullptr;
+        else
+            return;
+        cancel(&op);
+    }
+
+    void ready(op_base*& slot) noexcept
+    {
+        auto* op = slot;
+        if(op && op->perform(op))
+        {
+            slot = nullptr;
+            complete(*op);
+        }
+    }
+
+    void wake_loop() noexcept
+    {
+#if defined(CAPY_REACTOR_EPOLL)
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(wake_fd_, &one, sizeof(one));
+#else
+        struct kevent ev;
+        EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+        ::kevent(poll_fd_, &ev, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    void poll(int timeout)
+    {
+        constexpr int max_events = 128;
+#if defined(CAPY_REACTOR_EPOLL)
+        epoll_event events[max_events];
+        int n = ::epoll_wait(poll_fd_, events, max_events, timeout);
+        if(n < 0 && errno != EINTR)
+            fail(errno, "epoll_wait");
+        for(int i = 0; i < n; ++i)
+        {
+            auto* d = static_cast<descriptor_state*>(events[i].data.ptr);
+            if(!d)
+            {
+                std::uint64_t value;
+                [[maybe_unused]] auto r = ::read(wake_fd_, &value, sizeof(value));
+                continue;
+            }
+            auto const e = events[i].events;
+            if(e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                ready(d->reader);
+            if(e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                ready(d->writer);
+        }
+#else
+        struct kevent events[max_events];
+        timespec ts{timeout / 1000, (timeout % 1000) * 1000000L};
+        int n = ::kevent(poll_fd_, nullptr, 0, events, max_events,
+            timeout < 0 ? nullptr : &ts);
+        if(n < 0 && errno != EINTR)
+            fail(errno, "kevent");
+        for(int i = 0; i < n; ++i)
+        {
+            if(events[i].filter == EVFILT_USER)
+                continue;
+            auto* d = static_cast<descriptor_state*>(events[i].udata);
+            if(events[i].filter == EVFILT_READ)
+                ready(d->reader);
+            else if(events[i].filter == EVFILT_WRITE)
+                ready(d->writer);
+        }
+#endif
+    }
+};
+
+inline void
+reactor_context::op_base::on_stop(void* p) noexcept
+{
+    auto* op = static_cast<op_base*>(p);
+    op->ctx->cancel_wait(*op);
+}
+
+static_assert(Executor<reactor_context::executor_type>);
+static_assert(BatchExecutor<reactor_context::executor_type>);
+static_assert(any_executor::fits<reactor_context::executor_type>);
+
+// ============================================================
+// reactor awaitables
+// ============================================================
+
+namespace detail {
+
+// Derived provides bool attempt() noexcept, which performs the
+// system call once and returns false on EAGAIN, and
+// bool writing() telling which direction to wait on.
+template<class Derived>
+struct reactor_op : reactor_context::op_base
+{
+    int fd_;
+
+    reactor_op(reactor_context& ctx, int fd) noexcept
+        : op_base(&reactor_op::retry, ctx)
+        , fd_(fd)
+    {
+    }
+
+    static bool retry(op_base* base) noexcept
+    {
+        return static_cast<Derived*>(base)->attempt();
+    }
+
+    bool await_ready()
+    {
+        ctx->descriptor(fd_);
+        return static_cast<Derived*>(this)->attempt();
+    }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        if(env->stop_token.stop_requested())
+        {
+            error = ECANCELED;
+            return h;
+        }
+        this->env = env;
+        cont.h = h;
+        auto& d = ctx->descriptor(fd_);
+        if(static_cast<Derived const*>(this)->writing())
+            ctx->wait_write(d, *this);
+        else
+            ctx->wait_read(d, *this);
+        return std::noop_coroutine();
+    }
+
+    // Records errno unless it means "try again later"
+    bool finish(long r) noexcept
+    {
+        if(r >= 0)
+            return true;
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return false;
+        error = errno;
+        return true;
+    }
+
+    std::error_code error_code() const noexcept
+    {
+        if(error)
+            return {error, std::system_category()};
+        return {};
+    }
+};
+
+} // namespace detail
+
+struct reactor_read_some : detail::reactor_op<reactor_read_some>
+{
+    mutable_buffer buf_;
+    std::size_t n_ = 0;
+
+    reactor_read_some(reactor_context& ctx, int fd, mutable_buffer b) noexcept
+        : reactor_op(ctx, fd), buf_(b)
+    {
+    }
+
+    bool writing() const noexcept { return false; }
+
+    bool attempt() noexcept
+    {
+        auto r = ::read(fd_, buf_.data, buf_.size);
+        if(r > 0)
+            n_ = static_cast<std::size_t>(r);
+        return finish(r);
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return detail::read_result(error_code(), n_, buf_.size);
+    }
+};
+
+struct reactor_write_some : detail::reactor_op<reactor_write_some>
+{
+    const_buffer buf_;
+    std::size_t n_ = 0;
+
+    reactor_write_some(reactor_context& ctx, int fd, const_buffer b) noexcept
+        : reactor_op(ctx, fd), buf_(b)
+    {
+    }
+
+    bool writing() const noexcept { return true; }
+
+    bool attempt() noexcept
+    {
+        auto r = ::write(fd_, buf_.data, buf_.size);
+        if(r > 0)
+            n_ = static_cast<std::size_t>(r);
+        return finish(r);
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return {error_code(), n_};
+    }
+};
+
+struct reactor_writev : detail::reactor_op<reactor_writev>
+{
+    detail::iovec_array iov_;
+    std::size_t n_ = 0;
+
+    reactor_writev(reactor_context& ctx, int fd,
+        std::span<const_buffer const> bufs) noexcept
+        : reactor_op(ctx, fd), iov_(bufs)
+    {
+    }
+
+    bool writing() const noexcept { return true; }
+
+    bool attempt() noexcept
+    {
+        auto r = ::writev(fd_, iov_.iov, static_cast<int>(iov_.count));
+        if(r > 0)
+            n_ = static_cast<std::size_t>(r);
+        return finish(r);
+    }
+
+    io_result<std::size_t> await_resume() const noexcept
+    {
+        return {error_code(), n_};
+    }
+};
+
+struct reactor_accept : detail::reactor_op<reactor_accept>
+{
+    int peer_ = -1;
+
+    reactor_accept(reactor_context& ctx, int fd) noexcept
+        : reactor_op(ctx, fd)
+    {
+    }
+
+    bool writing() const noexcept { return false; }
+
+    bool attempt() noexcept
+    {
+#if defined(CAPY_REACTOR_EPOLL)
+        peer_ = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+        peer_ = ::accept(fd_, nullptr, nullptr);
+        if(peer_ >= 0)
+        {
+            ::fcntl(peer_, F_SETFD, FD_CLOEXEC);
+            ::fcntl(peer_, F_SETFL, ::fcntl(peer_, F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        return finish(peer_);
+    }
+
+    io_result<int> await_resume() const noexcept
+    {
+        return {error_code(), error ? -1 : peer_};
+    }
+};
+
+// The first attempt starts the connection; later attempts,
+// made once the socket is writable, collect its result.
+struct reactor_connect : detail::reactor_op<reactor_connect>
+{
+    sockaddr_storage addr_;
+    socklen_t len_;
+    bool started_ = false;
+
+    reactor_connect(reactor_context& ctx, int fd,
+        sockaddr const* addr, socklen_t len) noexcept
+        : reactor_op(ctx, fd), len_(len)
+    {
+        std::memcpy(&addr_, addr, len);
+    }
+
+    bool writing() const noexcept { return true; }
+
+    bool attempt() noexcept
+    {
+        if(!std::exchange(started_, true))
+        {
+            if(::connect(fd_, reinterpret_cast<sockaddr const*>(&addr_), len_) == 0)
+                return true;
+            if(errno == EINPROGRESS)
+                return false;
+            error = errno;
+            return true;
+        }
+        int err = 0;
+        socklen_t n = sizeof(err);
+        if(::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &n) < 0)
+            err = errno;
+        error = err;
+        return true;
+    }
+
+    io_result<> await_resume() const noexcept { return {error_code()}; }
+};
+
+static_assert(IoAwaitable<reactor_read_some>);
+static_assert(IoAwaitable<reactor_write_some>);
+static_assert(IoAwaitable<reactor_writev>);
+static_assert(IoAwaitable<reactor_accept>);
+static_assert(IoAwaitable<reactor_connect>);
+
+// ============================================================
+// reactor_context operations
+// ============================================================
+
+inline reactor_read_some
+read_some(reactor_context& ctx, int fd, mutable_buffer b)
+{
+    return {ctx, fd, b};
+}
+
+inline reactor_write_some
+write_some(reactor_context& ctx, int fd, const_buffer b)
+{
+    return {ctx, fd, b};
+}
+
+// Writes the first iovec_array::max_iov non-empty buffers
+inline reactor_writev
+write_some(reactor_context& ctx, int fd, std::span<const_buffer const> bufs)
+{
+    return {ctx, fd, bufs};
+}
+
+inline reactor_accept
+accept(reactor_context& ctx, int fd)
+{
+    return {ctx, fd};
+}
+
+inline reactor_connect
+connect(reactor_context& ctx, int fd, sockaddr const* addr, socklen_t len)
+{
+    return {ctx, fd, addr, len};
+}
+
+#endif // defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+
+#if defined(__linux__)
+
+// ============================================================
+// mirrored_buffer - a ring buffer mapped twice in a row
+//
+// One memfd is mapped at two adjacent addresses, so byte i and
+// byte i + capacity() are the same memory. The readable bytes
+// are then a single contiguous range even when they wrap past
+// the end of the ring, and so is the free space: a parser gets
+// a plain pointer and length, and nothing is ever copied to
+// undo the wrap.
+//
+// The capacity is rounded up to whole pages.
+// ============================================================
+
+class mirrored_buffer
+{
+    unsigned char* base_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t head_ = 0; // first readable byte, below capacity_
+    std::size_t tail_ = 0; // one past the last readable byte
+
+public:
+    explicit mirrored_buffer(std::size_t capacity)
+    {
+        auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        capacity_ = (capacity == 0 ? page : (capacity + page - 1) / page * page);
+
+        int fd = ::memfd_create("capy.mirrored_buffer", MFD_CLOEXEC);
+        if(fd < 0)
+            detail::throw_system_error({errno, std::system_category()}, "memfd_create");
+        void* p = MAP_FAILED;
+        if(::ftruncate(fd, static_cast<off_t>(capacity_)) == 0)
+            p = ::mmap(nullptr, 2 * capacity_, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p != MAP_FAILED)
+        {
+            // Both halves replace the reservation in place
+            auto* b = static_cast<unsigned char*>(p);
+            if(::mmap(b, capacity_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                ::mmap(b + capacity_, capacity_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+            {
+                ::munmap(p, 2 * capacity_);
+                p = MAP_FAILED;
+            }
+        }
+        int err = errno;
+        ::close(fd);
+        if(p == MAP_FAILED)
+            detail::throw_system_error({err, std::system_category()}, "mmap");
+        base_ = static_cast<unsigned char*>(p);
+    }
+
+    ~mirrored_buffer()
+    {
+        ::munmap(base_, 2 * capacity_);
+    }
+
+    mirrored_buffer(mirrored_buffer const&) = delete;
+    mirrored_buffer& operator=(mirrored_buffer const&) = delete;
+
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    std::size_t size() const noexcept { return tail_ - head_; }
+
+    // The readable bytes
+    const_buffer data() const noexcept
+    {
+        return {base_ + head_, tail_ - head_};
+    }
+
+    // All of the free space, for the next read
+    mutable_buffer prepare() noexcept
+    {
+        return {base_ + tail_, capacity_ - size()};
+    }
+
+    void commit(std::size_t n) noexcept
+    {
+        tail_ += n;
+    }
+
+    void consume(std::size_t n) noexcept
+    {
+        head_ += n;
+        if(head_ == tail_)
+            head_ = tail_ = 0;
+        else if(head_ >= capacity_)
+        {
+            head_ -= capacity_;
+            tail_ -= capacity_;
+        }
+    }
+};
+
+// ============================================================
+// buffered_stream - delimited and exact reads over read_some
+//
+// Wraps a descriptor on an io_uring_context or reactor_context.
+// read_until and read_exactly return a view into the stream's
+// mirrored_buffer instead of copying the bytes out. The view
+// stays valid until the next read on the stream, which is when
+// the bytes it covers are consumed:
+//
+//     auto [ec, line] = co_await stream.read_until("\r\n");
+//
+// When the buffer already holds the answer, the read completes
+// in await_ready with no frame and no system call. Otherwise
+// it awaits a task that reads into all of the free space at
+// once, however much of it the delimiter needs.
+//
+// A line that fills the buffer reports error::buffer_full, as
+// does read_exactly past the capacity. At the end of the stream
+// the read reports error::eof and leaves any partial line in
+// data().
+//
+// Writes are not buffered. write_all gathers the buffers of a
+// sequence, up to iovec_array::max_iov of them, into each
+// writev until all of them are written.
+// ============================================================
+
+// A buffered read, complete at once or after a refill
+class buffered_read
+{
+    io_result<std::string_view> result_;
+    std::optional<task<io_result<std::string_view>>> refill_;
+
+public:
+    explicit buffered_read(io_result<std::string_view> r) noexcept
+        : result_(r)
+    {
+    }
+
+    explicit buffered_read(task<io_result<std::string_view>> t) noexcept
+        : refill_(std::move(t))
+    {
+    }
+
+    bool await_ready() const noexcept { return !refill_; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> h, io_env const* env)
+    {
+        return refill_->await_suspend(h, env);
+    }
+
+    io_result<std::string_view> await_resume()
+    {
+        if(refill_)
+            return refill_->await_resume();
+        return result_;
+    }
+};
+
+static_assert(IoAwaitable<buffered_read>);
+
+// Writes every byte of bufs, or stops at the first error with
+// the count written so far
+template<class Context>
+task<io_result<std::size_t>>
+write_all(Context& ctx, int fd, std::span<const_buffer const> bufs)
+{
+    std::size_t total = 0;
+    std::size_t i = 0;    // first buffer not completely written
+    std::size_t skip = 0; // bytes of bufs[i] already written
+    while(i < bufs.size())
+    {
+        const_buffer batch[detail::iovec_array::max_iov];
+        std::size_t k = 0;
+        for(std::size_t j = i; j < bufs.size() && k < std::size(batch); ++j)
+            batch[k++] = bufs[j];
+        batch[0] = {static_cast<char const*>(batch[0].data) + skip,
+            batch[0].size - skip};
+
+        auto [ec, n] = co_await write_some(ctx, fd, std::span<const_buffer const>(batch, k));
+        total += n;
+        if(ec)
+            co_return {ec, total};
+        n += skip;
+        while(i < bufs.size() && n >= bufs[i].size)
+            n -= bufs[i++].size;
+        skip = n;
+    }
+    co_return {{}, total};
+}
+
+template<class Context>
+class buffered_stream
+{
+    Context& ctx_;
+    int fd_;
+    mirrored_buffer buf_;
+    std::size_t handed_out_ = 0; // covered by the last view
+
+    using view_result = io_result<std::string_view>;
+
+    std::string_view buffered() const noexcept
+    {
+        auto d = buf_.data();
+        return {static_cast<char const*>(d.data), d.size};
+    }
+
+    view_result take(std::size_t n) noexcept
+    {
+        handed_out_ = n;
+        return {{}, buffered().substr(0, n)};
+    }
+
+    // Consumes what the last view covered
+    void release() noexcept
+    {
+        buf_.consume(std::exchange(handed_out_, 0));
+    }
+
+    task<view_result> fill_until(std::string_view delim, std::size_t searched)
+    {
+        for(;;)
+        {
+            if(buf_.size() == buf_.capacity())
+                co_return {error::buffer_full, {}};
+            auto [ec, n] = co_await read_some(ctx_, fd_, buf_.prepare());
+            if(ec)
+                co_return {ec, {}};
+            buf_.commit(n);
+
+            // A match may straddle the old and the new bytes
+            auto d = buffered();
+            auto from = searched < delim.size() ? 0 : searched - delim.size() + 1;
+            auto pos = d.find(delim, from);
+            if(pos != std::string_view::npos)
+                co_return take(pos + delim.size());
+            searched = d.size();
+        }
+    }
+
+    task<view_result> fill_exactly(std::size_t n)
+    {
+        while(buf_.size() < n)
+        {
+            auto [ec, m] = co_await read_some(ctx_, fd_, buf_.prepare());
+            if(ec)
+                co_return {ec, {}};
+            buf_.commit(m);
+        }
+        co_return take(n);
+    }
+
+public:
+    buffered_stream(Context& ctx, int fd, std::size_t capacity = 65536)
+        : ctx_(ctx)
+        , fd_(fd)
+        , buf_(capacity)
+    {
+    }
+
+    int native_handle() const noexcept { return fd_; }
+
+    std::size_t capacity() const noexcept { return buf_.capacity(); }
+
+    // Bytes read from the descriptor but not handed out yet
+    std::string_view data() const noexcept
+    {
+        return buffered().substr(handed_out_);
+    }
+
+    // Reads up to and including the first occurrence of delim,
+    // which must outlive the read
+    buffered_read read_until(std::string_view delim)
+    {
+        release();
+        auto d = buffered();
+        auto pos = d.find(delim);
+        if(pos != std::string_view::npos)
+            return buffered_read(take(pos + delim.size()));
+        return buffered_read(fill_until(delim, d.size()));
+    }
+
+    buffered_read read_exactly(std::size_t n)
+    {
+        release();
+        if(n > buf_.capacity())
+            return buffered_read(view_result{error::buffer_full, {}});
+        if(buf_.size() >= n)
+            return buffered_read(take(n));
+        return buffered_read(fill_exactly(n));
+    }
+
+    task<io_result<std::size_t>> write_all(std::span<const_buffer const> bufs)
+    {
+        return capy::write_all(ctx_, fd_, bufs);
+    }
+};
+
+#endif // defined(__linux__)
+
+// ============================================================
+// Minimal run_sync — synchronous launcher for demonstration
+// ============================================================
+
+template<IoRunnable Task>
+auto run_sync(executor_ref ex, std::stop_token token, Task t)
+{
+    auto h = t.handle();
+    auto& p = h.promise();
+    auto* mr = get_cached_frame_allocator();
+    io_env env{ex, token, mr ? mr : &default_frame_pool()};
+    p.set_continuation(std::noop_coroutine());
+    p.set_environment(&env);
+    t.release();
+
+    // The launcher owns the frame once released
+    struct frame_guard
+    {
+        std::coroutine_handle<> h;
+        ~frame_guard() { h.destroy(); }
+    } guard{h};
+
+    safe_resume(h);
+
+    if(p.exception())
+        std::rethrow_exception(p.exception());
+
+    if constexpr (!std::is_void_v<decltype(t.await_resume())>)
+        return p.result();
+}
+
+template<IoRunnable Task>
+auto run_sync(executor_ref ex, Task t)
+{
+    return run_sync(ex, std::stop_token{}, std::move(t));
+}
+
+// ============================================================
+// run_async - asynchronous launcher
+//
+// Starts a task on an executor and returns at once; this is the
+// launcher for production use. The root io_env, a copy of the
+// executor, the task and the completion handler all live in
+// the frame of one trampoline coroutine, allocated from the
+// cached frame allocator, so a launch costs that allocation
+// and one post.
+//
+// The trampoline awaits the task by symmetric transfer and then
+// calls the handler on the executor: handler(value), or
+// handler() for a void task, when it returns, and
+// handler(std::exception_ptr) when it throws. The value is
+// moved straight from the task's promise.
+//
+// A launch counts as work on the executor until the handler has
+// returned, so run() does not return while root tasks are
+// alive. Without a handler, an exception terminates. Given a
+// frame_arena, the tree allocates from it and the launcher
+// releases it at the end.
+// ============================================================
+
+namespace detail {
+
+struct launcher
+{
+    struct promise_type
+    {
+        continuation start_;
+
+        template<class Ex, class Task, class Handler>
+        static void* operator new(std::size_t size, Ex&, std::stop_token&,
+            Task&, Handler&, std::pmr::memory_resource*& mr, frame_arena*&)
+        {
+            auto total = size + sizeof(std::pmr::memory_resource*);
+            void* raw = mr->allocate(total, alignof(std::max_align_t));
+            std::memcpy(static_cast<char*>(raw) + size, &mr, sizeof(mr));
+            return raw;
+        }
+
+        static void operator delete(void* ptr, std::size_t size) noexcept
+        {
+            std::pmr::memory_resource* mr;
+            std::memcpy(&mr, static_cast<char*>(ptr) + size, sizeof(mr));
+            auto total = size + sizeof(std::pmr::memory_resource*);
+            mr->deallocate(ptr, total, alignof(std::max_align_t));
+        }
+
+        launcher get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+
+        // Only a throwing handler gets here
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+template<class Ex, class Task, class Handler>
+launcher
+launch(Ex ex, std::stop_token token, Task t, Handler handler,
+    std::pmr::memory_resource* mr, frame_arena* arena)
+{
+    // Resumes when the task finishes, leaving its result or
+    // exception in the promise
+    struct start
+    {
+        Task& task;
+        io_env const* env;
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+        {
+            return task.await_suspend(h, env);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    io_env env{ex, std::move(token), arena ? arena : mr};
+    {
+        // Locals, so both are gone before the work is released
+        Task task = std::move(t);
+        Handler h = std::move(handler);
+        co_await start{task, &env};
+
+        auto& p = task.handle().promise();
+        if(auto ep = p.exception())
+            h(std::move(ep));
+        else if constexpr (std::is_void_v<child_result_t<Task>>)
+            h();
+        else
+            h(std::move(p.result()));
+    }
+    if(arena)
+        arena->release();
+    ex.on_work_finished();
+}
+
+struct terminate_on_exception
+{
+    template<class... Args>
+    void operator()(Args&&...) const noexcept {}
+
+    void operator()(std::exception_ptr ep) const noexcept
+    {
+        std::rethrow_exception(ep);
+    }
+};
+
+} // namespace detail
+
+namespace detail {
+
+template<class Ex, class Task, class Handler>
+void
+start_launch(Ex const& ex, std::stop_token token, Task t, Handler handler,
+    frame_arena* arena)
+{
+    auto* mr = get_cached_frame_allocator();
+    if(!mr)
+        mr = &default_frame_pool();
+    auto h = launch(ex, std::move(token), std::move(t),
+        std::move(handler), mr, arena).h;
+    ex.on_work_started();
+    h.promise().start_.h = h;
+    executor_ref(ex).post(h.promise().start_);
+}
+
+} // namespace detail
+
+template<Executor Ex, IoRunnable Task, class Handler>
+void run_async(Ex const& ex, std::stop_token token, Task t, Handler handler)
+{
+    detail::start_launch(ex, std::move(token), std::move(t),
+        std::move(handler), nullptr);
+}
+
+template<Executor Ex, IoRunnable Task, class Handler>
+void run_async(Ex const& ex, Task t, Handler handler)
+{
+    run_async(ex, std::stop_token{}, std::move(t), std::move(handler));
+}
+
+template<Executor Ex, IoRunnable Task>
+void run_async(Ex const& ex, std::stop_token token, Task t)
+{
+    run_async(ex, std::move(token), std::move(t),
+        detail::terminate_on_exception{});
+}
+
+template<Executor Ex, IoRunnable Task>
+void run_async(Ex const& ex, Task t)
+{
+    run_async(ex, std::stop_token{}, std::move(t),
+        detail::terminate_on_exception{});
+}
+
+// The task's children allocate their frames from arena, which
+// is released when the handler has returned. The task's own
+// frame comes from wherever it was allocated; create it with
+// the arena as the cached frame allocator to put it there too.
+// The arena must outlive the launch.
+template<Executor Ex, IoRunnable Task, class Handler>
+void run_async(Ex const& ex, std::stop_token token, frame_arena& arena,
+    Task t, Handler handler)
+{
+    detail::start_launch(ex, std::move(token), std::move(t),
+        std::move(handler), &arena);
+}
+
+template<Executor Ex, IoRunnable Task, class Handler>
+void run_async(Ex const& ex, frame_arena& arena, Task t, Handler handler)
+{
+    run_async(ex, std::stop_token{}, arena, std::move(t), std::move(handler));
+}
+
+template<Executor Ex, IoRunnable Task>
+void run_async(Ex const& ex, frame_arena& arena, Task t)
+{
+    run_async(ex, std::stop_token{}, arena, std::move(t),
+        detail::terminate_on_exception{});
+}
+
+// ============================================================
+// Demo: IoAwaitable protocol in action
+// ============================================================
+
+// A simple IoAwaitable that completes immediately with a value
+struct immediate_value
+{
+    int value_;
+
+    bool await_ready() const noexcept { return true; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<>, io_env const*)
+    {
+        return std::noop_coroutine();
+    }
+
+    int await_resume() const noexcept { return value_; }
+};
+
+static_assert(IoAwaitable<immediate_value>);
+
+// Child task: receives context from parent
+task<int> compute(int x)
+{
+    // Retrieve the propagated environment
+    auto env = co_await this_coro::environment;
+
+    std::printf("  compute(%d): has executor=%s, stop_possible=%s\n",
+        x,
+        env->executor ? "yes" : "no",
+        env->stop_token.stop_possible() ? "yes" : "no");
+
+    // Await an IoAwaitable — context propagates automatically
+    int v = co_await immediate_value{x * 10};
+    co_return v + 1;
+}
+
+// Parent task: composes child tasks
+task<int> parent_task()
+{
+    auto env = co_await this_coro::environment;
+    std::printf("parent_task: has executor=%s\n", env->executor ? "yes" : "no");
+
+    int a = co_await compute(3);
+    int b = co_await compute(7);
+    co_return a + b;
+}
+
+// Void task
+task<> void_task()
+{
+    auto env = co_await this_coro::environment;
+    std::printf("void_task: stop_requested=%s\n",
+        env->stop_token.stop_requested() ? "yes" : "no");
+    co_return;
+}
+
+// Counts the allocations that reach the upstream resource
+struct counting_resource : std::pmr::memory_resource
+{
+    std::size_t allocations = 0;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// Quiet versions of compute/parent_task for repeated runs
+task<int> leaf(int x)
+{
+    co_return co_await immediate_value{x * 10} + 1;
+}
+
+task<int> nested()
+{
+    int a = co_await leaf(3);
+    int b = co_await leaf(7);
+    co_return a + b;
+}
+
+// Counts the frames an inline_task asks for
+struct counting_new_allocator
+{
+    static inline std::size_t frames = 0;
+
+    static void* allocate(std::size_t n)
+    {
+        ++frames;
+        return new_frame_allocator::allocate(n);
+    }
+
+    static void deallocate(void* p, std::size_t n) noexcept
+    {
+        new_frame_allocator::deallocate(p, n);
+    }
+};
+
+template<class T>
+using counted_inline_task = inline_task<T, counting_new_allocator>;
+
+// leaf and nested as inline_task
+counted_inline_task<int> inline_leaf(int x)
+{
+    co_return co_await immediate_value{x * 10} + 1;
+}
+
+counted_inline_task<int> inline_nested()
+{
+    int a = co_await inline_leaf(3);
+    int b = co_await inline_leaf(7);
+    co_return a + b;
+}
+
+// With coro_await_elidable the children live in the parent's
+// frame, the only one allocated, since run_sync does not await
+// the parent; without it each of the three has its own.
+void inline_task_demo(executor_ref ex)
+{
+    counting_new_allocator::frames = 0;
+    int result = run_sync(ex, inline_nested());
+    auto const frames = counting_new_allocator::frames;
+#if CAPY_HAS_CORO_AWAIT_ELIDABLE
+    std::printf("inline_task: result = %d, %zu frame(s) allocated for a "
+        "parent and 2 awaited children, elided\n", result, frames);
+    assert(frames == 1);
+#else
+    std::printf("inline_task: result = %d, %zu frames allocated for a "
+        "parent and 2 awaited children, no coro_await_elidable: "
+        "operator new fallback\n", result, frames);
+    assert(frames == 3);
+#endif
+    assert(result == 102);
+}
+
+void frame_pool_demo(executor_ref ex)
+{
+    counting_resource upstream;
+    std::size_t warm = 0;
+    {
+        recycling_frame_pool pool(&upstream);
+        set_cached_frame_allocator(&pool);
+        for(int i = 0; i < 1000; ++i)
+        {
+            run_sync(ex, nested());
+            if(i == 0)
+                warm = upstream.allocations;
+        }
+        set_cached_frame_allocator(nullptr);
+    }
+    std::printf("upstream allocations: %zu after first run, %zu after 1000\n",
+        warm, upstream.allocations);
+}
+
+// Counts the frames it hands out from the default pool
+struct counting_frame_allocator
+{
+    static inline std::size_t frames = 0;
+
+    static void* allocate(std::size_t n)
+    {
+        ++frames;
+        return pool_frame_allocator::allocate(n);
+    }
+
+    static void deallocate(void* p, std::size_t n) noexcept
+    {
+        pool_frame_allocator::deallocate(p, n);
+    }
+};
+
+task<int, use_frame_allocator<counting_frame_allocator>> static_leaf(int x)
+{
+    co_return co_await immediate_value{x * 10} + 1;
+}
+
+// The static allocator bypasses the cached resource entirely
+void static_allocator_demo(executor_ref ex)
+{
+    counting_resource cached;
+    set_cached_frame_allocator(&cached);
+    int sum = 0;
+    for(int i = 0; i < 100; ++i)
+        sum += run_sync(ex, static_leaf(i));
+    set_cached_frame_allocator(nullptr);
+    std::printf("use_frame_allocator: %zu frames from the allocator, "
+        "%zu from the cached resource, sum = %d\n",
+        counting_frame_allocator::frames, cached.allocations, sum);
+}
+
+task<std::vector<int>> make_values(int n)
+{
+    std::vector<int> v;
+    for(int i = 0; i < n; ++i)
+        v.push_back(co_await leaf(i));
+    co_return v;
+}
+
+task<int, noexcept_tag> count_values(int n)
+{
+    auto v = co_await make_values(n);
+    co_return static_cast<int>(v.size());
+}
+
+void result_slot_demo(executor_ref ex)
+{
+    std::printf("noexcept_tag task counted %d values\n",
+        run_sync(ex, count_values(4)));
+    std::printf("task<int> promise: %zu bytes, %zu with noexcept_tag\n",
+        sizeof(task<int>::promise_type),
+        sizeof(task<int, noexcept_tag>::promise_type));
+}
+
+task<> accumulate(std::atomic<int>& sum, int x)
+{
+    sum.fetch_add(co_await leaf(x), std::memory_order_relaxed);
+}
+
+void thread_pool_run(idle_policy policy)
+{
+    thread_pool pool(4, policy);
+    auto ex = pool.get_executor();
+    io_env env{ex, {}, &default_frame_pool()};
+
+    std::atomic<int> sum{0};
+    std::vector<task<>> tasks;
+    std::vector<continuation> starts(100);
+    for(int i = 0; i < 100; ++i)
+    {
+        tasks.push_back(accumulate(sum, i));
+        auto& p = tasks.back().handle().promise();
+        p.set_continuation(std::noop_coroutine());
+        p.set_environment(&env);
+        starts[i].h = tasks.back().handle();
+        if(i > 0)
+            starts[i - 1].next = &starts[i];
+    }
+    ex.post_batch(&starts[0]);
+    pool.run();
+    auto const s = pool.stats();
+    std::printf("thread_pool(%zu), %u spins and %u yields before parking: "
+        "sum = %d\n", pool.size(), pool.policy().spins, pool.policy().yields,
+        sum.load());
+    std::printf("  idle: %llu spins, %llu yields, %llu parks, %llu wakeups\n",
+        static_cast<unsigned long long>(s.spins),
+        static_cast<unsigned long long>(s.yields),
+        static_cast<unsigned long long>(s.parks),
+        static_cast<unsigned long long>(s.wakeups));
+}
+
+void thread_pool_demo()
+{
+    thread_pool_run({});
+    thread_pool_run({0, 0});
+}
+
+struct fairness
+{
+    int hot_awaits = 0;
+    int longest_gap = 0;
+    int ticks = 0;
+};
+
+// Never suspends: every await completes at once
+task<> hot_loop(fairness& f, int n)
+{
+    for(int i = 0; i < n; ++i)
+        f.hot_awaits += co_await immediate_value{1};
+}
+
+// Measures how long the hot loop keeps the thread between turns
+task<> ticker(fairness& f, int turns)
+{
+    int last = 0;
+    for(int i = 0; i < turns; ++i)
+    {
+        if(f.hot_awaits - last > f.longest_gap)
+            f.longest_gap = f.hot_awaits - last;
+        last = f.hot_awaits;
+        ++f.ticks;
+        co_await this_coro::yield;
+    }
+}
+
+void resume_budget_demo()
+{
+    thread_pool pool(1);
+    fairness f;
+    run_async(pool.get_executor(), hot_loop(f, 10000));
+    run_async(pool.get_executor(), ticker(f, 20));
+    pool.run();
+    std::printf("hot loop: %d awaits; ticker: %d turns, at most %d hot "
+        "awaits apart (budget %d)\n",
+        f.hot_awaits, f.ticks, f.longest_gap, CAPY_RESUME_BUDGET);
+}
+
+task<> produce(channel<int>& ch, int n)
+{
+    for(int i = 1; i <= n; ++i)
+    {
+        auto [ec] = co_await ch.send(i);
+        if(ec)
+            co_return;
+    }
+    ch.close();
+}
+
+// Until the channel is closed and drained
+task<> consume(channel<int>& ch, std::atomic<int>& sum, std::atomic<int>& count)
+{
+    for(;;)
+    {
+        auto [ec, v] = co_await ch.receive();
+        if(ec)
+            co_return;
+        sum += v;
+        ++count;
+    }
+}
+
+// Never sent to: waits until its stop_token is stopped
+task<> receive_until_stopped(channel<int>& ch)
+{
+    auto [ec, v] = co_await ch.receive();
+    std::printf("receive on an idle channel: %s\n", ec.message().c_str());
+}
+
+task<> request_stop(std::stop_source& source)
+{
+    co_await this_coro::yield;
+    source.request_stop();
+}
+
+void channel_pipeline(std::size_t capacity)
+{
+    thread_pool pool(2);
+    channel<int> ch(capacity);
+    std::atomic<int> sum{0};
+    std::atomic<int> count{0};
+    run_async(pool.get_executor(), consume(ch, sum, count));
+    run_async(pool.get_executor(), consume(ch, sum, count));
+    run_async(pool.get_executor(), produce(ch, 1000));
+    pool.run();
+    std::printf("channel(%zu): 1 producer, 2 consumers: %d values, sum = %d\n",
+        capacity, count.load(), sum.load());
+}
+
+void channel_demo()
+{
+    channel_pipeline(8);
+    channel_pipeline(0);
+
+    thread_pool pool(1);
+    channel<int> idle(1);
+    std::stop_source source;
+    run_async(pool.get_executor(), source.get_token(), receive_until_stopped(idle));
+    run_async(pool.get_executor(), request_stop(source));
+    pool.run();
+}
+
+// Queues the coroutine behind the work its executor has waiting
+struct reschedule
+{
+    continuation c;
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        c.h = h;
+        env->executor.post(c);
+        return std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+};
+
+// Every task on the strand shares the counter without a lock
+task<> strand_increments(int& counter, int n)
+{
+    for(int i = 0; i < n; ++i)
+    {
+        ++counter;
+        co_await reschedule{};
+    }
+}
+
+task<> strand_dispatch(strand<thread_pool::executor_type> ex)
+{
+    continuation c{std::noop_coroutine()};
+    std::printf("in the strand: running_in_this_thread = %d, dispatch %s\n",
+        ex.running_in_this_thread(),
+        ex.dispatch(c) == c.h ? "returns the handle" : "queues");
+    co_return;
+}
+
+void strand_demo()
+{
+    thread_pool pool(4);
+    strand_state<thread_pool::executor_type> state(pool.get_executor());
+    auto ex = state.get_executor();
+
+    int counter = 0;
+    for(int i = 0; i < 16; ++i)
+        run_async(ex, strand_increments(counter, 1000));
+    run_async(ex, strand_dispatch(ex));
+    std::printf("outside: running_in_this_thread = %d\n", ex.running_in_this_thread());
+    pool.run();
+    std::printf("strand on thread_pool(%zu): 16 tasks x 1000 increments = %d\n",
+        pool.size(), counter);
+}
+
+// Holds the mutex across a suspension, so the others queue
+task<> locked_increments(async_mutex& m, int& counter, int n)
+{
+    for(int i = 0; i < n; ++i)
+    {
+        auto lock = co_await m.scoped_lock();
+        int const seen = counter;
+        co_await reschedule{};
+        counter = seen + 1;
+    }
+}
+
+struct occupancy
+{
+    std::atomic<int> now{0};
+    std::atomic<int> peak{0};
+};
+
+task<> limited(async_semaphore& s, occupancy& o)
+{
+    co_await s.acquire();
+    int const n = ++o.now;
+    int peak = o.peak.load();
+    while(n > peak && !o.peak.compare_exchange_weak(peak, n))
+        ;
+    co_await this_coro::yield;
+    --o.now;
+    s.release();
+}
+
+task<> wait_for_start(async_event& start, std::atomic<int>& started)
+{
+    co_await start.wait();
+    ++started;
+}
+
+task<> signal_start(async_event& start)
+{
+    co_await reschedule{};
+    start.set();
+}
+
+void sync_demo()
+{
+    thread_pool pool(4);
+    auto ex = pool.get_executor();
+
+    async_mutex m;
+    int counter = 0;
+    for(int i = 0; i < 8; ++i)
+        run_async(ex, locked_increments(m, counter, 100));
+
+    async_semaphore s(2);
+    occupancy o;
+    for(int i = 0; i < 16; ++i)
+        run_async(ex, limited(s, o));
+
+    async_event start;
+    std::atomic<int> started{0};
+    for(int i = 0; i < 4; ++i)
+        run_async(ex, wait_for_start(start, started));
+    run_async(ex, signal_start(start));
+
+    pool.run();
+    std::printf("async_mutex: 8 tasks x 100 increments across a suspension = %d\n",
+        counter);
+    std::printf("async_semaphore(2): 16 tasks, at most %d inside at once\n",
+        o.peak.load());
+    std::printf("async_event: %d of 4 waiting tasks released by set()\n",
+        started.load());
+}
+
+// Counts the posts and batches that reach the executor it wraps
+template<class Ex>
+struct counting_executor
+{
+    struct counts
+    {
+        std::atomic<int> posts{0};
+        std::atomic<int> batches{0};
+        std::atomic<int> batched{0};
+    };
+
+    Ex inner;
+    counts* n;
+
+    decltype(auto) context() const noexcept { return inner.context(); }
+    void on_work_started() const noexcept { inner.on_work_started(); }
+    void on_work_finished() const noexcept { inner.on_work_finished(); }
+
+    std::coroutine_handle<> dispatch(continuation& c) const
+    {
+        return inner.dispatch(c);
+    }
+
+    void post(continuation& c) const
+    {
+        n->posts.fetch_add(1, std::memory_order_relaxed);
+        inner.post(c);
+    }
+
+    void post_batch(continuation* head) const
+    {
+        n->batches.fetch_add(1, std::memory_order_relaxed);
+        for(auto* c = head; c; c = c->next)
+            n->batched.fetch_add(1, std::memory_order_relaxed);
+        inner.post_batch(head);
+    }
+
+    bool operator==(counting_executor const& other) const noexcept
+    {
+        return inner == other.inner && n == other.n;
+    }
+};
+
+task<int> square(int x)
+{
+    co_return x * x;
+}
+
+task<> fan_out(int n, int& sum)
+{
+    std::vector<task<int>> tasks;
+    for(int i = 0; i < n; ++i)
+        tasks.push_back(square(i));
+    for(int v : co_await when_all(tasks))
+        sum += v;
+}
+
+// when_all over a range starts its children with one batch
+void fan_out_demo()
+{
+    thread_pool pool(4);
+    counting_executor<thread_pool::executor_type>::counts n;
+    counting_executor<thread_pool::executor_type> ex{pool.get_executor(), &n};
+    int sum = 0;
+    run_async(ex, fan_out(1000, sum));
+    pool.run();
+    std::printf("when_all over 1000 tasks = %d: %d post, %d post_batch of %d\n",
+        sum, n.posts.load(), n.batches.load(), n.batched.load());
+}
+
+#if CAPY_HAS_EXCEPTIONS
+task<int> failing()
+{
+    co_await immediate_value{0};
+    throw std::runtime_error("no value");
+}
+#endif
+
+// Completion handler for run_async: one overload for the value,
+// one for the exception
+struct report
+{
+    void operator()(int v) const
+    {
+        std::printf("run_async: handler got %d\n", v);
+    }
+
+    void operator()(std::exception_ptr ep) const
+    {
+#if CAPY_HAS_EXCEPTIONS
+        try
+        {
+            std::rethrow_exception(ep);
+        }
+        catch(std::exception const& e)
+        {
+            std::printf("run_async: handler got exception: %s\n", e.what());
+        }
+#else
+        (void)ep;
+#endif
+    }
+};
+
+// Declared to run on the pool, so this_coro::executor yields a
+// known_executor_ref that calls the pool directly
+task<void, use_executor<thread_pool::executor_type>> on_pool()
+{
+    auto ex = co_await this_coro::executor;
+    std::printf("use_executor: direct calls to the pool: %s\n",
+        ex.known() ? "yes" : "no");
+}
+
+// The io_env holds its executor by value, so the executor
+// object lives inside the environment itself
+task<> env_owns_executor()
+{
+    auto env = co_await this_coro::environment;
+    auto const* ex = env->executor.target<thread_pool::executor_type>();
+    auto const* lo = reinterpret_cast<unsigned char const*>(env);
+    auto const* p = reinterpret_cast<unsigned char const*>(ex);
+    std::printf("any_executor: executor stored in io_env: %s\n",
+        p >= lo && p < lo + sizeof(io_env) ? "yes" : "no");
+}
+
+// One connection serving its requests one after another; each
+// request's frames are freed newest first, so the arena reuses
+// the same space for all of them
+task<int> connection(int requests)
+{
+    int sum = 0;
+    for(int i = 0; i < requests; ++i)
+        sum += co_await nested();
+    co_return sum;
+}
+
+void arena_demo()
+{
+    counting_resource upstream;
+    frame_arena arena(1024, &upstream);
+    thread_pool pool(1);
+
+    set_cached_frame_allocator(&arena);
+    auto root = connection(1000);
+    set_cached_frame_allocator(nullptr);
+
+    run_async(pool.get_executor(), arena, std::move(root), report{});
+    pool.run();
+    std::printf("frame_arena: 3001 frames from %zu upstream allocation(s), "
+        "%zu chunk(s) kept after release\n",
+        upstream.allocations, arena.chunk_count());
+    assert(upstream.allocations == 1);
+}
+
+void run_async_demo()
+{
+    thread_pool pool(1);
+    run_async(pool.get_executor(), leaf(4), report{});
+#if CAPY_HAS_EXCEPTIONS
+    run_async(pool.get_executor(), failing(), report{});
+#endif
+    run_async(pool.get_executor(), on_pool());
+    run_async(pool.get_executor(), env_owns_executor());
+    pool.run();
+    arena_demo();
+}
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+
+// Loopback listener on an ephemeral port
+int listen_loopback(sockaddr_in& addr)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if(fd < 0 ||
+        ::bind(fd, reinterpret_cast<sockaddr*>(&addr), len) < 0 ||
+        ::listen(fd, 64) < 0 ||
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+        detail::throw_system_error({errno, std::system_category()}, "listen");
+    return fd;
+}
+
+#endif
+
+#if defined(__linux__)
+
+task<> uring_session(io_uring_context& ctx)
+{
+    sockaddr_in addr;
+    int lfd = listen_loopback(addr);
+    uring_acceptor acceptor(ctx, lfd);
+
+    int cfd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    auto [cec] = co_await connect(ctx, cfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    auto [aec, sfd] = co_await acceptor.next();
+    if(cec || aec)
+    {
+        std::printf("io_uring: connect: %s, accept: %s\n",
+            cec.message().c_str(), aec.message().c_str());
+        co_return;
+    }
+
+    char buf[64];
+    iovec iov{buf, sizeof(buf)};
+    ctx.register_buffers(&iov, 1);
+    ctx.register_files(&sfd, 1);
+
+    (void)co_await write_some(ctx, cfd, const_buffer("hello", 5));
+    auto [ec, n] = co_await read_some_fixed(ctx, fixed_file{0}, {buf, sizeof(buf)}, 0);
+    std::printf("io_uring: accepted fd, read %zu bytes: %.*s\n",
+        n, static_cast<int>(n), buf);
+
+    // The peer going away is an error code, not an exception
+    ::shutdown(sfd, SHUT_WR);
+    auto [eof, m] = co_await read_some(ctx, cfd, {buf, sizeof(buf)});
+    std::printf("io_uring: read after shutdown: %s, %zu bytes\n",
+        eof.message().c_str(), m);
+
+    ctx.unregister_files();
+    ctx.unregister_buffers();
+    ::close(sfd);
+    ::close(cfd);
+    ::close(lfd);
+}
+
+void io_uring_demo()
+{
+    io_uring_context ctx;
+    run_async(ctx.get_executor(), uring_session(ctx));
+    ctx.run();
+}
+
+// Resumes the coroutine on another executor
+struct switch_to
+{
+    executor_ref ex;
+    continuation c;
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h, io_env const*)
+    {
+        c.h = h;
+        ex.post(c);
+        return std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+};
+
+struct shard_tally
+{
+    std::atomic<int> remaining;
+    std::stop_source stop;
+    std::vector<int> accepted; // written on shard 0 only
+    std::size_t reported = 0;
+};
+
+// Accepts until the connections run out, then moves to shard 0
+// to record the count: all of shard 0's writes are from one
+// thread, so the tally needs no lock
+task<> shard_server(sharded_context& shards, int lfd, shard_tally& tally)
+{
+    auto& self = *sharded_context::current();
+    int accepted = 0;
+    {
+        uring_acceptor acceptor(self.context(), lfd);
+        for(;;)
+        {
+            auto [ec, fd] = co_await acceptor.next();
+            if(ec)
+                break;
+            ::close(fd);
+            ++accepted;
+            if(tally.remaining.fetch_sub(1) == 1)
+                tally.stop.request_stop();
+        }
+    }
+    ::close(lfd);
+
+    co_await switch_to{shards[0].get_executor(), {}};
+    tally.accepted[self.index()] = accepted;
+    if(++tally.reported == shards.size())
+        shards.stop();
+}
+
+void sharded_demo()
+{
+    constexpr int connections = 64;
+    sharded_context shards(4);
+    shard_tally tally{{connections}, {}, std::vector<int>(shards.size()), 0};
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int first = open_reuseport_listener(addr);
+
+    std::latch listening(static_cast<std::ptrdiff_t>(shards.size()));
+    std::thread clients([&] {
+        listening.wait();
+        std::vector<int> fds;
+        for(int i = 0; i < connections; ++i)
+        {
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            fds.push_back(fd);
+        }
+        for(int fd : fds)
+            ::close(fd);
+    });
+
+    shards.run([&](sharded_context::shard& s) {
+        auto local = addr;
+        int lfd = s.index() == 0 ? first : open_reuseport_listener(local);
+        run_async(s.get_executor(), tally.stop.get_token(),
+            shard_server(shards, lfd, tally));
+        listening.count_down();
+    });
+    clients.join();
+
+    int total = 0;
+    for(std::size_t i = 0; i < shards.size(); ++i)
+    {
+        std::printf("shard %zu on cpu %d, node %u: accepted %d\n", i,
+            shards[i].cpu(), shards[i].numa_node(), tally.accepted[i]);
+        total += tally.accepted[i];
+    }
+    std::printf("sharded_context(%zu): %d of %d connections\n",
+        shards.size(), total, connections);
+}
+
+// Readers run on a counting executor wrapping the loop's, so
+// their completions are bound for another executor
+void completion_batch_demo()
+{
+    constexpr int readers = 16;
+    io_uring_context ctx;
+    counting_executor<io_uring_context::executor_type>::counts n;
+    counting_executor<io_uring_context::executor_type> ex{ctx.get_executor(), &n};
+
+    int fds[readers][2];
+    int done = 0;
+    for(auto& f : fds)
+        if(::socketpair(AF_UNIX, SOCK_STREAM, 0, f) < 0)
+            return;
+
+    struct session
+    {
+        static task<> read(io_uring_context& ctx, int fd, int& done)
+        {
+            char c;
+            auto [ec, got] = co_await read_some(ctx, fd, {&c, 1});
+            done += got;
+        }
+
+        // Runs once every reader has suspended
+        static task<> write(int (&fds)[readers][2])
+        {
+            co_await reschedule{};
+            for(auto& f : fds)
+                [[maybe_unused]] auto r = ::write(f[1], "x", 1);
+        }
+    };
+    for(auto& f : fds)
+        run_async(ex, session::read(ctx, f[0], done));
+    run_async(ctx.get_executor(), session::write(fds));
+    ctx.run();
+    std::printf("%d reads done: %d post, %d post_batch carrying %d completions\n",
+        done, n.posts.load(), n.batches.load(), n.batched.load());
+    for(auto& f : fds)
+    {
+        ::close(f[0]);
+        ::close(f[1]);
+    }
+}
+
+#endif
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
 
-template<typename T = void>
-struct [[nodiscard]] task
+task<> reactor_session(reactor_context& ctx)
 {
-    struct promise_type
-        : io_awaitable_promise_base<promise_type>
-        , detail::task_return_base<T>
+    sockaddr_in addr;
+    int lfd = listen_loopback(addr);
+    int cfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto [cec] = co_await connect(ctx, cfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    auto [aec, sfd] = co_await accept(ctx, lfd);
+    if(cec || aec)
     {
-        std::exception_ptr ep_;
-
-        std::exception_ptr exception() const noexcept { return ep_; }
+        std::printf("reactor: connect: %s, accept: %s\n",
+            cec.message().c_str(), aec.message().c_str());
+        co_return;
+    }
 
-        task get_return_object()
+    // Lets other queued work run before resuming
+    struct yield_once
+    {
+        continuation c;
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> h, io_env const* env)
         {
-            return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            c.h = h;
+            env->executor.post(c);
+            return std::noop_coroutine();
         }
+        void await_resume() const noexcept {}
+    };
 
-        auto initial_suspend() noexcept
+    // Nothing is buffered yet, so this read suspends until
+    // the write below makes the socket readable
+    struct reader
+    {
+        static task<> run(reactor_context& ctx, int fd)
         {
-            struct awaiter
-            {
-                promise_type* p_;
+            char buf[64];
+            auto [ec, n] = co_await read_some(ctx, fd, {buf, sizeof(buf)});
+            std::printf("reactor: suspended read got %zu bytes: %.*s\n",
+                n, static_cast<int>(n), buf);
+        }
+    };
+    run_async(ctx.get_executor(), reader::run(ctx, sfd));
+    co_await yield_once{};
+    (void)co_await write_some(ctx, cfd, const_buffer("hello", 5));
+    co_await yield_once{};
 
-                bool await_ready() const noexcept { return false; }
+    // Data is already buffered, so this read completes in
+    // await_ready without suspending
+    (void)co_await write_some(ctx, cfd, const_buffer("again", 5));
+    char buf[64];
+    auto [ec, n] = co_await read_some(ctx, sfd, {buf, sizeof(buf)});
+    std::printf("reactor: speculative read got %zu bytes: %.*s\n",
+        n, static_cast<int>(n), buf);
 
-                void await_suspend(std::coroutine_handle<>) const noexcept
-                {
-                }
+    ctx.close(sfd);
+    ctx.close(cfd);
+    ctx.close(lfd);
+}
 
-                void await_resume() const noexcept
-                {
-                    set_cached_frame_allocator(p_->environment()->frame_allocator);
-                }
-            };
-            return awaiter{this};
-        }
+void reactor_demo()
+{
+    reactor_context ctx;
+    run_async(ctx.get_executor(), reactor_session(ctx));
+    ctx.run();
+}
 
-        auto final_suspend() noexcept
-        {
-            struct awaiter
-            {
-                promise_type* p_;
+#endif
 
-                bool await_ready() const noexcept { return false; }
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
 
-                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
-                {
-                    return p_->continuation();
-                }
+// A read that no data will ever satisfy, stopped from another
+// thread through io_env::stop_token
+template<class Context>
+task<> cancelled_read(Context& ctx, int fd, char const* name)
+{
+    char buf[16];
+    auto [ec, n] = co_await read_some(ctx, fd, {buf, sizeof(buf)});
+    std::printf("%s: read stopped: %s after %zu bytes\n",
+        name, ec.message().c_str(), n);
+}
 
-                void await_resume() const noexcept {}
-            };
-            return awaiter{this};
-        }
+template<class Context>
+void cancel_demo(char const* name)
+{
+    Context ctx;
+    std::stop_source source;
 
-        void unhandled_exception()
-        {
-            ep_ = std::current_exception();
-        }
+    int fds[2];
+    if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return;
+    run_async(ctx.get_executor(), source.get_token(),
+        cancelled_read(ctx, fds[0], name));
 
-        template<class Awaitable>
-        struct transform_awaiter
-        {
-            std::decay_t<Awaitable> a_;
-            promise_type* p_;
+    std::thread stopper([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        source.request_stop();
+    });
+    ctx.run();
+    stopper.join();
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
 
-            bool await_ready() noexcept { return a_.await_ready(); }
+long elapsed_ms(timer_wheel::clock::time_point since)
+{
+    return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        timer_wheel::clock::now() - since).count());
+}
 
-            decltype(auto) await_resume()
-            {
-                set_cached_frame_allocator(p_->environment()->frame_allocator);
-                return a_.await_resume();
-            }
+task<io_result<>> sleep_for(std::chrono::milliseconds d)
+{
+    co_return co_await delay(d);
+}
 
-            template<class Promise>
-            auto await_suspend(std::coroutine_handle<Promise> h) noexcept
-            {
-                return a_.await_suspend(h, p_->environment());
-            }
-        };
+template<class Context>
+task<io_result<std::size_t>> read_once(Context& ctx, int fd, mutable_buffer b)
+{
+    co_return co_await read_some(ctx, fd, b);
+}
 
-        template<class Awaitable>
-        auto transform_awaitable(Awaitable&& a)
-        {
-            using A = std::decay_t<Awaitable>;
-            if constexpr (IoAwaitable<A>)
-            {
-                return transform_awaiter<Awaitable>{
-                    std::forward<Awaitable>(a), this};
-            }
-            else
-            {
-                static_assert(sizeof(A) == 0, "requires IoAwaitable");
-            }
-        }
-    };
+// A delay, a delay cut short by a deadline, and a read that no
+// data will satisfy, bounded by a deadline
+template<class Context>
+task<> timer_session(Context& ctx, int fd, char const* name)
+{
+    using namespace std::chrono_literals;
 
-    std::coroutine_handle<promise_type> h_;
+    auto start = timer_wheel::clock::now();
+    (void)co_await delay(20ms);
+    std::printf("%s: delay(20ms) resumed after %ldms\n", name, elapsed_ms(start));
 
-    ~task()
-    {
-        if(h_)
-            h_.destroy();
-    }
+    start = timer_wheel::clock::now();
+    auto [ec] = co_await with_deadline(sleep_for(10s), 15ms);
+    std::printf("%s: delay(10s) with a 15ms deadline: %s after %ldms\n",
+        name, ec.message().c_str(), elapsed_ms(start));
 
-    bool await_ready() const noexcept { return false; }
+    char buf[16];
+    start = timer_wheel::clock::now();
+    auto [rec, n] = co_await with_deadline(read_once(ctx, fd, {buf, sizeof(buf)}), 15ms);
+    std::printf("%s: read with a 15ms deadline: %s after %ldms\n",
+        name, rec.message().c_str(), elapsed_ms(start));
+}
 
-    auto await_resume()
-    {
-        if(h_.promise().ep_)
-            std::rethrow_exception(h_.promise().ep_);
-        if constexpr (! std::is_void_v<T>)
-            return std::move(*h_.promise().result_);
-        else
-            return;
-    }
+task<int> delayed_value(int v, std::chrono::milliseconds d)
+{
+    (void)co_await delay(d);
+    co_return v;
+}
 
-    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont, io_env const* env)
-    {
-        h_.promise().set_continuation(cont);
-        h_.promise().set_environment(env);
-        return h_;
-    }
+// Children run concurrently: two delays together, a read that
+// loses to a delay and is stopped, and a range of tasks
+template<class Context>
+task<> combinator_session(Context& ctx, int fd, char const* name)
+{
+    using namespace std::chrono_literals;
 
-    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+    auto start = timer_wheel::clock::now();
+    auto [a, b] = co_await when_all(delayed_value(1, 20ms), delayed_value(2, 20ms));
+    std::printf("%s: when_all of two 20ms delays = %d after %ldms\n",
+        name, a + b, elapsed_ms(start));
 
-    void release() noexcept { h_ = nullptr; }
+    char buf[16];
+    start = timer_wheel::clock::now();
+    auto [index, result] = co_await when_any(
+        read_once(ctx, fd, {buf, sizeof(buf)}), delayed_value(7, 15ms));
+    std::printf("%s: when_any(read, 15ms delay) won by child %zu with %d after %ldms\n",
+        name, index, std::get<1>(result), elapsed_ms(start));
 
-    task(task const&) = delete;
-    task& operator=(task const&) = delete;
+    std::vector<task<int>> tasks;
+    for(int i = 0; i < 8; ++i)
+        tasks.push_back(delayed_value(i, 10ms));
+    start = timer_wheel::clock::now();
+    int sum = 0;
+    for(int v : co_await when_all(tasks))
+        sum += v;
+    std::printf("%s: when_all over 8 tasks = %d after %ldms\n",
+        name, sum, elapsed_ms(start));
+}
 
-    task(task&& other) noexcept
-        : h_(std::exchange(other.h_, nullptr))
-    {
-    }
+// Runs a session on a fresh context, with a socket pair the
+// session may read from and nobody writes to
+template<class Context, class Session>
+void loop_demo(char const* name, Session session)
+{
+    Context ctx;
 
-    task& operator=(task&& other) noexcept
-    {
-        if(this != &other)
-        {
-            if(h_)
-                h_.destroy();
-            h_ = std::exchange(other.h_, nullptr);
-        }
-        return *this;
-    }
+    int fds[2];
+    if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return;
+    run_async(ctx.get_executor(), session(ctx, fds[0], name));
+    ctx.run();
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
 
-private:
-    explicit task(std::coroutine_handle<promise_type> h)
-        : h_(h)
-    {
-    }
-};
+#endif
 
-// ============================================================
-// Concept satisfaction checks
-// ============================================================
+#if defined(__linux__)
 
-static_assert(IoAwaitable<task<int>>);
-static_assert(IoRunnable<task<int>>);
-static_assert(IoAwaitable<task<>>);
-static_assert(IoRunnable<task<>>);
+char const* numbered_line(char (&buf)[64], int i)
+{
+    std::snprintf(buf, sizeof(buf), "line %03d of the stream, past the wrap\r\n", i);
+    return buf;
+}
 
-// ============================================================
-// inline_executor — trivial synchronous executor for demo
-// ============================================================
+// A request gathered from three buffers in one writev, then
+// enough lines to wrap the reader's one-page buffer twice
+template<class Context>
+task<> buffered_writer(Context& ctx, int fd, char const* name)
+{
+    static constexpr char body[] = "hello, buffered world";
+    char head[64];
+    auto n = std::snprintf(head, sizeof(head),
+        "POST /echo HTTP/1.1\r\nContent-Length: %zu\r\n", sizeof(body) - 1);
+    const_buffer request[] = {
+        {head, static_cast<std::size_t>(n)}, {"\r\n", 2}, {body, sizeof(body) - 1}};
+    auto [ec, total] = co_await write_all(ctx, fd, request);
+    std::printf("%s: wrote a %zu byte request from %zu buffers\n",
+        name, total, std::size(request));
 
-struct inline_context : execution_context {};
+    std::vector<std::string> lines;
+    std::vector<const_buffer> bufs;
+    char line[64];
+    for(int i = 0; i < 200; ++i)
+        lines.emplace_back(numbered_line(line, i));
+    for(auto const& l : lines)
+        bufs.push_back({l.data(), l.size()});
+    auto [lec, written] = co_await write_all(ctx, fd, bufs);
+    std::printf("%s: wrote %zu lines, %zu bytes, %zu buffers per writev\n",
+        name, lines.size(), written, detail::iovec_array::max_iov);
+    ::shutdown(fd, SHUT_WR);
+}
 
-struct inline_executor
+template<class Context>
+task<> buffered_reader(Context& ctx, int fd, char const* name)
 {
-    inline_context* ctx_;
+    buffered_stream<Context> stream(ctx, fd, 4096);
 
-    execution_context& context() const noexcept { return *ctx_; }
-    void on_work_started() const noexcept {}
-    void on_work_finished() const noexcept {}
+    auto [ec, request] = co_await stream.read_until("\r\n");
+    std::printf("%s: request line: %.*s\n",
+        name, static_cast<int>(request.size() - 2), request.data());
 
-    std::coroutine_handle<> dispatch(continuation& c) const
+    std::size_t length = 0;
+    for(;;)
     {
-        return c.h;
+        auto [hec, h] = co_await stream.read_until("\r\n");
+        if(hec || h == "\r\n")
+            break;
+        if(h.starts_with("Content-Length: "))
+            length = std::strtoul(h.data() + 16, nullptr, 10);
     }
+    auto [bec, body] = co_await stream.read_exactly(length);
+    std::printf("%s: body: %.*s\n",
+        name, static_cast<int>(body.size()), body.data());
 
-    void post(continuation& c) const
+    // Lines that cross the end of the ring come back whole
+    int count = 0;
+    bool intact = true;
+    std::size_t bytes = 0;
+    char expected[64];
+    for(;;)
     {
-        safe_resume(c.h);
+        auto [lec, l] = co_await stream.read_until("\r\n");
+        if(lec)
+        {
+            std::printf("%s: %d lines, %zu bytes through a %zu byte buffer, %s; then %s\n",
+                name, count, bytes, stream.capacity(),
+                intact ? "all intact" : "CORRUPTED", lec.message().c_str());
+            break;
+        }
+        intact = intact && l == numbered_line(expected, count);
+        bytes += l.size();
+        ++count;
     }
+}
 
-    bool operator==(inline_executor const& other) const noexcept
-    {
-        return ctx_ == other.ctx_;
-    }
-};
+template<class Context>
+void buffered_demo(char const* name)
+{
+    Context ctx;
 
-static_assert(Executor<inline_executor>);
+    int fds[2];
+    if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return;
+    run_async(ctx.get_executor(), buffered_reader(ctx, fds[0], name));
+    run_async(ctx.get_executor(), buffered_writer(ctx, fds[1], name));
+    ctx.run();
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
 
-// ============================================================
-// Minimal run_sync — synchronous launcher for demonstration
-// ============================================================
+#endif
 
-template<IoRunnable Task>
-auto run_sync(executor_ref ex, std::stop_token token, Task t)
-{
-    auto h = t.handle();
-    auto& p = h.promise();
-    io_env env{ex, token};
-    p.set_continuation(std::noop_coroutine());
-    p.set_environment(&env);
-    t.release();
-    h.resume();
+#if CAPY_TRACE
 
-    if(p.exception())
-        std::rethrow_exception(p.exception());
+task<int> traced_leaf(int x)
+{
+    co_await reschedule{};
+    co_return x;
+}
 
-    if constexpr (!std::is_void_v<decltype(t.await_resume())>)
-        return p.result();
+task<> traced_root(std::atomic<int>& sum)
+{
+    for(int i = 0; i < 4; ++i)
+        sum.fetch_add(co_await traced_leaf(i), std::memory_order_relaxed);
 }
 
-template<IoRunnable Task>
-auto run_sync(executor_ref ex, Task t)
+// Writes the trace of a few tasks hopping across a pool to
+// capy-trace.json, for Perfetto or chrome://tracing
+void trace_demo()
 {
-    return run_sync(ex, std::stop_token{}, std::move(t));
+    thread_pool pool(2);
+    std::atomic<int> sum{0};
+    for(int i = 0; i < 3; ++i)
+        run_async(pool.get_executor(), traced_root(sum));
+    pool.run();
+
+    auto* out = std::fopen("capy-trace.json", "w");
+    if(!out)
+        return;
+    async_trace::dump(out);
+    auto const bytes = std::ftell(out);
+    std::fclose(out);
+    std::printf("sum = %d, %ld bytes of trace in capy-trace.json\n",
+        sum.load(), bytes);
 }
 
-// ============================================================
-// Demo: IoAwaitable protocol in action
-// ============================================================
+#endif
 
-// A simple IoAwaitable that completes immediately with a value
-struct immediate_value
+#if CAPY_ASYNC_STACK
+
+// Holds the coroutine until it is resumed by hand, like an
+// operation that never completes
+struct held
 {
-    int value_;
+    std::coroutine_handle<>* slot;
 
-    bool await_ready() const noexcept { return true; }
+    bool await_ready() const noexcept { return false; }
 
-    std::coroutine_handle<> await_suspend(std::coroutine_handle<>, io_env const*)
+    void await_suspend(std::coroutine_handle<> h, io_env const*) noexcept
     {
-        return std::noop_coroutine();
+        *slot = h;
     }
 
-    int await_resume() const noexcept { return value_; }
+    void await_resume() const noexcept {}
 };
 
-static_assert(IoAwaitable<immediate_value>);
-
-// Child task: receives context from parent
-task<int> compute(int x)
+task<int> stack_leaf(std::coroutine_handle<>& slot)
 {
-    // Retrieve the propagated environment
-    auto env = co_await this_coro::environment;
-
-    std::printf("  compute(%d): has executor=%s, stop_possible=%s\n",
-        x,
-        env->executor ? "yes" : "no",
-        env->stop_token.stop_possible() ? "yes" : "no");
+    co_await held{&slot};
 
-    // Await an IoAwaitable — context propagates automatically
-    int v = co_await immediate_value{x * 10};
-    co_return v + 1;
+    // What a profiler's signal handler would sample here
+    async_frame const* frames[8];
+    auto const n = async_stack::walk(frames, 8);
+    std::printf("on-CPU stack, innermost first:\n");
+    for(std::size_t i = 0; i < n; ++i)
+        std::printf("  %s\n", frames[i]->function);
+    co_return 1;
 }
 
-// Parent task: composes child tasks
-task<int> parent_task()
+task<int> stack_middle(std::coroutine_handle<>& slot)
 {
-    auto env = co_await this_coro::environment;
-    std::printf("parent_task: has executor=%s\n", env->executor ? "yes" : "no");
+    co_return co_await stack_leaf(slot) + 1;
+}
 
-    int a = co_await compute(3);
-    int b = co_await compute(7);
-    co_return a + b;
+task<> stack_root(std::coroutine_handle<>& slot, int& out)
+{
+    out = co_await stack_middle(slot);
 }
 
-// Void task
-task<> void_task()
+void async_stack_demo(executor_ref ex)
 {
-    auto env = co_await this_coro::environment;
-    std::printf("void_task: stop_requested=%s\n",
-        env->stop_token.stop_requested() ? "yes" : "no");
-    co_return;
+    std::coroutine_handle<> slot;
+    int out = 0;
+    run_async(ex, stack_root(slot, out));
+    async_stack::dump(stdout);
+    slot.resume();
+    std::printf("out = %d, roots left: ", out);
+    std::size_t roots = 0;
+    async_stack::for_each_root([&](async_frame const&) { ++roots; });
+    std::printf("%zu\n", roots);
 }
 
+#endif
+
 int main()
 {
     inline_context ctx;
@@ -723,11 +9796,98 @@ int main()
     source.request_stop();
     run_sync(ex, source.get_token(), void_task());
 
+    std::printf("\n--- Recycling frame pool ---\n");
+    frame_pool_demo(ex);
+    static_allocator_demo(ex);
+    inline_task_demo(ex);
+
+    std::printf("\n--- Task result slot ---\n");
+    result_slot_demo(ex);
+
+    std::printf("\n--- Work-stealing thread_pool ---\n");
+    thread_pool_demo();
+
+    std::printf("\n--- Resume budget ---\n");
+    resume_budget_demo();
+
+    std::printf("\n--- channel ---\n");
+    channel_demo();
+
+    std::printf("\n--- strand ---\n");
+    strand_demo();
+
+    std::printf("\n--- async_mutex / async_semaphore / async_event ---\n");
+    sync_demo();
+
+    std::printf("\n--- post_batch ---\n");
+    fan_out_demo();
+#if defined(__linux__)
+    completion_batch_demo();
+#endif
+
+    std::printf("\n--- run_async ---\n");
+    run_async_demo();
+
+#if defined(__linux__)
+    std::printf("\n--- io_uring_context ---\n");
+    io_uring_demo();
+
+    std::printf("\n--- sharded_context ---\n");
+    sharded_demo();
+#endif
+
+#if defined(CAPY_REACTOR_EPOLL) || defined(CAPY_REACTOR_KQUEUE)
+    std::printf("\n--- reactor_context ---\n");
+    reactor_demo();
+
+    std::printf("\n--- Cancellation through stop_token ---\n");
+#if defined(__linux__)
+    cancel_demo<io_uring_context>("io_uring");
+#endif
+    cancel_demo<reactor_context>("reactor");
+
+    std::printf("\n--- Timers ---\n");
+#if defined(__linux__)
+    loop_demo<io_uring_context>("io_uring", timer_session<io_uring_context>);
+#endif
+    loop_demo<reactor_context>("reactor", timer_session<reactor_context>);
+
+    std::printf("\n--- when_all / when_any ---\n");
+#if defined(__linux__)
+    loop_demo<io_uring_context>("io_uring", combinator_session<io_uring_context>);
+#endif
+    loop_demo<reactor_context>("reactor", combinator_session<reactor_context>);
+#endif
+
+#if defined(__linux__)
+    std::printf("\n--- buffered_stream ---\n");
+    buffered_demo<io_uring_context>("io_uring");
+    buffered_demo<reactor_context>("reactor");
+#endif
+
+#if CAPY_FRAME_TELEMETRY
+    std::printf("\n--- Frame telemetry ---\n");
+    frame_telemetry::dump(stdout);
+#endif
+
+#if CAPY_TRACE
+    std::printf("\n--- Async trace ---\n");
+    trace_demo();
+#endif
+
+#if CAPY_ASYNC_STACK
+    std::printf("\n--- Async stack ---\n");
+    async_stack_demo(ex);
+#endif
+
     std::printf("\nAll concept checks passed. Protocol works.\n");
     return 0;
 }
 
 } // namespace capy
 
-// Trampoline main
+// Trampoline main. Define CAPY_NO_DEMO_MAIN to include this
+// file from another program, such as the benchmarks.
+#ifndef CAPY_NO_DEMO_MAIN
 int main() { return capy::main(); }
+#endif